@@ -15,31 +15,271 @@
  * SOFTWARE.
  */
 
+#define _GNU_SOURCE  //fallocate
+#include <dirent.h>
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <libgen.h>
 #include <limits.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
+#include <linux/falloc.h>
+#include <linux/futex.h>
 
 #include "serializer.h"
 #include "ctdb.h"
 
+///////////////////////////////////////////////////////////////////////////////
+// STATS
+///////////////////////////////////////////////////////////////////////////////
+static __thread int stats_slot = -1;
+static int stats_slot_seq = 0;
+
+static inline struct ctdb_stats *thread_stats(struct ctdb *db) {
+    if (0 > stats_slot) {
+        stats_slot = __atomic_fetch_add(&stats_slot_seq, 1, __ATOMIC_RELAXED) % CTDB_STATS_SLOTS;
+    }
+    return &(db->stats_slots[stats_slot].stats);
+}
+
+#define STATS_ADD(db, field, num) \
+    ({ __atomic_fetch_add(&(thread_stats(db)->field), (num), __ATOMIC_RELAXED); })
+
+///////////////////////////////////////////////////////////////////////////////
+// TRACE
+///////////////////////////////////////////////////////////////////////////////
+#ifdef CTDB_TRACING
+struct trace_span{
+    int op;
+    uint32_t key_len;
+    uint32_t depth;
+    uint64_t bytes;
+    uint64_t start_ns;
+    struct trace_span *outer;  //the span this one is nested in (an fsync inside a commit)
+};
+static __thread struct trace_span *trace_current = NULL;
+
+static inline uint64_t trace_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline int histogram_index(uint64_t value) {
+    if (value < (1 << CTDB_HIST_SUB_BITS)) return value;
+    int shift = 63 - __builtin_clzll(value) - CTDB_HIST_SUB_BITS;
+    return ((shift + 1) << CTDB_HIST_SUB_BITS) + ((value >> shift) & ((1 << CTDB_HIST_SUB_BITS) - 1));
+}
+
+static inline void trace_begin(struct ctdb *db, struct trace_span *span, int op, uint32_t key_len) {
+    *span = (struct trace_span){.op = op, .key_len = key_len, .depth = 0, .bytes = 0, .start_ns = 0, .outer = trace_current};
+    trace_current = span;
+    if (NULL == db) return;
+    if (NULL != db->trace_hook) db->trace_hook(db->trace_arg, op, CTDB_TRACE_BEGIN, key_len, 0, 0);
+    span->start_ns = trace_now_ns();
+}
+
+static inline void trace_end(struct ctdb *db, struct trace_span *span) {
+    if (span != trace_current) return;  //already ended
+    trace_current = span->outer;
+    if (NULL != trace_current) {  //the outer operation touched these bytes too
+        trace_current->depth += span->depth;
+        trace_current->bytes += span->bytes;
+    }
+    if (NULL == db) return;
+    uint64_t elapsed_ns = trace_now_ns() - span->start_ns;
+    struct ctdb_histogram *hist = db->histograms;
+    if (NULL != hist) {
+        hist += span->op;
+        __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&hist->sum_ns, elapsed_ns, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&hist->buckets[histogram_index(elapsed_ns)], 1, __ATOMIC_RELAXED);
+        uint64_t max_ns = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+        while (max_ns < elapsed_ns &&
+            !__atomic_compare_exchange_n(&hist->max_ns, &max_ns, elapsed_ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+    if (NULL != db->trace_hook) db->trace_hook(db->trace_arg, span->op, CTDB_TRACE_END, span->key_len, span->depth, span->bytes);
+}
+
+#define TRACE_BEGIN(db, op, key_len) struct trace_span __trace_span; trace_begin((db), &__trace_span, (op), (key_len))
+#define TRACE_END(db) trace_end((db), &__trace_span)
+#define TRACE_DEPTH(num) ({ if (NULL != trace_current) trace_current->depth += (num); })
+#define TRACE_BYTES(num) ({ if (NULL != trace_current) trace_current->bytes += (num); })
+#else
+#define TRACE_BEGIN(db, op, key_len)
+#define TRACE_END(db)
+#define TRACE_DEPTH(num)
+#define TRACE_BYTES(num)
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// FILE
+///////////////////////////////////////////////////////////////////////////////
+#define SEGMENT_OF(pos) ((uint32_t)((pos) >> CTDB_SEGMENT_SHIFT))
+#define SEGMENT_OFFSET(pos) ((pos) & ((1LL << CTDB_SEGMENT_SHIFT) - 1))
+#define SEGMENT_POS(segment, offset) (((off_t)(segment) << CTDB_SEGMENT_SHIFT) | (offset))
+
+//'is_create' starts the segment over, otherwise it must exist
+static int open_segment(struct ctdb *db, uint32_t segment, uint8_t is_create) {
+    char path[PATH_MAX];
+    if (CTDB_MAX_SEGMENTS <= segment) return -1;
+    if (sizeof(path) <= snprintf(path, sizeof(path), CTDB_SEGMENT_FMT, db->path, segment)) return -1;
+    STATS_ADD(db, syscalls, 1);
+    int fd = open(path, is_create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0666);
+    if (0 > fd) return -1;
+    int opened = -1;
+    if (!__atomic_compare_exchange_n(&db->segment_fds[segment], &opened, fd, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        close(fd);  //another thread was first
+        return opened;
+    }
+    return fd;
+}
+
+//the file and the offset in it of a position
+static inline int segment_fd(struct ctdb *db, off_t pos, off_t *offset) {
+    *offset = pos;
+    if (0 == db->segment_size) return db->fd;
+    uint32_t segment = SEGMENT_OF(pos);
+    *offset = SEGMENT_OFFSET(pos);
+    if (0 == segment) return db->fd;
+    if (CTDB_MAX_SEGMENTS <= segment) return -1;
+    int fd = __atomic_load_n(&db->segment_fds[segment], __ATOMIC_ACQUIRE);
+    return 0 <= fd ? fd : open_segment(db, segment, 0);
+}
+
+static inline ssize_t read_at(struct ctdb *db, off_t pos, void *buf, size_t len) {
+    off_t offset = 0;
+    int fd = segment_fd(db, pos, &offset);
+    if (0 > fd) return -1;
+    ssize_t res = pread(fd, buf, len, offset);
+    STATS_ADD(db, syscalls, 1);
+    if (0 < res) {
+        STATS_ADD(db, bytes_read, res);
+        TRACE_BYTES(res);
+    }
+    return res;
+}
+
+static inline ssize_t write_at(struct ctdb *db, off_t pos, void *buf, size_t len) {
+    off_t offset = 0;
+    int fd = segment_fd(db, pos, &offset);
+    if (0 > fd) return -1;
+    ssize_t res = pwrite(fd, buf, len, offset);
+    STATS_ADD(db, syscalls, 1);
+    if (0 < res) {
+        STATS_ADD(db, bytes_written, res);
+        TRACE_BYTES(res);
+    }
+    return res;
+}
+
+//the end of the tail segment, kept by the writer instead of asking the file every time
+static inline off_t file_end(struct ctdb *db) {
+    return SEGMENT_POS(db->tail_segment, db->end_pos);
+}
+
+//the blocks are allocated a chunk at a time ahead of the appends, the file size stays at the end of the data
+static inline void preallocate(struct ctdb *db, off_t pos, uint32_t len) {
+    if (0 >= db->prealloc_size || SEGMENT_OFFSET(pos) + len <= db->alloc_end) return;
+    off_t offset = 0;
+    int fd = segment_fd(db, pos, &offset);
+    if (db->alloc_end < offset) db->alloc_end = offset;
+    off_t alloc_len = (offset + len - db->alloc_end + db->prealloc_size - 1) / db->prealloc_size * db->prealloc_size;
+    if (0 <= fd) {
+        STATS_ADD(db, syscalls, 1);
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, db->alloc_end, alloc_len);  //a file system without it just allocates on write
+    }
+    db->alloc_end += alloc_len;
+}
+
+static void close_segments(struct ctdb *db) {
+    int i = 1;  //segment 0 is 'fd'
+    for (; i < CTDB_MAX_SEGMENTS; i++) {
+        if (0 <= db->segment_fds[i]) close(db->segment_fds[i]);
+        db->segment_fds[i] = -1;
+    }
+}
+
+//the data and the size, the timestamps are not worth a journal commit
+static inline int sync_fd(struct ctdb *db, int fd) {
+    STATS_ADD(db, syscalls, 1);
+    STATS_ADD(db, fsyncs, 1);
+    TRACE_BEGIN(db, CTDB_OP_FSYNC, 0);
+    int res = fdatasync(fd);
+    TRACE_END(db);
+    return -1 == res ? CTDB_ERR : CTDB_OK;
+}
+
+static inline int sync_file(struct ctdb *db) {
+    off_t offset = 0;
+    int fd = segment_fd(db, SEGMENT_POS(db->tail_segment, 0), &offset);  //the segments before it were synced as they rolled over
+    return sync_fd(db, fd);
+}
+
+static int sync_dir(struct ctdb *db) {
+    char dir[PATH_MAX];
+    if (sizeof(dir) <= snprintf(dir, sizeof(dir), "%s", db->path)) return CTDB_ERR;
+    int fd = open(dirname(dir), O_RDONLY | O_DIRECTORY);
+    if (0 > fd) return CTDB_ERR;
+    STATS_ADD(db, syscalls, 2);
+    int res = fsync(fd);
+    close(fd);
+    return -1 == res ? CTDB_ERR : CTDB_OK;
+}
+
+//the compactor unlinks the segments it empties, so the ids have gaps: the tail is the highest one in the directory
+static int find_segments(struct ctdb *db) {
+    char dir[PATH_MAX], base[PATH_MAX];
+    if (sizeof(dir) <= snprintf(dir, sizeof(dir), "%s", db->path) || sizeof(base) <= snprintf(base, sizeof(base), "%s", db->path)) return CTDB_ERR;
+    char *name = basename(base);
+    size_t name_len = strlen(name);
+    DIR *dirp = opendir(dirname(dir));
+    if (NULL == dirp) return CTDB_ERR;
+    STATS_ADD(db, syscalls, 1);
+    uint32_t tail = 0, segment = 0;
+    struct dirent *entry = NULL;
+    while (NULL != (entry = readdir(dirp))) {
+        unsigned int id = 0;
+        int id_end = 0;
+        if (0 != strncmp(entry->d_name, name, name_len)) continue;
+        if (1 != sscanf(entry->d_name + name_len, "-seg-%u%n", &id, &id_end) || '\0' != entry->d_name[name_len + id_end]) continue;
+        if (CTDB_MAX_SEGMENTS > id && tail < id) tail = id;
+    }
+    closedir(dirp);
+    for (; segment < tail; segment++) {  //what the tail discovery of load_footer adds up otherwise
+        off_t offset = 0;
+        int fd = segment_fd(db, SEGMENT_POS(segment, 0), &offset);
+        if (0 > fd) continue;  //unlinked
+        off_t size = lseek(fd, 0, SEEK_END);
+        STATS_ADD(db, syscalls, 1);
+        if (0 < size) db->sealed_bytes += size;
+    }
+    db->tail_segment = tail;
+    return CTDB_OK;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // SERIALIZER
 ///////////////////////////////////////////////////////////////////////////////
-static int check_header(int fd) {
+static int check_header(struct ctdb *db) {
     char magic_str[CTDB_MAGIC_LEN + 1] = {[0 ... CTDB_MAGIC_LEN] = 0};
     int version_num = -1;
     struct serializer ser = SERIALIZER_INIT(CTDB_HEADER_SIZE);
-    if (-1 == lseek(fd, 0, SEEK_SET)) return CTDB_ERR;  //get back to the beginning
-    if (CTDB_HEADER_SIZE != read(fd, ser.buf, ser.buf_len)) return CTDB_ERR;
+    if (CTDB_HEADER_SIZE != read_at(db, 0, ser.buf, ser.buf_len)) return CTDB_ERR;
     if (SERIALIZER_OK != SERIALIZER_READ_STR(ser, magic_str, CTDB_MAGIC_LEN) ||
-        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, version_num, uint32_t)) {
+        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, version_num, uint32_t) ||
+        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, db->segment_size, int64_t)) {
         return CTDB_ERR;
     }
     if (0 == strncmp(magic_str, CTDB_MAGIC_STR, CTDB_MAGIC_LEN) && CTDB_VERSION_NUM == version_num)
@@ -47,188 +287,652 @@ static int check_header(int fd) {
     return CTDB_ERR;
 }
 
-static int dump_header(int fd) {
+//every segment starts with the header, so a footer is never found before 'CTDB_HEADER_SIZE'
+static int dump_header(struct ctdb *db, uint32_t segment) {
     struct serializer ser = SERIALIZER_INIT(CTDB_HEADER_SIZE);
     if (SERIALIZER_OK != SERIALIZER_WRITE_STR(ser, CTDB_MAGIC_STR, CTDB_MAGIC_LEN) ||
-        SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, CTDB_VERSION_NUM, uint32_t)) {
+        SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, CTDB_VERSION_NUM, uint32_t) ||
+        SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, db->segment_size, int64_t)) {
         return CTDB_ERR;
     }
-    if (-1 == lseek(fd, 0, SEEK_SET)) return CTDB_ERR;  //get back to the beginning
-    if (CTDB_HEADER_SIZE != write(fd, ser.buf, ser.buf_len)) return CTDB_ERR;
+    if (CTDB_HEADER_SIZE != write_at(db, SEGMENT_POS(segment, 0), ser.buf, ser.buf_len)) return CTDB_ERR;  //at the beginning
+    return CTDB_OK;
+}
+
+//the tail is complete, it is synced once here instead of by every later commit
+static int roll_segment(struct ctdb *db) {
+    uint32_t segment = db->tail_segment + 1;
+    if (CTDB_MAX_SEGMENTS <= segment) return CTDB_ERR;  //out of ids, time for a vacuum into a new file
+    off_t offset = 0;
+    int fd = segment_fd(db, file_end(db), &offset);
+    if (0 > fd) return CTDB_ERR;
+    if (db->end_pos < db->alloc_end) {  //the rest of the chunk is never written now
+        STATS_ADD(db, syscalls, 1);
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, db->end_pos, db->alloc_end - db->end_pos);
+    }
+    if (CTDB_OK != sync_file(db)) return CTDB_ERR;
+    if (0 > open_segment(db, segment, 1)) return CTDB_ERR;  //a leftover of a writer that died is started over
+    if (CTDB_OK != dump_header(db, segment)) return CTDB_ERR;
+    if (CTDB_OK != sync_dir(db)) return CTDB_ERR;
+    db->sealed_bytes += db->end_pos;
+    db->tail_segment = segment;
+    db->end_pos = CTDB_HEADER_SIZE;
+    db->alloc_end = 0;
     return CTDB_OK;
 }
 
+//where 'len' bytes go, a segment that would grow past its size rolls over (unless it has nothing but the header)
+static inline off_t append_pos(struct ctdb *db, uint32_t len) {
+    off_t pos = file_end(db);
+    if (0 < db->segment_size &&
+        SEGMENT_OFFSET(pos) + len > db->segment_size && CTDB_HEADER_SIZE < SEGMENT_OFFSET(pos)) {
+        if (CTDB_OK != roll_segment(db)) return -1;
+        pos = file_end(db);
+    }
+    preallocate(db, pos, len);
+    return pos;
+}
+
+static inline off_t append_to_end(struct ctdb *db, char *buf, uint32_t buf_len){
+    off_t pos = append_pos(db, buf_len);
+    if (-1 == pos) goto err;
+    if (buf_len != write_at(db, pos, buf, buf_len)) goto err;
+    db->end_pos = SEGMENT_OFFSET(pos) + buf_len;
+    db->appended_bytes += buf_len;
+    return pos;
+
+err:
+    return -1;
+}
+
+//'len' bytes from the offset of 'in_fd', copied in the kernel between files, read and written in chunks otherwise (pipes, sockets)
+static off_t append_from_fd(struct ctdb *db, int in_fd, uint32_t len) {
+    char *buf = NULL;
+    off_t pos = append_pos(db, len);
+    if (-1 == pos) goto err;
+    uint32_t done = 0;
+    uint8_t is_copy_range = 1;
+    while (done < len) {
+        ssize_t res = -1;
+        if (is_copy_range) {
+            off_t offset = 0;
+            int out_fd = segment_fd(db, pos + done, &offset);
+            if (0 > out_fd) goto err;
+            res = copy_file_range(in_fd, NULL, out_fd, &offset, len - done, 0);
+            STATS_ADD(db, syscalls, 1);
+            if (0 > res && (EINVAL == errno || EXDEV == errno || ENOSYS == errno || EBADF == errno || EOPNOTSUPP == errno)) {
+                is_copy_range = 0;  //not two regular files, nothing was copied
+                continue;
+            }
+        } else {
+            if (NULL == buf && NULL == (buf = malloc(CTDB_STREAM_CHUNK_SIZE))) goto err;
+            res = read(in_fd, buf, len - done < CTDB_STREAM_CHUNK_SIZE ? len - done : CTDB_STREAM_CHUNK_SIZE);
+            STATS_ADD(db, syscalls, 1);
+            if (0 < res && res != write_at(db, pos + done, buf, res)) goto err;
+        }
+        if (0 > res && EINTR == errno) continue;
+        if (0 >= res) goto err;  //the source ended early
+        if (is_copy_range) {
+            STATS_ADD(db, bytes_written, res);
+            TRACE_BYTES(res);
+        }
+        done += res;
+    }
+    db->end_pos = SEGMENT_OFFSET(pos) + len;
+    db->appended_bytes += len;
+    free(buf);
+    return pos;
+
+err:
+    free(buf);
+    return -1;
+}
+
 #define FOOTER_ALIGNED(num) ({ ((num) + CTDB_FOOTER_ALIGNED_BASE - 1) & ~(CTDB_FOOTER_ALIGNED_BASE - 1); });
 
-static int load_footer(int fd, struct ctdb_footer *footer) {
-    off_t file_size = lseek(fd, -CTDB_FOOTER_ALIGNED_BASE, SEEK_END);
-    off_t flag_aligned_pos = FOOTER_ALIGNED(file_size);  //find the right place for the 'transaction flag'
-    while (flag_aligned_pos >= CTDB_HEADER_SIZE) {
-        uint64_t cksum_1 = 1, cksum_2 = 2;
-        struct ctdb_footer footer_in_file = {.tran_count = 0, .del_count = 0, .root_pos = 0};
-        struct serializer ser = SERIALIZER_INIT(CTDB_FOOTER_SIZE);
-        if (-1 == lseek(fd, flag_aligned_pos, SEEK_SET)) goto retry;
-        if (CTDB_FOOTER_SIZE != read(fd, ser.buf, ser.buf_len)) goto retry;
-        if (SERIALIZER_OK != SERIALIZER_READ_NUM(ser, cksum_1, uint64_t) ||
-            SERIALIZER_OK != SERIALIZER_READ_NUM(ser, footer_in_file.tran_count, uint64_t) ||
-            SERIALIZER_OK != SERIALIZER_READ_NUM(ser, footer_in_file.del_count, uint64_t) ||
-            SERIALIZER_OK != SERIALIZER_READ_NUM(ser, footer_in_file.root_pos, int64_t) ||
-            SERIALIZER_OK != SERIALIZER_READ_NUM(ser, cksum_2, uint64_t)) {
-            goto retry;
-        }
-        //check the mark, make sure the data is correct (CheckSum)
-        if (0 < cksum_1 && cksum_1 == cksum_2 && 
-            file_size > footer_in_file.root_pos &&
-            0 == 1 + cksum_2 + (footer_in_file.tran_count + footer_in_file.del_count + footer_in_file.root_pos)) {
-            *footer = footer_in_file;
-            return CTDB_OK;
+//'file_size' bounds the positions a valid footer may point to
+static int parse_footer(struct ctdb *db, off_t footer_pos, off_t file_size, struct ctdb_footer *footer) {
+    uint64_t cksum_1 = 1, cksum_2 = 2;
+    struct ctdb_footer footer_in_file = {.tran_count = 0, .del_count = 0, .root_pos = 0, .prev_pos = 0, .live_bytes = 0, .pos = footer_pos};
+    struct serializer ser = SERIALIZER_INIT(CTDB_FOOTER_SIZE);
+    if (CTDB_FOOTER_SIZE != read_at(db, footer_pos, ser.buf, ser.buf_len)) return CTDB_ERR;
+    if (SERIALIZER_OK != SERIALIZER_READ_NUM(ser, cksum_1, uint64_t) ||
+        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, footer_in_file.tran_count, uint64_t) ||
+        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, footer_in_file.del_count, uint64_t) ||
+        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, footer_in_file.root_pos, int64_t) ||
+        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, footer_in_file.prev_pos, int64_t) ||
+        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, footer_in_file.live_bytes, uint64_t) ||
+        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, footer_in_file.filter_pos, int64_t) ||
+        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, footer_in_file.delta_pos, int64_t) ||
+        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, footer_in_file.log_pos, int64_t) ||
+        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, cksum_2, uint64_t)) {
+        return CTDB_ERR;
+    }
+    //check the mark, make sure the data is correct (CheckSum)
+    if (0 < cksum_1 && cksum_1 == cksum_2 && 
+        file_size > footer_in_file.root_pos && footer_pos > footer_in_file.prev_pos &&
+        footer_pos > footer_in_file.filter_pos && footer_pos > footer_in_file.delta_pos && footer_pos > footer_in_file.log_pos &&
+        0 == 1 + cksum_2 + (footer_in_file.tran_count + footer_in_file.del_count + footer_in_file.root_pos + footer_in_file.prev_pos + 
+                            footer_in_file.live_bytes + footer_in_file.filter_pos + footer_in_file.delta_pos + footer_in_file.log_pos)) {
+        *footer = footer_in_file;
+        return CTDB_OK;
+    }
+    return CTDB_ERR;
+}
+
+//segmented, the tail is found first: other processes may have rolled over since
+static int load_footer(struct ctdb *db, struct ctdb_footer *footer) {
+    off_t offset = 0;
+    while (0 < db->segment_size && 0 <= segment_fd(db, SEGMENT_POS(db->tail_segment + 1, 0), &offset)) {
+        int fd = segment_fd(db, SEGMENT_POS(db->tail_segment, 0), &offset);
+        off_t tail_end = 0 <= fd ? lseek(fd, 0, SEEK_END) : -1;
+        STATS_ADD(db, syscalls, 1);
+        if (0 < tail_end) db->sealed_bytes += tail_end;
+        db->tail_segment += 1;
+    }
+    int tail_fd = segment_fd(db, SEGMENT_POS(db->tail_segment, 0), &offset);
+    db->end_pos = 0 <= tail_fd ? lseek(tail_fd, 0, SEEK_END) : -1;  //whatever a writer that died left is skipped
+    STATS_ADD(db, syscalls, 1);
+    if (CTDB_HEADER_SIZE > db->end_pos) return CTDB_ERR;
+    uint32_t segment = db->tail_segment + 1;
+    while (0 < segment--) {  //a tail without a footer yet, the writer died right after the roll over
+        int fd = segment_fd(db, SEGMENT_POS(segment, 0), &offset);
+        if (0 > fd) continue;  //never rolled over into, or gone
+        off_t file_size = lseek(fd, -CTDB_FOOTER_ALIGNED_BASE, SEEK_END);
+        STATS_ADD(db, syscalls, 1);
+        off_t flag_aligned_pos = FOOTER_ALIGNED(file_size);  //find the right place for the 'transaction flag'
+        while (flag_aligned_pos >= CTDB_HEADER_SIZE) {
+            STATS_ADD(db, footer_scan_steps, 1);
+            if (CTDB_OK == parse_footer(db, SEGMENT_POS(segment, flag_aligned_pos), SEGMENT_POS(segment, file_size), footer)) return CTDB_OK;
+            flag_aligned_pos -= CTDB_FOOTER_ALIGNED_BASE;  //when searching for the 'transaction flag', it spans an alignment length at a time
         }
-    retry:
-        flag_aligned_pos -= CTDB_FOOTER_ALIGNED_BASE;  //when searching for the 'transaction flag', it spans an alignment length at a time
-        continue;
     }
-    *footer = (struct ctdb_footer){.tran_count = 0, .del_count = 0, .root_pos = 0};
+    *footer = (struct ctdb_footer){.tran_count = 0, .del_count = 0, .root_pos = 0, .prev_pos = 0, .live_bytes = 0, .pos = 0};
     return CTDB_ERR;
 }
 
-static int dump_footer(int fd, struct ctdb_footer *footer) {
+//'footer->prev_pos' links the new footer to the last one, 'footer->pos' is set to where it was written
+static int dump_footer(struct ctdb *db, struct ctdb_footer *footer) {
     struct serializer ser = SERIALIZER_INIT(CTDB_FOOTER_SIZE);
-    uint64_t cksum = ~(footer->tran_count + footer->del_count + footer->root_pos);  //CheckSum
+    uint64_t cksum = ~(footer->tran_count + footer->del_count + footer->root_pos + footer->prev_pos + 
+                       footer->live_bytes + footer->filter_pos + footer->delta_pos + footer->log_pos);  //CheckSum
     if (SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, cksum, uint64_t) ||
         SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, footer->tran_count, uint64_t) ||
         SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, footer->del_count, uint64_t) ||
         SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, footer->root_pos, int64_t) ||
+        SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, footer->prev_pos, int64_t) ||
+        SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, footer->live_bytes, uint64_t) ||
+        SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, footer->filter_pos, int64_t) ||
+        SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, footer->delta_pos, int64_t) ||
+        SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, footer->log_pos, int64_t) ||
         SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, cksum, uint64_t)) {
         return CTDB_ERR;
     }
-    off_t file_size = lseek(fd, 0, SEEK_END);
-    off_t flag_aligned_pos = FOOTER_ALIGNED(file_size);  //find a right position to write the 'transaction flag'
-    if (-1 == lseek(fd, flag_aligned_pos, SEEK_SET)) return CTDB_ERR;
-    if (CTDB_FOOTER_SIZE != write(fd, ser.buf, ser.buf_len)) return CTDB_ERR;
+    off_t flag_aligned_pos = FOOTER_ALIGNED(file_end(db));  //find a right position to write the 'transaction flag'
+    preallocate(db, flag_aligned_pos, CTDB_FOOTER_SIZE);
+    if (CTDB_FOOTER_SIZE != write_at(db, flag_aligned_pos, ser.buf, ser.buf_len)) return CTDB_ERR;
+    db->end_pos = SEGMENT_OFFSET(flag_aligned_pos) + CTDB_FOOTER_SIZE;
+    footer->pos = flag_aligned_pos;
     return CTDB_OK;
 }
 
-static inline off_t append_to_end(int fd, char *buf, uint32_t buf_len){
-    off_t pos = lseek(fd, 0, SEEK_END);  //reach to the end
-    if (-1 == pos) goto err;
-    if (buf_len != write(fd, buf, buf_len)) goto err;
-    return pos;
+//most nodes have only a few items, they are read together with the node header
+#define CTDB_NODE_READ_ITEMS 16
+#define NODE_DISK_SIZE(node) (CTDB_NODE_SIZE + (node)->items_count * CTDB_ITEMS_SIZE)
 
-err:
-    return -1;
+static int decode_node_header(struct serializer *ser, struct ctdb_node *node) {
+    if (SERIALIZER_OK != SERIALIZER_READ_NUM(*ser, node->prefix_len, uint8_t) ||
+        SERIALIZER_OK != SERIALIZER_READ_STR(*ser, node->prefix, node->prefix_len) ||
+        SERIALIZER_OK != SERIALIZER_READ_NUM(*ser, node->leaf_pos, int64_t) ||
+        SERIALIZER_OK != SERIALIZER_READ_NUM(*ser, node->items_count, uint16_t) ||
+        SERIALIZER_OK != SERIALIZER_READ_NUM(*ser, node->count, uint64_t) ||
+        CTDB_MAX_CHAR_RANGE < node->items_count) {
+        return CTDB_ERR;
+    }
+    return CTDB_OK;
 }
 
-static inline int load_items(int fd, int items_count, struct ctdb_node_item *items) {
-    struct serializer ser = SERIALIZER_INIT(CTDB_MAX_CHAR_RANGE * CTDB_ITEMS_SIZE);
-    size_t real_item_size = items_count * CTDB_ITEMS_SIZE;
-    if (real_item_size != read(fd, ser.buf, real_item_size)) return CTDB_ERR;
+static int decode_node_items(struct serializer *ser, struct ctdb_node *node) {
+    ser->offset = CTDB_NODE_SIZE;  //the items follow the fixed size header
     int i = 0;
-    for (; i < items_count; i++) {
-        if (SERIALIZER_OK != SERIALIZER_READ_NUM(ser, items[i].sub_prefix_char, uint8_t) ||
-            SERIALIZER_OK != SERIALIZER_READ_NUM(ser, items[i].sub_node_pos, int64_t)) {
+    for (; i < node->items_count; i++) {
+        if (SERIALIZER_OK != SERIALIZER_READ_NUM(*ser, node->items[i].sub_prefix_char, uint8_t) ||
+            SERIALIZER_OK != SERIALIZER_READ_NUM(*ser, node->items[i].sub_node_pos, int64_t) ||
+            SERIALIZER_OK != SERIALIZER_READ_NUM(*ser, node->items[i].sub_count, uint64_t)) {
             return CTDB_ERR;
         }
     }
     return CTDB_OK;
 }
-static int load_node(int fd, off_t node_pos, struct ctdb_node *node) {
-    struct serializer ser = SERIALIZER_INIT(CTDB_NODE_SIZE);
-    if (-1 == lseek(fd, node_pos, SEEK_SET)) return CTDB_ERR;
-    if (CTDB_NODE_SIZE != read(fd, ser.buf, ser.buf_len)) return CTDB_ERR;
-    if (SERIALIZER_OK != SERIALIZER_READ_NUM(ser, node->prefix_len, uint8_t) ||
-        SERIALIZER_OK != SERIALIZER_READ_STR(ser, node->prefix, node->prefix_len) ||
-        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, node->leaf_pos, int64_t) ||
-        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, node->items_count, uint8_t)) {
-        return CTDB_ERR;
+
+static int read_node(struct ctdb *db, off_t node_pos, struct ctdb_node *node) {
+    struct serializer ser = SERIALIZER_INIT(CTDB_NODE_SIZE + CTDB_MAX_CHAR_RANGE * CTDB_ITEMS_SIZE);
+    ssize_t read_len = read_at(db, node_pos, ser.buf, CTDB_NODE_SIZE + CTDB_NODE_READ_ITEMS * CTDB_ITEMS_SIZE);
+    if (CTDB_NODE_SIZE > read_len) return CTDB_ERR;
+    if (CTDB_OK != decode_node_header(&ser, node)) return CTDB_ERR;
+    if (NODE_DISK_SIZE(node) > read_len) {  //the rest of the items
+        size_t rest_len = NODE_DISK_SIZE(node) - read_len;
+        if (rest_len != read_at(db, node_pos + read_len, ser.buf + read_len, rest_len)) return CTDB_ERR;
     }
-    if (CTDB_OK != load_items(fd, node->items_count, node->items)) return CTDB_ERR;
+    if (CTDB_OK != decode_node_items(&ser, node)) return CTDB_ERR;
+    STATS_ADD(db, node_loads, 1);
     return CTDB_OK;
 }
 
-static inline int dump_items(int fd, int items_count, struct ctdb_node_item *items) {
-    struct serializer ser = SERIALIZER_INIT(CTDB_MAX_CHAR_RANGE * CTDB_ITEMS_SIZE);
+//at the offset of 'ser', which ends up after the items
+static int encode_node(struct ctdb_node *node, struct serializer *ser) {
+    off_t start = ser->offset;
+    if (SERIALIZER_OK != SERIALIZER_WRITE_NUM(*ser, node->prefix_len, uint8_t) ||
+        SERIALIZER_OK != SERIALIZER_WRITE_STR(*ser, node->prefix, node->prefix_len) ||
+        SERIALIZER_OK != SERIALIZER_WRITE_NUM(*ser, node->leaf_pos, int64_t) ||
+        SERIALIZER_OK != SERIALIZER_WRITE_NUM(*ser, node->items_count, uint16_t) ||
+        SERIALIZER_OK != SERIALIZER_WRITE_NUM(*ser, node->count, uint64_t)) {
+        return CTDB_ERR;
+    }
+    ser->offset = start + CTDB_NODE_SIZE;  //the items follow the fixed size header
     int i = 0;
-    for (; i < items_count; i++) {
-        if (SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, items[i].sub_prefix_char, uint8_t) ||
-            SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, items[i].sub_node_pos, int64_t)) {
+    for (; i < node->items_count; i++) {
+        if (SERIALIZER_OK != SERIALIZER_WRITE_NUM(*ser, node->items[i].sub_prefix_char, uint8_t) ||
+            SERIALIZER_OK != SERIALIZER_WRITE_NUM(*ser, node->items[i].sub_node_pos, int64_t) ||
+            SERIALIZER_OK != SERIALIZER_WRITE_NUM(*ser, node->items[i].sub_count, uint64_t)) {
             return CTDB_ERR;
         }
     }
-    size_t real_item_size = items_count * CTDB_ITEMS_SIZE;
-    if (real_item_size != write(fd, ser.buf, real_item_size)) return CTDB_ERR;
     return CTDB_OK;
 }
-static off_t dump_node(int fd, struct ctdb_node *node) {   
-    struct serializer ser = SERIALIZER_INIT(CTDB_NODE_SIZE);
-    if (SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, node->prefix_len, uint8_t) ||
-        SERIALIZER_OK != SERIALIZER_WRITE_STR(ser, node->prefix, node->prefix_len) ||
-        SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, node->leaf_pos, int64_t) ||
-        SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, node->items_count, uint8_t)) {
-        goto err;
+
+//a flush keeps the nodes it changes in memory, under positions past any file, and writes the last copies once
+#define CTDB_BATCH_BASE (1LL << 62)
+
+struct ctdb_batch{
+    struct batch_slot{
+        char *buf;  //the encoded node, NULL once it was loaded again (the loader always dumps a new copy)
+        uint32_t len;
+    } *slots;
+    uint32_t count;
+    uint32_t cap;
+    uint32_t *free_slots;
+    uint32_t free_count;
+    uint64_t loaded_bytes;  //of the nodes loaded back, they were never in the file
+};
+
+static off_t batch_store(struct ctdb_batch *batch, char *buf, uint32_t len) {
+    uint32_t slot = 0;
+    if (0 < batch->free_count) {
+        slot = batch->free_slots[--batch->free_count];
+    } else {
+        if (batch->count == batch->cap) {
+            uint32_t new_cap = 0 < batch->cap ? batch->cap * 2 : 1024;
+            struct batch_slot *slots = realloc(batch->slots, new_cap * sizeof(struct batch_slot));
+            if (NULL == slots) return -1;
+            batch->slots = slots;
+            uint32_t *free_slots = realloc(batch->free_slots, new_cap * sizeof(uint32_t));
+            if (NULL == free_slots) return -1;
+            batch->free_slots = free_slots;
+            batch->cap = new_cap;
+        }
+        slot = batch->count++;
     }
-    off_t node_pos = append_to_end(fd, ser.buf, ser.buf_len);
-    
+    if (NULL == (batch->slots[slot].buf = malloc(len))) {
+        batch->free_slots[batch->free_count++] = slot;
+        return -1;
+    }
+    memcpy(batch->slots[slot].buf, buf, len);
+    batch->slots[slot].len = len;
+    return CTDB_BATCH_BASE + slot;
+}
+
+static int batch_load(struct ctdb_batch *batch, off_t node_pos, struct ctdb_node *node) {
+    uint64_t slot = node_pos - CTDB_BATCH_BASE;
+    if (NULL == batch || batch->count <= slot || NULL == batch->slots[slot].buf) return CTDB_ERR;
+    struct serializer ser = {.buf = batch->slots[slot].buf, .buf_len = batch->slots[slot].len, .offset = 0};
+    int res = CTDB_OK == decode_node_header(&ser, node) && CTDB_OK == decode_node_items(&ser, node) ? CTDB_OK : CTDB_ERR;
+    batch->loaded_bytes += batch->slots[slot].len;
+    free(batch->slots[slot].buf);
+    batch->slots[slot].buf = NULL;
+    batch->free_slots[batch->free_count++] = slot;
+    return res;
+}
+
+static void batch_free(struct ctdb_batch *batch) {
+    uint32_t slot = 0;
+    for (; slot < batch->count; slot++) {
+        free(batch->slots[slot].buf);
+    }
+    free(batch->slots);
+    free(batch->free_slots);
+}
+
+//with a 'batch' (a flush of the memtable) the node is kept there, written by the end of the flush
+static off_t dump_node(struct ctdb *db, struct ctdb_batch *batch, struct ctdb_node *node) {   
+    struct serializer ser = SERIALIZER_INIT(CTDB_NODE_SIZE + CTDB_MAX_CHAR_RANGE * CTDB_ITEMS_SIZE);
+    if (CTDB_OK != encode_node(node, &ser)) goto err;
+    if (NULL != batch) return batch_store(batch, ser.buf, ser.offset);
+    off_t node_pos = append_to_end(db, ser.buf, ser.offset);  //the header and the items in one write
     if (0 >= node_pos) goto err;
-    if (CTDB_OK != dump_items(fd, node->items_count, node->items)) goto err;
+    STATS_ADD(db, node_dumps, 1);
     return node_pos;
 
 err:
     return -1;
 }
 
-static int load_leaf(int fd, off_t leaf_pos, struct ctdb_leaf *leaf) {
+static int load_leaf(struct ctdb *db, off_t leaf_pos, struct ctdb_leaf *leaf) {
     struct serializer ser = SERIALIZER_INIT(CTDB_LEAF_SIZE);
-    if (-1 == lseek(fd, leaf_pos, SEEK_SET)) return CTDB_ERR;
-    if (CTDB_LEAF_SIZE != read(fd, ser.buf, ser.buf_len)) return CTDB_ERR;
+    if (CTDB_LEAF_SIZE != read_at(db, leaf_pos, ser.buf, ser.buf_len)) return CTDB_ERR;
     if (SERIALIZER_OK != SERIALIZER_READ_NUM(ser, leaf->version, uint64_t) ||
         SERIALIZER_OK != SERIALIZER_READ_NUM(ser, leaf->value_len, uint32_t) ||
-        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, leaf->value_pos, int64_t)) {
+        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, leaf->value_pos, int64_t) ||
+        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, leaf->expire, int64_t)) {
+        return CTDB_ERR;
+    }
+    STATS_ADD(db, leaf_loads, 1);
+    return CTDB_OK;
+}
+
+//expired keys are invisible until a vacuum drops them, the subtree counts still include them
+#define LEAF_IS_LIVE(leaf, now) (0 < (leaf).value_len && (0 == (leaf).expire || (now) < (leaf).expire))
+
+static int encode_leaf(struct ctdb_leaf *leaf, struct serializer *ser) {
+    if (SERIALIZER_OK != SERIALIZER_WRITE_NUM(*ser, leaf->version, uint64_t) ||
+        SERIALIZER_OK != SERIALIZER_WRITE_NUM(*ser, leaf->value_len, uint32_t) ||
+        SERIALIZER_OK != SERIALIZER_WRITE_NUM(*ser, leaf->value_pos, int64_t) ||
+        SERIALIZER_OK != SERIALIZER_WRITE_NUM(*ser, leaf->expire, int64_t)) {
         return CTDB_ERR;
     }
     return CTDB_OK;
 }
 
-static off_t dump_leaf(int fd, struct ctdb_leaf *leaf) {
+static off_t dump_leaf(struct ctdb *db, struct ctdb_leaf *leaf) {
     struct serializer ser = SERIALIZER_INIT(CTDB_LEAF_SIZE);
-    if (SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, leaf->version, uint64_t) ||
-        SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, leaf->value_len, uint32_t) ||
-        SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, leaf->value_pos, int64_t)) {
+    if (CTDB_OK != encode_leaf(leaf, &ser)) goto err;
+    STATS_ADD(db, leaf_dumps, 1);
+    return append_to_end(db, ser.buf, ser.buf_len);
+
+err:
+    return -1;
+}
+///////////////////////////////////////////////////////////////////////////////
+// PINNED
+///////////////////////////////////////////////////////////////////////////////
+//the top levels of the last root, decoded, every search starts below them without reading the file.
+//Nodes never change once written, a position is found here or in the file, never both different
+#define CTDB_PINNED_MAX_NODES 1024
+#define NODE_MEM_SIZE(items_count) (offsetof(struct ctdb_node, items) + (items_count) * sizeof(struct ctdb_node_item))
+
+struct ctdb_pinned{
+    off_t root_pos;
+    uint32_t slots;  //a power of 2, at least twice the nodes
+    uint32_t count;
+    struct pinned_slot{
+        off_t node_pos;  //0 for an empty slot
+        struct ctdb_node *node;  //NODE_MEM_SIZE of its items
+    } *table;
+};
+
+#define PINNED_SLOT(pinned, pos) ((((uint64_t)(pos) * 0x9e3779b97f4a7c15ULL) >> 32) & ((pinned)->slots - 1))
+
+static struct ctdb_node *pinned_find(struct ctdb_pinned *pinned, off_t node_pos) {
+    uint32_t slot = PINNED_SLOT(pinned, node_pos);
+    while (0 != pinned->table[slot].node_pos) {
+        if (node_pos == pinned->table[slot].node_pos) return pinned->table[slot].node;
+        slot = (slot + 1) & (pinned->slots - 1);
+    }
+    return NULL;
+}
+
+static void free_pinned(struct ctdb_pinned *pinned) {
+    if (NULL == pinned) return;
+    uint32_t slot = 0;
+    for (; NULL != pinned->table && slot < pinned->slots; slot++) {
+        free(pinned->table[slot].node);
+    }
+    free(pinned->table);
+    free(pinned);
+}
+
+static int load_node(struct ctdb *db, off_t node_pos, struct ctdb_node *node) {
+    if (CTDB_BATCH_BASE <= node_pos) return CTDB_ERR;  //a node of a flush, only its batch has it
+    if (NULL != __atomic_load_n(&(db->pinned), __ATOMIC_ACQUIRE)) {
+        pthread_rwlock_rdlock(&(db->pinned_lock));
+        struct ctdb_node *pinned_node = NULL != db->pinned ? pinned_find(db->pinned, node_pos) : NULL;
+        if (NULL != pinned_node) memcpy(node, pinned_node, NODE_MEM_SIZE(pinned_node->items_count));
+        pthread_rwlock_unlock(&(db->pinned_lock));
+        if (NULL != pinned_node) {
+            STATS_ADD(db, cache_hits, 1);
+            return CTDB_OK;
+        }
+    }
+    return read_node(db, node_pos, node);
+}
+
+//a node of a flush is still in its batch, the others are in the file
+static inline int load_batch_node(struct ctdb *db, struct ctdb_batch *batch, off_t node_pos, struct ctdb_node *node) {
+    if (NULL != batch && CTDB_BATCH_BASE <= node_pos) return batch_load(batch, node_pos, node);
+    return load_node(db, node_pos, node);
+}
+
+//the nodes that are pinned already are copied, only the ones written since the last root are read
+static int pin_root(struct ctdb *db, off_t root_pos) {
+    struct ctdb_pinned *pinned = NULL;
+    off_t *level = NULL, *next_level = NULL;
+    struct ctdb_node *node = NULL;
+    if (0 == db->pinned_levels || 0 >= root_pos) goto unpin;
+    if (0 != pthread_mutex_trylock(&(db->pinning_lock))) return CTDB_OK;  //another thread is at it
+    struct ctdb_pinned *old = __atomic_load_n(&(db->pinned), __ATOMIC_ACQUIRE);
+    if (NULL != old && root_pos == old->root_pos) {
+        pthread_mutex_unlock(&(db->pinning_lock));
+        return CTDB_OK;
+    }
+
+    if (NULL == (pinned = calloc(1, sizeof(*pinned)))) goto err;
+    pinned->root_pos = root_pos;
+    pinned->slots = CTDB_PINNED_MAX_NODES * 2;
+    if (NULL == (pinned->table = calloc(pinned->slots, sizeof(*(pinned->table))))) goto err;
+    if (NULL == (level = malloc(CTDB_PINNED_MAX_NODES * sizeof(off_t))) ||
+        NULL == (next_level = malloc(CTDB_PINNED_MAX_NODES * sizeof(off_t))) ||
+        NULL == (node = malloc(sizeof(*node)))) {
         goto err;
     }
-    return append_to_end(fd, ser.buf, ser.buf_len);
+    uint32_t level_count = 1, depth = 0;
+    level[0] = root_pos;
+    for (; depth < db->pinned_levels && 0 < level_count; depth++) {
+        uint32_t next_count = 0, i = 0;
+        for (; i < level_count && pinned->count < CTDB_PINNED_MAX_NODES; i++) {
+            struct ctdb_node *old_node = NULL != old ? pinned_find(old, level[i]) : NULL;  //only freed under 'pinning_lock'
+            if (NULL != old_node) memcpy(node, old_node, NODE_MEM_SIZE(old_node->items_count));
+            if (NULL == old_node && CTDB_OK != read_node(db, level[i], node)) goto err;
+
+            uint32_t slot = PINNED_SLOT(pinned, level[i]);
+            while (0 != pinned->table[slot].node_pos) {
+                slot = (slot + 1) & (pinned->slots - 1);
+            }
+            if (NULL == (pinned->table[slot].node = malloc(NODE_MEM_SIZE(node->items_count)))) goto err;
+            memcpy(pinned->table[slot].node, node, NODE_MEM_SIZE(node->items_count));
+            pinned->table[slot].node_pos = level[i];
+            pinned->count += 1;
+            int items_index = 0;
+            for (; items_index < node->items_count && next_count < CTDB_PINNED_MAX_NODES; items_index++) {
+                next_level[next_count++] = node->items[items_index].sub_node_pos;
+            }
+        }
+        off_t *tmp = level;
+        level = next_level;
+        next_level = tmp;
+        level_count = next_count;
+    }
+
+    pthread_rwlock_wrlock(&(db->pinned_lock));
+    __atomic_store_n(&(db->pinned), pinned, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&(db->pinned_lock));
+    pthread_mutex_unlock(&(db->pinning_lock));
+    free_pinned(old);
+    free(level);
+    free(next_level);
+    free(node);
+    return CTDB_OK;
 
 err:
-    return -1;
+    pthread_mutex_unlock(&(db->pinning_lock));
+    free_pinned(pinned);
+    free(level);
+    free(next_level);
+    free(node);
+    return CTDB_ERR;
+
+unpin:
+    pthread_mutex_lock(&(db->pinning_lock));
+    pthread_rwlock_wrlock(&(db->pinned_lock));
+    pinned = db->pinned;
+    __atomic_store_n(&(db->pinned), NULL, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&(db->pinned_lock));
+    pthread_mutex_unlock(&(db->pinning_lock));
+    free_pinned(pinned);
+    return CTDB_OK;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// COMMEN
+// DEDUP
 ///////////////////////////////////////////////////////////////////////////////
-static inline int prefix_copy(char *filled_prefix_dst, char *prefix_src, uint8_t prefix_src_len) {
-    int copied_len = -1;
-    if (CTDB_MAX_KEY_LEN >= prefix_src_len && filled_prefix_dst == strncpy(filled_prefix_dst, prefix_src, prefix_src_len)) {
-        copied_len = strnlen(filled_prefix_dst, CTDB_MAX_KEY_LEN);
+//a hash table from a 64-bit key to a value in the file: the hash of the values appended since open (one per hash,
+//the newest), or the old position of the values a vacuum copied. It grows with the values, nothing is evicted
+#define VALUE_HASH_SEED 0x2545f4914f6cdd1dULL
+
+struct ctdb_dedup{
+    struct dedup_slot{
+        uint64_t key;
+        off_t value_pos;  //0 for an empty slot
+        uint32_t value_len;
+    } *slots;
+    uint64_t count;
+    uint64_t cap;  //a power of 2, at most half full
+};
+
+//values are long, 8 bytes at a time
+static uint64_t value_hash(char *value, uint32_t value_len) {
+    uint64_t hash = VALUE_HASH_SEED ^ value_len, word = 0;
+    uint32_t i = 0;
+    for (; i + CTDB_I64_LEN <= value_len; i += CTDB_I64_LEN) {
+        memcpy(&word, value + i, CTDB_I64_LEN);
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 29;
+    }
+    word = 0;
+    memcpy(&word, value + i, value_len - i);
+    hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static struct ctdb_dedup *dedup_new() {
+    struct ctdb_dedup *dedup = calloc(1, sizeof(*dedup));
+    if (NULL == dedup) return NULL;
+    dedup->cap = 1024;
+    if (NULL == (dedup->slots = calloc(dedup->cap, sizeof(struct dedup_slot)))) {
+        free(dedup);
+        return NULL;
+    }
+    return dedup;
+}
+
+static void dedup_free(struct ctdb_dedup *dedup) {
+    if (NULL == dedup) return;
+    free(dedup->slots);
+    free(dedup);
+}
+
+//the slot of 'key', or the empty one it would take
+static struct dedup_slot *dedup_find(struct ctdb_dedup *dedup, uint64_t key) {
+    uint64_t index = ((key * 0x9e3779b97f4a7c15ULL) >> 32) & (dedup->cap - 1);  //positions are aligned, the high bits are mixed
+    while (0 < dedup->slots[index].value_pos && key != dedup->slots[index].key) {
+        index = (index + 1) & (dedup->cap - 1);
+    }
+    return &(dedup->slots[index]);
+}
+
+static int dedup_add(struct ctdb_dedup *dedup, uint64_t key, off_t value_pos, uint32_t value_len) {
+    if (dedup->cap <= (dedup->count + 1) * 2) {
+        struct ctdb_dedup grown = {.slots = calloc(dedup->cap * 2, sizeof(struct dedup_slot)), .count = dedup->count, .cap = dedup->cap * 2};
+        if (NULL == grown.slots) return CTDB_ERR;
+        uint64_t i = 0;
+        for (; i < dedup->cap; i++) {
+            if (0 < dedup->slots[i].value_pos) *dedup_find(&grown, dedup->slots[i].key) = dedup->slots[i];
+        }
+        free(dedup->slots);
+        *dedup = grown;
+    }
+    struct dedup_slot *slot = dedup_find(dedup, key);
+    if (0 >= slot->value_pos) dedup->count += 1;
+    *slot = (struct dedup_slot){.key = key, .value_pos = value_pos, .value_len = value_len};
+    return CTDB_OK;
+}
+
+static void dedup_clear(struct ctdb_dedup *dedup) {
+    if (NULL == dedup) return;
+    memset(dedup->slots, 0, dedup->cap * sizeof(struct dedup_slot));
+    dedup->count = 0;
+}
+
+static int value_equals(struct ctdb *db, off_t value_pos, char *value, uint32_t value_len) {
+    uint32_t buf_len = value_len < CTDB_STREAM_CHUNK_SIZE ? value_len : CTDB_STREAM_CHUNK_SIZE, done = 0;
+    char *buf = malloc(buf_len);
+    if (NULL == buf) return 0;
+    while (done < value_len) {
+        uint32_t len = value_len - done < buf_len ? value_len - done : buf_len;
+        ssize_t res = read_at(db, value_pos + done, buf, len);
+        if (0 >= res || 0 != memcmp(buf, value + done, res)) break;
+        done += res;
+    }
+    free(buf);
+    return done == value_len;
+}
+
+//the position of a value equal to 'value' that is in the file already, or of the copy appended now
+static off_t append_value_shared(struct ctdb *db, char *value, uint32_t value_len, uint64_t *shared_bytes) {
+    if (0 == db->dedup_min_len || value_len < db->dedup_min_len || NULL == db->dedup) return append_to_end(db, value, value_len);
+    uint64_t hash = value_hash(value, value_len);
+    struct dedup_slot *slot = dedup_find(db->dedup, hash);
+    if (0 < slot->value_pos && value_len == slot->value_len && value_equals(db, slot->value_pos, value, value_len)) {
+        STATS_ADD(db, dedup_hits, 1);
+        STATS_ADD(db, dedup_bytes, value_len);
+        *shared_bytes += value_len;
+        return slot->value_pos;
     }
-    return copied_len;
+    off_t value_pos = append_to_end(db, value, value_len);
+    if (0 < value_pos) dedup_add(db->dedup, hash, value_pos, value_len);  //best effort, the bytes stay even if rolled back, and every hit is compared
+    return value_pos;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// COMMEN
+///////////////////////////////////////////////////////////////////////////////
+static inline int prefix_copy(char *prefix_dst, char *prefix_src, uint16_t prefix_src_len) {
+    if (CTDB_MAX_PREFIX_LEN < prefix_src_len) return -1;
+    memmove(prefix_dst, prefix_src, prefix_src_len);  //keys are binary, a 0x00 byte is part of the key
+    return prefix_src_len;
 }
 
 static int item_cmp(const void *a, const void *b) {
     const struct ctdb_node_item *i = a, *j = b;
-    return i->sub_prefix_char - j->sub_prefix_char;
+    return (int)i->sub_prefix_char - (int)j->sub_prefix_char;  //unsigned bytes, so the keys are in memcmp order
 }
 
-static off_t find_node_from_file(int fd, off_t trav_pos, char *prefix, uint8_t prefix_len, uint8_t prefix_pos, uint8_t is_fuzzy, uint8_t *matched_prefix_len) {
+static off_t find_node_from_file(struct ctdb *db, off_t trav_pos, char *prefix, uint16_t prefix_len, uint16_t prefix_pos, uint8_t is_fuzzy, uint16_t *matched_prefix_len) {
     if(prefix_len == prefix_pos) return trav_pos;  //no need to match
     if(prefix_len > prefix_pos) {
         struct ctdb_node trav = {.prefix_len = 0, .leaf_pos = 0, .items_count = 0};
-        if (CTDB_OK != load_node(fd, trav_pos, &trav)) goto err;
+        if (CTDB_OK != load_node(db, trav_pos, &trav)) goto err;
+        STATS_ADD(db, lookup_depth, 1);
+        TRACE_DEPTH(1);
 
         if (NULL != matched_prefix_len){
             *matched_prefix_len = prefix_pos;
         }
         
         //across the same prefix
-        uint8_t key_prefix_pos = prefix_pos;
+        uint16_t key_prefix_pos = prefix_pos;
         uint8_t trav_prefix_pos = 0;
         while (trav_prefix_pos < trav.prefix_len && 
                 key_prefix_pos < prefix_len && 
@@ -243,14 +947,14 @@ static off_t find_node_from_file(int fd, off_t trav_pos, char *prefix, uint8_t p
             }
 
             //traverse to the next node of the tree
-            char prefix_char = prefix[key_prefix_pos];
+            uint8_t prefix_char = prefix[key_prefix_pos];
             struct ctdb_node_item key_item = {.sub_prefix_char = prefix_char, .sub_node_pos = 0};
             struct ctdb_node_item *item = (struct ctdb_node_item *)bsearch(&key_item, trav.items, trav.items_count, sizeof(key_item), item_cmp);
             if (NULL == item) goto err;  //the item not found in child nodes, stop searching
-            return find_node_from_file(fd, item->sub_node_pos, prefix, prefix_len, key_prefix_pos, is_fuzzy, matched_prefix_len);
+            return find_node_from_file(db, item->sub_node_pos, prefix, prefix_len, key_prefix_pos, is_fuzzy, matched_prefix_len);
         }
-        //fuzzy matching
-        if(is_fuzzy) {
+        //fuzzy matching, the key ends inside the prefix of the current node
+        if(is_fuzzy && key_prefix_pos == prefix_len) {
             return trav_pos;
         }
         goto err;  //the current node's prefix does not match the key, stop searching
@@ -260,14 +964,18 @@ err:
     return -1;
 }
 
-static int put_node_into_items(struct ctdb_node *father_node, char sub_prefix_char, off_t sub_node_pos) {
+//'sub_count' is the live keys under the sub node, the count of the father follows the difference
+static int put_node_into_items(struct ctdb_node *father_node, uint8_t sub_prefix_char, off_t sub_node_pos, uint64_t sub_count) {
     if (0 >= sub_node_pos) goto err;
-    struct ctdb_node_item new_item = {.sub_prefix_char = sub_prefix_char, .sub_node_pos = sub_node_pos};
+    struct ctdb_node_item new_item = {.sub_prefix_char = sub_prefix_char, .sub_node_pos = sub_node_pos, .sub_count = sub_count};
     struct ctdb_node_item *exists_item = (struct ctdb_node_item *)bsearch(&new_item, father_node->items, father_node->items_count, sizeof(new_item), item_cmp);
     if (exists_item != NULL) {
+        father_node->count += sub_count - exists_item->sub_count;
         exists_item->sub_node_pos = sub_node_pos;
+        exists_item->sub_count = sub_count;
     } else {
-        if (father_node->items_count + 1 >= CTDB_MAX_CHAR_RANGE) goto err;
+        if (CTDB_MAX_CHAR_RANGE <= father_node->items_count) goto err;
+        father_node->count += sub_count;
         father_node->items[father_node->items_count++] = new_item;
         qsort(father_node->items, father_node->items_count, sizeof(struct ctdb_node_item), item_cmp);
     }
@@ -277,19 +985,91 @@ err:
     return CTDB_ERR;
 }
 
-static off_t append_node_to_file(int fd, struct ctdb_node *trav, char *prefix, uint8_t prefix_len, uint8_t prefix_pos, off_t leaf_pos) {
+//append the nodes of a new key remainder, a remainder longer than a node prefix is chunked into a chain of nodes
+static off_t dump_new_node(struct ctdb *db, struct ctdb_batch *batch, char *prefix, uint16_t prefix_len, off_t leaf_pos, uint8_t is_live) {
+    struct ctdb_node new_node = {.prefix_len = 0, .leaf_pos = leaf_pos, .items_count = 0, .count = is_live};
+    if (CTDB_MAX_PREFIX_LEN < prefix_len) {
+        off_t chunk_pos = dump_new_node(db, batch, prefix + CTDB_MAX_PREFIX_LEN, prefix_len - CTDB_MAX_PREFIX_LEN, leaf_pos, is_live);
+        new_node.leaf_pos = 0;
+        new_node.count = 0;
+        if (CTDB_OK != put_node_into_items(&new_node, prefix[CTDB_MAX_PREFIX_LEN], chunk_pos, is_live)) goto err;
+        prefix_len = CTDB_MAX_PREFIX_LEN;
+    }
+    if (prefix_len != (new_node.prefix_len = prefix_copy(new_node.prefix, prefix, prefix_len))) goto err;
+    return dump_node(db, batch, &new_node);
+
+err:
+    return -1;
+}
+
+//the value and the leaf of a put, 'shared_bytes' adds up the value if it was in the file already
+static off_t dump_value_leaf(struct ctdb *db, char *value, int value_fd, uint32_t value_len, uint64_t version, int64_t expire, uint64_t *shared_bytes) {
+    off_t value_pos = NULL != value ? append_value_shared(db, value, value_len, shared_bytes) : append_from_fd(db, value_fd, value_len);
+    if (0 >= value_pos) return -1;
+    struct ctdb_leaf new_leaf = {.version = version, .value_len = value_len, .value_pos = value_pos, .expire = expire};
+    return dump_leaf(db, &new_leaf);
+}
+
+#define CHECK_VERSION 1  //the key is live at 'expected_version'
+#define CHECK_ABSENT 2  //the key is not live
+#define CHECK_INCR 3  //the value is a counter, or the key is not live and it counts from 0
+
+//a put that depends on the leaf the key has, checked where the descent for the put ends, before any of it is written
+struct put_check{
+    uint8_t kind;
+    uint64_t expected_version;
+    int64_t delta;
+    int64_t counter;  //the new value of an increment
+    char counter_buf[CTDB_I64_LEN];  //its value, big-endian
+    uint8_t is_conflict;
+    uint64_t shared_bytes;
+    char *value;
+    uint32_t value_len;
+    uint64_t version;
+    int64_t expire;
+};
+
+//'old' is the live leaf of the key, NULL if it has none. The leaf of the put comes back in 'leaf_pos'
+static int check_leaf(struct ctdb *db, struct put_check *check, struct ctdb_leaf *old, off_t *leaf_pos, uint8_t *is_live) {
+    if ((CHECK_VERSION == check->kind && (NULL == old || old->version != check->expected_version)) ||
+        (CHECK_ABSENT == check->kind && NULL != old)) {
+        check->is_conflict = 1;
+        return CTDB_ERR;
+    }
+    if (CHECK_INCR == check->kind) {
+        uint64_t counter = 0;  //big-endian in the file, not the little-endian of the serializer
+        if (NULL != old) {
+            if (CTDB_I64_LEN != old->value_len) return CTDB_ERR;  //not a counter
+            if (CTDB_OK != ctdb_read_value(db, old, (char *)&counter)) return CTDB_ERR;
+            counter = be64toh(counter);
+        }
+        check->counter = (int64_t)(counter + (uint64_t)check->delta);  //wraps around
+        counter = htobe64((uint64_t)check->counter);
+        memcpy(check->counter_buf, &counter, CTDB_I64_LEN);
+    }
+    if (0 >= (*leaf_pos = dump_value_leaf(db, check->value, -1, check->value_len, check->version, check->expire, &(check->shared_bytes)))) return CTDB_ERR;
+    *is_live = 0 < check->value_len;
+    return CTDB_OK;
+}
+
+//'is_live' is 0 for the leaf of a delete, the counts along the path are kept up to date
+//'dead_bytes' adds up the old copies of the nodes on the path and the leaf and value that were replaced.
+//With a 'check', the leaf of the put is written where the descent ends, and nothing at all if the check fails
+static off_t append_node_to_file(struct ctdb *db, struct ctdb_batch *batch, struct ctdb_node *trav, char *prefix, uint16_t prefix_len, uint16_t prefix_pos, off_t leaf_pos, uint8_t is_live, uint64_t *dead_bytes, struct put_check *check) {
     while (prefix_len > prefix_pos) { //this is not a loop, just for the 'break'
-        char prefix_char = prefix[prefix_pos];
+        uint8_t prefix_char = prefix[prefix_pos];
         struct ctdb_node_item key_item = {.sub_prefix_char = prefix_char, .sub_node_pos = 0};
         struct ctdb_node_item *item = (struct ctdb_node_item *)bsearch(&key_item, trav->items, trav->items_count, sizeof(key_item), item_cmp);
         if (NULL == item) break;  //the item not found in child nodes, stop searching
 
         //load node from the file
         struct ctdb_node sub_node = {.prefix_len = 0, .leaf_pos = 0, .items_count = 0};
-        if (CTDB_OK != load_node(fd, item->sub_node_pos, &sub_node)) goto err;
+        if (CTDB_OK != load_batch_node(db, batch, item->sub_node_pos, &sub_node)) goto err;
+        TRACE_DEPTH(1);
+        *dead_bytes += NODE_DISK_SIZE(&sub_node);  //every node on the path is written again
 
         //across the same prefix
-        uint8_t key_prefix_pos = prefix_pos;
+        uint16_t key_prefix_pos = prefix_pos;
         uint8_t sub_node_prefix_pos = 0;
         while (sub_node_prefix_pos < sub_node.prefix_len && 
                 key_prefix_pos < prefix_len && 
@@ -300,61 +1080,69 @@ static off_t append_node_to_file(int fd, struct ctdb_node *trav, char *prefix, u
 
         if (sub_node_prefix_pos == sub_node.prefix_len) {
             //continue to traverse to the next node of the tree
-            off_t new_node_pos = append_node_to_file(fd, &sub_node, prefix, prefix_len, key_prefix_pos, leaf_pos);
-            if (CTDB_OK != put_node_into_items(trav, sub_node.prefix[0], new_node_pos)) goto err;
-            return dump_node(fd, trav);  //append the node to the end of file
+            off_t new_node_pos = append_node_to_file(db, batch, &sub_node, prefix, prefix_len, key_prefix_pos, leaf_pos, is_live, dead_bytes, check);
+            if (CTDB_OK != put_node_into_items(trav, sub_node.prefix[0], new_node_pos, sub_node.count)) goto err;
+            return dump_node(db, batch, trav);  //append the node to the end of file
 
         } else {
-            char old_remained[CTDB_MAX_KEY_LEN + 1] = {[0 ... CTDB_MAX_KEY_LEN] = 0};  //the old prefix does not include duplicate parts
-            if (0 > prefix_copy(old_remained, sub_node.prefix + sub_node_prefix_pos, CTDB_MAX_KEY_LEN - sub_node_prefix_pos)) goto err;
+            if (NULL != check && CTDB_OK != check_leaf(db, check, NULL, &leaf_pos, &is_live)) goto err;  //a new key
+            char old_remained[CTDB_MAX_PREFIX_LEN + 1] = {[0 ... CTDB_MAX_PREFIX_LEN] = 0};  //the old prefix does not include duplicate parts
+            uint8_t old_remained_len = sub_node.prefix_len - sub_node_prefix_pos;
+            if (old_remained_len != prefix_copy(old_remained, sub_node.prefix + sub_node_prefix_pos, old_remained_len)) goto err;
             
-            char new_remained[CTDB_MAX_KEY_LEN + 1] = {[0 ... CTDB_MAX_KEY_LEN] = 0};  //the new prefix does not include duplicate parts
-            if (0 > prefix_copy(new_remained, prefix + key_prefix_pos, CTDB_MAX_KEY_LEN - key_prefix_pos)) goto err;
             if (key_prefix_pos == prefix_len) {
                 //the old prefix is longer and the new node should be inserted before the old node
-                if (0 > (sub_node.prefix_len = prefix_copy(sub_node.prefix, old_remained, CTDB_MAX_KEY_LEN))) goto err;
+                if (old_remained_len != (sub_node.prefix_len = prefix_copy(sub_node.prefix, old_remained, old_remained_len))) goto err;
 
-                //the old node as a child of the new node
-                struct ctdb_node new_node = {.prefix_len = 0, .leaf_pos = leaf_pos, .items_count = 0};
-                if (0 > (new_node.prefix_len = prefix_copy(new_node.prefix, prefix + prefix_pos, CTDB_MAX_KEY_LEN - prefix_pos))) goto err;
-                if (CTDB_OK != put_node_into_items(&new_node, sub_node.prefix[0], dump_node(fd, &sub_node))) goto err;
+                //the old node as a child of the new node (shorter than the old prefix, so it fits in one node)
+                struct ctdb_node new_node = {.prefix_len = 0, .leaf_pos = leaf_pos, .items_count = 0, .count = is_live};
+                if (prefix_len - prefix_pos != (new_node.prefix_len = prefix_copy(new_node.prefix, prefix + prefix_pos, prefix_len - prefix_pos))) goto err;
+                if (CTDB_OK != put_node_into_items(&new_node, sub_node.prefix[0], dump_node(db, batch, &sub_node), sub_node.count)) goto err;
 
                 //the new node as a child of the trav node
-                if (CTDB_OK != put_node_into_items(trav, new_node.prefix[0], dump_node(fd, &new_node))) goto err;
-                return dump_node(fd, trav);  //append the node to the end of file
+                if (CTDB_OK != put_node_into_items(trav, new_node.prefix[0], dump_node(db, batch, &new_node), new_node.count)) goto err;
+                return dump_node(db, batch, trav);  //append the node to the end of file
 
             } else {
                 //the new prefix and the old prefix are not duplicate, split a common node to accommodate both
                 struct ctdb_node common_node = {.prefix_len = 0, .leaf_pos = 0, .items_count = 0};
-                if (0 > (common_node.prefix_len = prefix_copy(common_node.prefix, sub_node.prefix, sub_node_prefix_pos))) goto err;
+                if (sub_node_prefix_pos != (common_node.prefix_len = prefix_copy(common_node.prefix, sub_node.prefix, sub_node_prefix_pos))) goto err;
 
                 //the old node as a child of the common node
-                if (0 > (sub_node.prefix_len = prefix_copy(sub_node.prefix, old_remained, CTDB_MAX_KEY_LEN))) goto err;
-                if (CTDB_OK != put_node_into_items(&common_node, sub_node.prefix[0], dump_node(fd, &sub_node))) goto err;
+                if (old_remained_len != (sub_node.prefix_len = prefix_copy(sub_node.prefix, old_remained, old_remained_len))) goto err;
+                if (CTDB_OK != put_node_into_items(&common_node, sub_node.prefix[0], dump_node(db, batch, &sub_node), sub_node.count)) goto err;
 
-                //the new node as a child of the common node
-                struct ctdb_node new_node = {.prefix_len = 0, .leaf_pos = leaf_pos, .items_count = 0};
-                if (0 > (new_node.prefix_len = prefix_copy(new_node.prefix, new_remained, CTDB_MAX_KEY_LEN))) goto err;
-                if (CTDB_OK != put_node_into_items(&common_node, new_node.prefix[0], dump_node(fd, &new_node))) goto err;
+                //the new node (the new prefix does not include duplicate parts) as a child of the common node
+                off_t new_node_pos = dump_new_node(db, batch, prefix + key_prefix_pos, prefix_len - key_prefix_pos, leaf_pos, is_live);
+                if (CTDB_OK != put_node_into_items(&common_node, prefix[key_prefix_pos], new_node_pos, is_live)) goto err;
 
                 //the common node as a child of the trav node
-                if (CTDB_OK != put_node_into_items(trav, common_node.prefix[0], dump_node(fd, &common_node))) goto err;
-                return dump_node(fd, trav);  //append the node to the end of file
+                if (CTDB_OK != put_node_into_items(trav, common_node.prefix[0], dump_node(db, batch, &common_node), common_node.count)) goto err;
+                return dump_node(db, batch, trav);  //append the node to the end of file
             }
         }
     }  //end:while
     
     if (prefix_len > prefix_pos) {
         //initialize the new node, or the new prefix is longer than the old prefix
-        struct ctdb_node new_node = {.prefix_len = 0, .leaf_pos = leaf_pos, .items_count = 0};
-        if (0 > (new_node.prefix_len = prefix_copy(new_node.prefix, prefix + prefix_pos, CTDB_MAX_KEY_LEN - prefix_pos))) goto err;
-        if (CTDB_OK != put_node_into_items(trav, new_node.prefix[0], dump_node(fd, &new_node))) goto err;
-        return dump_node(fd, trav);  //append the node to the end of file
+        if (NULL != check && CTDB_OK != check_leaf(db, check, NULL, &leaf_pos, &is_live)) goto err;
+        off_t new_node_pos = dump_new_node(db, batch, prefix + prefix_pos, prefix_len - prefix_pos, leaf_pos, is_live);
+        if (CTDB_OK != put_node_into_items(trav, prefix[prefix_pos], new_node_pos, is_live)) goto err;
+        return dump_node(db, batch, trav);  //append the node to the end of file
         
     } else {
         //duplicate prefix, replace (written datas are never changed)
+        uint8_t was_live = 0;
+        struct ctdb_leaf old_leaf = {.version = 0, .value_len = 0, .value_pos = -1};
+        if (0 < trav->leaf_pos) {
+            if (CTDB_OK != load_leaf(db, trav->leaf_pos, &old_leaf)) goto err;
+            was_live = 0 < old_leaf.value_len;
+            if (was_live) *dead_bytes += CTDB_LEAF_SIZE + old_leaf.value_len;  //a delete leaf was never live
+        }
+        if (NULL != check && CTDB_OK != check_leaf(db, check, LEAF_IS_LIVE(old_leaf, time(NULL)) ? &old_leaf : NULL, &leaf_pos, &is_live)) goto err;
+        trav->count += is_live - was_live;
         trav->leaf_pos = leaf_pos;
-        return dump_node(fd, trav);  //append the node to the end of file
+        return dump_node(db, batch, trav);  //append the node to the end of file
     }
 
 err:
@@ -362,223 +1150,2667 @@ err:
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// API
+// COMMITTED
 ///////////////////////////////////////////////////////////////////////////////
-struct ctdb *ctdb_open(char *path) {
-    struct ctdb *db = NULL;
-    int fd = -1;
-
-    db = calloc(1, sizeof(*db));
-    if (NULL == db) goto err;
+static inline long futex(uint32_t *addr, int op, uint32_t val, struct timespec *timeout) {
+    return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
 
-    if (-1 == access(path, F_OK)) {
-        fd = open(path, O_RDWR | O_CREAT, 0666);
-        if (0 > fd) goto err;
-        if (SERIALIZER_OK != dump_header(fd)) goto err;
-        if (SERIALIZER_OK != dump_footer(fd, &(struct ctdb_footer){ .tran_count=0, .del_count=0, .root_pos=0 })) goto err;
-        if (-1 == fsync(fd)) goto err;
-    } else {
-        fd = open(path, O_RDWR);
-        if (0 > fd) goto err;
-        if (SERIALIZER_OK != check_header(fd)) goto err;
+static void publish_committed(struct ctdb *db, struct ctdb_footer *footer) {
+    struct ctdb_commit_record *rec = db->committed;
+    uint32_t seq = __atomic_load_n(&rec->seq, __ATOMIC_RELAXED);
+    do {  //take the odd sequence, so readers retry until the footer is complete
+        seq &= ~1U;
+    } while (!__atomic_compare_exchange_n(&rec->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    __atomic_store_n(&rec->footer.tran_count, footer->tran_count, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->footer.del_count, footer->del_count, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->footer.root_pos, footer->root_pos, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->footer.prev_pos, footer->prev_pos, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->footer.live_bytes, footer->live_bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->footer.filter_pos, footer->filter_pos, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->footer.delta_pos, footer->delta_pos, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->footer.log_pos, footer->log_pos, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->footer.pos, footer->pos, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);  //pairs with the waiter, which counts itself before checking 'seq'
+    if (0 < __atomic_load_n(&rec->waiters, __ATOMIC_RELAXED)) {
+        STATS_ADD(db, syscalls, 1);
+        futex(&rec->seq, FUTEX_WAKE, INT_MAX, NULL);
     }
-    db->fd = fd;
-    return db;
-
-err:
-    if (NULL != db) free(db);
-    if (0 <= fd) close(fd);
-    return NULL;
 }
 
-void ctdb_close(struct ctdb **db) {
-    if (NULL == db || NULL == *db) return;
-    if (0 <= (*db)->fd) 
-        close((*db)->fd);
-    free(*db);
-    *db = NULL;
+static void read_committed(struct ctdb *db, struct ctdb_footer *footer) {
+    struct ctdb_commit_record *rec = db->committed;
+    uint32_t seq = 0;
+    do {
+        seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+        footer->tran_count = __atomic_load_n(&rec->footer.tran_count, __ATOMIC_RELAXED);
+        footer->del_count = __atomic_load_n(&rec->footer.del_count, __ATOMIC_RELAXED);
+        footer->root_pos = __atomic_load_n(&rec->footer.root_pos, __ATOMIC_RELAXED);
+        footer->prev_pos = __atomic_load_n(&rec->footer.prev_pos, __ATOMIC_RELAXED);
+        footer->live_bytes = __atomic_load_n(&rec->footer.live_bytes, __ATOMIC_RELAXED);
+        footer->filter_pos = __atomic_load_n(&rec->footer.filter_pos, __ATOMIC_RELAXED);
+        footer->delta_pos = __atomic_load_n(&rec->footer.delta_pos, __ATOMIC_RELAXED);
+        footer->log_pos = __atomic_load_n(&rec->footer.log_pos, __ATOMIC_RELAXED);
+        footer->pos = __atomic_load_n(&rec->footer.pos, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&rec->seq, __ATOMIC_RELAXED));
 }
 
-struct ctdb_transaction *ctdb_transaction_begin(struct ctdb *db) {
-    struct ctdb_transaction *trans = calloc(1, sizeof(*trans));
-    if (NULL != trans) {
-        if(CTDB_OK != load_footer(db->fd, &(trans->footer))){  //try to find the last transaction
-            goto err;
+//the last footer written by this handle, durable or not yet (see PIPELINE), or else the last one committed by any process
+static void read_latest(struct ctdb *db, struct ctdb_footer *footer) {
+    if (__atomic_load_n(&(db->durable_ticket), __ATOMIC_ACQUIRE) != __atomic_load_n(&(db->written_ticket), __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&(db->pipeline_lock));
+        if (db->durable_ticket != db->written_ticket) {
+            *footer = db->pending;
+            pthread_mutex_unlock(&(db->pipeline_lock));
+            return;
         }
-        trans->is_isvalid = 1;
-        trans->db = db;
-        return trans;
+        pthread_mutex_unlock(&(db->pipeline_lock));  //the syncer published it in the meantime
     }
-
-err:
-    free(trans);
-    return NULL;
+    read_committed(db, footer);
 }
 
-struct ctdb_leaf ctdb_get(struct ctdb_transaction *trans, char *key, uint8_t key_len) {
-    if (NULL == trans || 1 != trans->is_isvalid) goto err;  //verify that the transaction has not been committed or rolled back
-    if (0 >= trans->footer.root_pos) goto err;
-    if (0 >= key_len || CTDB_MAX_KEY_LEN < key_len || NULL == key) goto err;
-
-    //search the prefix nodes related to key from the file
-    char filled_prefix_key[CTDB_MAX_KEY_LEN + 1] = {[0 ... CTDB_MAX_KEY_LEN] = 0};
-    if (filled_prefix_key != strncpy(filled_prefix_key, key, key_len)) goto err;
-    off_t sub_node_pos = find_node_from_file(trans->db->fd, trans->footer.root_pos, filled_prefix_key, key_len, 0, 0, NULL);  //not fuzzy match
-    if (0 >= sub_node_pos) goto err;  //node not found
-    
-    //load node from the file
-    struct ctdb_node sub_node = {.prefix_len = 0, .leaf_pos = 0, .items_count = 0};
-    if (CTDB_OK != load_node(trans->db->fd, sub_node_pos, &sub_node)) goto err;
-    if (0 >= sub_node.leaf_pos) goto err;  //leaf not found
+#define FOOTER_EQUAL(a, b) ((a)->tran_count == (b)->tran_count && (a)->del_count == (b)->del_count && (a)->root_pos == (b)->root_pos)
 
-    //load leaf from the file
-    struct ctdb_leaf leaf = {.version = 0, .value_len = 0, .value_pos = -1};
-    if (CTDB_OK != load_leaf(trans->db->fd, sub_node.leaf_pos, &leaf)) goto err;
-    if (0 == leaf.value_len) goto err;  //the data has been deleted
-    return leaf;
+//publishers of all the processes are serialized by a flock on the record file
+static inline int lock_committed(struct ctdb *db) {
+    if (0 > db->shm_fd) return CTDB_OK;
+    STATS_ADD(db, syscalls, 1);
+    return -1 == flock(db->shm_fd, LOCK_EX) ? CTDB_ERR : CTDB_OK;
+}
 
-err:
-    return (struct ctdb_leaf){.version = 0, .value_len = 0, .value_pos = -1};
+static inline void unlock_committed(struct ctdb *db) {
+    if (0 > db->shm_fd) return;
+    STATS_ADD(db, syscalls, 1);
+    flock(db->shm_fd, LOCK_UN);
 }
 
-int ctdb_put(struct ctdb_transaction *trans, char *key, uint8_t key_len, char *value, uint32_t value_len) {
+//make the record agree with the last footer in the file: it may be new, stale (the file was replaced),
+//or behind (a committer died between its fsync and its publish)
+static int refresh_committed(struct ctdb *db) {
+    if (CTDB_OK != lock_committed(db)) return CTDB_ERR;
+    struct ctdb_footer footer;
+    int res = load_footer(db, &footer);
+    if (CTDB_OK == res) {
+        struct ctdb_commit_record *rec = db->committed;
+        uint32_t seq = __atomic_load_n(&rec->seq, __ATOMIC_RELAXED);
+        if (seq & 1) {  //no publisher can be running under the lock, this one died halfway
+            __atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELEASE);
+        }
+        if ((seq & 1) || !FOOTER_EQUAL(&rec->footer, &footer) || rec->footer.pos != footer.pos) {
+            publish_committed(db, &footer);
+        }
+    }
+    unlock_committed(db);
+    return res;
+}
+
+static int open_committed(struct ctdb *db, char *path) {
+    char shm_path[PATH_MAX];
+    struct stat st;
+    db->committed = MAP_FAILED;
+    db->shm_fd = -1;
+    if (sizeof(shm_path) > snprintf(shm_path, sizeof(shm_path), "%s%s", path, CTDB_SHM_SUFFIX)) {
+        db->shm_fd = open(shm_path, O_RDWR | O_CREAT, 0666);
+    }
+    if (0 <= db->shm_fd && CTDB_OK == lock_committed(db)) {
+        if (0 == fstat(db->shm_fd, &st) && 
+            (sizeof(struct ctdb_commit_record) <= st.st_size || 0 == ftruncate(db->shm_fd, sizeof(struct ctdb_commit_record)))) {
+            db->committed = mmap(NULL, sizeof(struct ctdb_commit_record), PROT_READ | PROT_WRITE, MAP_SHARED, db->shm_fd, 0);
+        }
+        unlock_committed(db);
+    }
+    if (MAP_FAILED == db->committed) {  //read-only directory and so on, keep the record private
+        if (0 <= db->shm_fd) close(db->shm_fd);
+        db->shm_fd = -1;
+        db->committed = calloc(1, sizeof(struct ctdb_commit_record));
+        if (NULL == db->committed) return CTDB_ERR;
+    }
+    return refresh_committed(db);
+}
+
+static void close_committed(struct ctdb *db) {
+    if (NULL == db->committed || MAP_FAILED == db->committed) return;
+    if (0 <= db->shm_fd) {
+        munmap(db->committed, sizeof(struct ctdb_commit_record));
+        close(db->shm_fd);
+    } else {
+        free(db->committed);
+    }
+    db->committed = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WRITER
+///////////////////////////////////////////////////////////////////////////////
+//one writer per file across processes, the lock is held from the first put to the commit or rollback,
+//and by the syncer while footers wait to be durable
+static int writer_lock(struct ctdb_transaction *trans) {
+    struct ctdb *db = trans->db;
+    if (trans->is_writer) return CTDB_OK;
+    int res = CTDB_OK;
+    pthread_mutex_lock(&(db->pipeline_lock));
+    if (0 == db->writer_refs) {
+        STATS_ADD(db, syscalls, 1);
+        if (-1 == flock(db->fd, LOCK_EX)) {
+            res = CTDB_ERR;
+        } else if (CTDB_OK != refresh_committed(db)) {
+            flock(db->fd, LOCK_UN);
+            res = CTDB_ERR;
+        }
+    }
+    if (CTDB_OK == res) {
+        db->writer_refs += 1;
+        trans->is_writer = 1;
+    }
+    pthread_mutex_unlock(&(db->pipeline_lock));
+    return res;
+}
+
+//under 'pipeline_lock'
+static void writer_release(struct ctdb *db) {
+    if (0 == --db->writer_refs) {
+        STATS_ADD(db, syscalls, 1);
+        flock(db->fd, LOCK_UN);
+    }
+}
+
+static void writer_unlock(struct ctdb_transaction *trans) {
+    struct ctdb *db = trans->db;
+    if (!trans->is_writer) return;
+    trans->is_writer = 0;
+    pthread_mutex_lock(&(db->pipeline_lock));
+    writer_release(db);
+    pthread_mutex_unlock(&(db->pipeline_lock));
+}
+
+//the first write of a transaction, it is rolled back if another writer committed since it began
+static int writer_begin(struct ctdb_transaction *trans) {
+    if (trans->is_writer) return CTDB_OK;
+    if (CTDB_OK != writer_lock(trans)) return CTDB_ERR;
+    struct ctdb_footer committed;
+    read_latest(trans->db, &committed);
+    if (!FOOTER_EQUAL(&committed, &(trans->footer))) {
+        trans->is_isvalid = 0;
+        writer_unlock(trans);
+        return CTDB_ERR;
+    }
+    trans->base = committed;  //the lock is shared by the transactions of the handle, another one may commit first
+    return CTDB_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// READERS
+///////////////////////////////////////////////////////////////////////////////
+//a handle with live transactions or snapshots holds a read lock on a byte of '<path>-shm' (an OFD lock, apart
+//from the flock of the record), a compaction empties segments only if it can take it for writing
+static int lock_readers(struct ctdb *db, short type, int cmd) {
+    if (0 > db->shm_fd) return CTDB_OK;  //a private record, no other process shares the roots
+    struct flock lock = {.l_type = type, .l_whence = SEEK_SET, .l_start = sizeof(struct ctdb_commit_record), .l_len = 1, .l_pid = 0};
+    STATS_ADD(db, syscalls, 1);
+    return -1 == fcntl(db->shm_fd, cmd, &lock) ? CTDB_ERR : CTDB_OK;
+}
+
+//before the root is read, it waits for a compaction that is emptying segments
+static int reader_enter(struct ctdb *db) {
+    int res = CTDB_OK;
+    pthread_mutex_lock(&(db->readers_lock));
+    if (0 == db->readers) res = lock_readers(db, F_RDLCK, F_OFD_SETLKW);
+    if (CTDB_OK == res) db->readers += 1;
+    pthread_mutex_unlock(&(db->readers_lock));
+    return res;
+}
+
+static void reader_exit(struct ctdb *db) {
+    pthread_mutex_lock(&(db->readers_lock));
+    if (0 == --db->readers) lock_readers(db, F_UNLCK, F_OFD_SETLK);
+    pthread_mutex_unlock(&(db->readers_lock));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PIPELINE
+///////////////////////////////////////////////////////////////////////////////
+//a pipelined commit writes its footer and returns, the syncer makes the footers durable and publishes them
+//in order. One sync covers every footer written before it, so a burst of commits shares the syncs
+static void *syncer_main(void *arg) {
+    struct ctdb *db = arg;
+    pthread_mutex_lock(&(db->pipeline_lock));
+    while (1) {
+        while (db->durable_ticket == db->written_ticket && !db->is_closing) {
+            pthread_cond_wait(&(db->pipeline_cond), &(db->pipeline_lock));
+        }
+        if (db->durable_ticket == db->written_ticket) break;  //closing, and nothing is left to sync
+        uint64_t ticket = db->written_ticket;
+        struct ctdb_footer footer = db->pending;
+        int fd = db->pending_fd;
+        pthread_mutex_unlock(&(db->pipeline_lock));
+
+        int res = sync_fd(db, fd);
+        if (CTDB_OK == res && CTDB_OK == (res = lock_committed(db))) {
+            publish_committed(db, &footer);
+            unlock_committed(db);
+        }
+
+        pthread_mutex_lock(&(db->pipeline_lock));
+        if (CTDB_OK != res && 0 == db->failed_ticket) {  //the commits behind it were built on its root, they fail too
+            __atomic_store_n(&(db->failed_ticket), db->durable_ticket + 1, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&(db->durable_ticket), ticket, __ATOMIC_RELEASE);
+        if (ticket == db->written_ticket) writer_release(db);  //the pipeline is empty
+        pthread_cond_broadcast(&(db->pipeline_cond));
+    }
+    pthread_mutex_unlock(&(db->pipeline_lock));
+    return NULL;
+}
+
+//'footer' was written, the syncer takes it from here
+static int pipeline_push(struct ctdb *db, struct ctdb_footer *footer, uint64_t *ticket) {
+    off_t offset = 0;
+    int fd = segment_fd(db, footer->pos, &offset);  //the segments before it were synced as they rolled over
+    if (0 > fd) return CTDB_ERR;
+    pthread_mutex_lock(&(db->pipeline_lock));
+    if (0 != db->failed_ticket) goto err;
+    if (!db->is_syncer_running) {
+        if (0 != pthread_create(&(db->syncer), NULL, syncer_main, db)) goto err;
+        db->is_syncer_running = 1;
+    }
+    if (db->durable_ticket == db->written_ticket) db->writer_refs += 1;  //no other process writes until it is published
+    db->pending = *footer;
+    db->pending_fd = fd;
+    __atomic_store_n(&(db->written_ticket), db->written_ticket + 1, __ATOMIC_RELEASE);
+    *ticket = db->written_ticket;
+    pthread_cond_broadcast(&(db->pipeline_cond));
+    pthread_mutex_unlock(&(db->pipeline_lock));
+    return CTDB_OK;
+
+err:
+    pthread_mutex_unlock(&(db->pipeline_lock));
+    return CTDB_ERR;
+}
+
+static int pipeline_wait(struct ctdb *db, uint64_t ticket) {
+    pthread_mutex_lock(&(db->pipeline_lock));
+    while (db->durable_ticket < ticket) {
+        pthread_cond_wait(&(db->pipeline_cond), &(db->pipeline_lock));
+    }
+    int res = 0 != db->failed_ticket && db->failed_ticket <= ticket ? CTDB_ERR : CTDB_OK;
+    pthread_mutex_unlock(&(db->pipeline_lock));
+    return res;
+}
+
+static void pipeline_close(struct ctdb *db) {
+    if (!db->is_syncer_running) return;
+    pthread_mutex_lock(&(db->pipeline_lock));
+    db->is_closing = 1;
+    pthread_cond_broadcast(&(db->pipeline_cond));
+    pthread_mutex_unlock(&(db->pipeline_lock));
+    pthread_join(db->syncer, NULL);  //after the last footer is durable
+    db->is_syncer_running = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FILTER
+///////////////////////////////////////////////////////////////////////////////
+#define CTDB_FILTER_BLOCK_WORDS 8  //512 bits, a key tests the bits of one cache line only
+#define CTDB_FILTER_MAX_HASHES 16
+#define CTDB_FILTER_MIN_DELTA 1024  //a small filter still takes a few commits before it is dropped
+
+//the bits are owned by the base view, a view with a delta refers to one (both are immutable once built)
+struct ctdb_filter{
+    uint32_t refs;  //under 'filter_lock'
+    off_t filter_pos;
+    off_t delta_pos;
+    struct ctdb_filter *base;  //NULL for a base
+    uint64_t blocks;
+    uint64_t keys;
+    uint32_t hashes;
+    uint64_t *bits;
+    uint32_t delta_count;
+    uint64_t *delta;  //sorted
+};
+
+#define KEY_HASH_SEED 14695981039346656037ULL
+
+static inline uint64_t key_hash_seeded(char *key, uint16_t key_len, uint64_t seed) {
+    uint64_t hash = seed;  //FNV-1a, then mixed so that every bit depends on every byte
+    uint16_t i = 0;
+    for (; i < key_len; i++) {
+        hash = (hash ^ (uint8_t)key[i]) * 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+#define key_hash(key, key_len) key_hash_seeded((key), (key_len), KEY_HASH_SEED)
+
+static int hash_cmp(const void *a, const void *b) {
+    uint64_t hash_a = *(const uint64_t *)a, hash_b = *(const uint64_t *)b;
+    return hash_a < hash_b ? -1 : (hash_a > hash_b);
+}
+
+static int push_hash(uint64_t **hashes, uint32_t *count, uint32_t *cap, uint64_t hash) {
+    if (*count == *cap) {
+        uint32_t new_cap = 0 < *cap ? *cap * 2 : 64;
+        uint64_t *new_hashes = realloc(*hashes, new_cap * sizeof(uint64_t));
+        if (NULL == new_hashes) return CTDB_ERR;
+        *hashes = new_hashes;
+        *cap = new_cap;
+    }
+    (*hashes)[(*count)++] = hash;
+    return CTDB_OK;
+}
+
+static inline uint32_t filter_hashes_of(uint32_t bits_per_key) {
+    uint32_t hashes = bits_per_key * 69 / 100;  //ln 2
+    return 1 > hashes ? 1 : (CTDB_FILTER_MAX_HASHES < hashes ? CTDB_FILTER_MAX_HASHES : hashes);
+}
+
+//the block is picked by the high half, the bits in it by double hashing of the low half
+static inline uint8_t filter_bits(uint64_t *bits, uint64_t blocks, uint32_t hashes, uint64_t hash, uint8_t is_set) {
+    uint64_t *block = bits + ((hash >> 32) % blocks) * CTDB_FILTER_BLOCK_WORDS;
+    uint32_t h1 = (uint32_t)hash, h2 = (uint32_t)((hash * 0x9e3779b97f4a7c15ULL) >> 32) | 1;
+    uint32_t i = 0;
+    for (; i < hashes; i++) {
+        uint32_t bit = (h1 + i * h2) % (CTDB_FILTER_BLOCK_WORDS * 64);
+        if (is_set) {
+            block[bit >> 6] |= 1ULL << (bit & 63);
+        } else if (0 == (block[bit >> 6] & (1ULL << (bit & 63)))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//the hashes of the keys that are not deleted (expired ones are kept, the search hides them)
+static int filter_travel(struct ctdb *db, off_t trav_pos, char *key, uint16_t key_len, uint64_t **hashes, uint32_t *count, uint32_t *cap) {
+    struct ctdb_node trav = {.prefix_len = 0, .leaf_pos = 0, .items_count = 0};
+    if (CTDB_OK != load_node(db, trav_pos, &trav)) return CTDB_ERR;
+    if (CTDB_MAX_KEY_LEN < key_len + trav.prefix_len) return CTDB_ERR;
+    memcpy(key + key_len, trav.prefix, trav.prefix_len);
+    key_len += trav.prefix_len;
+    if (0 < trav.leaf_pos) {
+        struct ctdb_leaf leaf = {.version = 0, .value_len = 0, .value_pos = -1};
+        if (CTDB_OK != load_leaf(db, trav.leaf_pos, &leaf)) return CTDB_ERR;
+        if (0 < leaf.value_len && CTDB_OK != push_hash(hashes, count, cap, key_hash(key, key_len))) return CTDB_ERR;
+    }
+    int items_index = 0;
+    for (; items_index < trav.items_count; items_index++) {
+        if (CTDB_OK != filter_travel(db, trav.items[items_index].sub_node_pos, key, key_len, hashes, count, cap)) return CTDB_ERR;
+    }
+    return CTDB_OK;
+}
+
+//appends the filter of the keys under 'root_pos', 'filter_pos' is where it went
+static int dump_filter(struct ctdb *db, off_t root_pos, uint32_t bits_per_key, off_t *filter_pos) {
+    uint64_t *hashes = NULL;
+    uint32_t count = 0, cap = 0;
+    char *buf = NULL, *out = NULL;
+    char key[CTDB_MAX_KEY_LEN];
+    //the header is written in front of the bits so that they are word aligned
+    size_t pad = (sizeof(uint64_t) - CTDB_FILTER_HEADER_SIZE % sizeof(uint64_t)) % sizeof(uint64_t);
+    if (0 < root_pos && CTDB_OK != filter_travel(db, root_pos, key, 0, &hashes, &count, &cap)) goto err;
+
+    uint64_t blocks = ((uint64_t)count * bits_per_key + CTDB_FILTER_BLOCK_WORDS * 64 - 1) / (CTDB_FILTER_BLOCK_WORDS * 64);
+    if (0 == blocks) blocks = 1;
+    uint64_t buf_len = CTDB_FILTER_HEADER_SIZE + blocks * CTDB_FILTER_BLOCK_WORDS * sizeof(uint64_t);
+    if (UINT32_MAX < buf_len || NULL == (buf = calloc(1, pad + buf_len))) goto err;
+    out = buf + pad;
+    struct serializer ser = {.buf = out, .buf_len = CTDB_FILTER_HEADER_SIZE, .offset = 0};
+    if (SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, blocks, uint64_t) ||
+        SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, (uint64_t)count, uint64_t) ||
+        SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, bits_per_key, uint32_t)) {
+        goto err;
+    }
+    uint64_t *bits = (uint64_t *)(out + CTDB_FILTER_HEADER_SIZE);
+    uint32_t i = 0, filter_hashes = filter_hashes_of(bits_per_key);
+    for (; i < count; i++) {
+        filter_bits(bits, blocks, filter_hashes, hashes[i], 1);
+    }
+    uint64_t word = 0;
+    for (; word < blocks * CTDB_FILTER_BLOCK_WORDS; word++) {
+        bits[word] = swapping_uint64_t(bits[word]);
+    }
+    if (0 >= (*filter_pos = append_to_end(db, out, buf_len))) goto err;
+    free(hashes);
+    free(buf);
+    return CTDB_OK;
+
+err:
+    free(hashes);
+    free(buf);
+    return CTDB_ERR;
+}
+
+static int load_filter_header(struct ctdb *db, off_t filter_pos, uint64_t *blocks, uint64_t *keys, uint32_t *bits_per_key) {
+    struct serializer ser = SERIALIZER_INIT(CTDB_FILTER_HEADER_SIZE);
+    if (CTDB_FILTER_HEADER_SIZE != read_at(db, filter_pos, ser.buf, ser.buf_len)) return CTDB_ERR;
+    if (SERIALIZER_OK != SERIALIZER_READ_NUM(ser, *blocks, uint64_t) ||
+        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, *keys, uint64_t) ||
+        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, *bits_per_key, uint32_t) || 0 == *blocks) {
+        return CTDB_ERR;
+    }
+    return CTDB_OK;
+}
+
+//a filter of the keys under 'root_pos' in 'dst', as dense as the one of 'footer' in 'db'
+static int rebuild_filter(struct ctdb *db, struct ctdb_footer *footer, struct ctdb *dst, off_t root_pos, off_t *filter_pos) {
+    uint64_t blocks = 0, keys = 0;
+    uint32_t bits_per_key = 0;
+    if (CTDB_OK != load_filter_header(db, footer->filter_pos, &blocks, &keys, &bits_per_key)) return CTDB_ERR;
+    return dump_filter(dst, root_pos, bits_per_key, filter_pos);
+}
+
+static int load_delta_header(struct ctdb *db, off_t delta_pos, off_t *prev_pos, uint64_t *total, uint32_t *count) {
+    struct serializer ser = SERIALIZER_INIT(CTDB_DELTA_HEADER_SIZE);
+    if (CTDB_DELTA_HEADER_SIZE != read_at(db, delta_pos, ser.buf, ser.buf_len)) return CTDB_ERR;
+    if (SERIALIZER_OK != SERIALIZER_READ_NUM(ser, *prev_pos, int64_t) ||
+        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, *total, uint64_t) ||
+        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, *count, uint32_t) || delta_pos <= *prev_pos) {
+        return CTDB_ERR;
+    }
+    return CTDB_OK;
+}
+
+//the keys put by the transaction are logged for the filter, which is dropped once the log is too long to be worth it
+static int dump_delta(struct ctdb_transaction *trans) {
+    struct ctdb *db = trans->db;
+    struct ctdb_footer *footer = &(trans->footer);
+    char *buf = NULL;
+    if (0 >= footer->filter_pos || 0 == trans->filter_count) return CTDB_OK;
+    uint64_t blocks = 0, keys = 0, total = 0;
+    uint32_t bits_per_key = 0, count = 0;
+    off_t prev_pos = 0;
+    if (CTDB_OK != load_filter_header(db, footer->filter_pos, &blocks, &keys, &bits_per_key)) goto err;
+    if (0 < footer->delta_pos && CTDB_OK != load_delta_header(db, footer->delta_pos, &prev_pos, &total, &count)) goto err;
+    total += trans->filter_count;
+    if (keys / 2 + CTDB_FILTER_MIN_DELTA < total) {  //until a vacuum or ctdb_build_filter
+        footer->filter_pos = 0;
+        footer->delta_pos = 0;
+        return CTDB_OK;
+    }
+
+    uint32_t buf_len = CTDB_DELTA_HEADER_SIZE + trans->filter_count * sizeof(uint64_t);
+    if (NULL == (buf = malloc(buf_len))) goto err;
+    struct serializer ser = {.buf = buf, .buf_len = CTDB_DELTA_HEADER_SIZE, .offset = 0};
+    if (SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, footer->delta_pos, int64_t) ||
+        SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, total, uint64_t) ||
+        SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, trans->filter_count, uint32_t)) {
+        goto err;
+    }
+    ser.buf_len = buf_len;
+    uint32_t i = 0;
+    for (; i < trans->filter_count; i++) {
+        if (SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, trans->filter_hashes[i], uint64_t)) goto err;
+    }
+    off_t delta_pos = append_to_end(db, buf, buf_len);
+    if (0 >= delta_pos) goto err;
+    footer->delta_pos = delta_pos;
+    free(buf);
+    return CTDB_OK;
+
+err:
+    free(buf);
+    return CTDB_ERR;
+}
+
+static void free_filter_hashes(struct ctdb_transaction *trans) {
+    free(trans->filter_hashes);
+    trans->filter_hashes = NULL;
+    trans->filter_count = 0;
+    trans->filter_cap = 0;
+}
+
+static void filter_release_locked(struct ctdb_filter *filter) {
+    if (NULL == filter || 0 < --filter->refs) return;
+    filter_release_locked(filter->base);
+    free(filter->bits);
+    free(filter->delta);
+    free(filter);
+}
+
+static void filter_release(struct ctdb *db, struct ctdb_filter *filter) {
+    pthread_mutex_lock(&(db->filter_lock));
+    filter_release_locked(filter);
+    pthread_mutex_unlock(&(db->filter_lock));
+}
+
+static struct ctdb_filter *load_filter_base(struct ctdb *db, off_t filter_pos) {
+    struct ctdb_filter *filter = calloc(1, sizeof(*filter));
+    uint32_t bits_per_key = 0;
+    if (NULL == filter) goto err;
+    *filter = (struct ctdb_filter){.refs = 1, .filter_pos = filter_pos, .delta_pos = 0};
+    if (CTDB_OK != load_filter_header(db, filter_pos, &(filter->blocks), &(filter->keys), &bits_per_key)) goto err;
+    filter->hashes = filter_hashes_of(bits_per_key);
+    uint64_t bits_len = filter->blocks * CTDB_FILTER_BLOCK_WORDS * sizeof(uint64_t), done = 0;
+    if (NULL == (filter->bits = malloc(bits_len))) goto err;
+    while (done < bits_len) {
+        ssize_t res = read_at(db, filter_pos + CTDB_FILTER_HEADER_SIZE + done, (char *)filter->bits + done, bits_len - done);
+        if (0 >= res) goto err;
+        done += res;
+    }
+    uint64_t word = 0;
+    for (; word < filter->blocks * CTDB_FILTER_BLOCK_WORDS; word++) {
+        filter->bits[word] = swapping_uint64_t(filter->bits[word]);
+    }
+    return filter;
+
+err:
+    filter_release_locked(filter);
+    return NULL;
+}
+
+//the view of the footer, 'cached' (the last one built) saves reading the base and the older part of the log again
+static struct ctdb_filter *load_filter_view(struct ctdb *db, struct ctdb_footer *footer, struct ctdb_filter *cached) {
+    struct ctdb_filter *base = NULL, *filter = NULL;
+    if (NULL != cached && cached->filter_pos == footer->filter_pos) {
+        base = NULL != cached->base ? cached->base : cached;
+        base->refs += 1;
+    } else {
+        if (NULL == (base = load_filter_base(db, footer->filter_pos))) goto err;
+        cached = NULL;
+    }
+    if (0 >= footer->delta_pos) return base;
+
+    if (NULL == (filter = calloc(1, sizeof(*filter)))) goto err;
+    *filter = (struct ctdb_filter){.refs = 1, .filter_pos = footer->filter_pos, .delta_pos = footer->delta_pos, .base = base};
+    base = NULL;
+    uint32_t cap = 0;
+    off_t delta_pos = footer->delta_pos;
+    while (0 < delta_pos) {
+        if (NULL != cached && delta_pos == cached->delta_pos) {  //the rest of the log is in the cached view
+            uint32_t i = 0;
+            for (; i < cached->delta_count; i++) {
+                if (CTDB_OK != push_hash(&(filter->delta), &(filter->delta_count), &cap, cached->delta[i])) goto err;
+            }
+            break;
+        }
+        off_t prev_pos = 0;
+        uint64_t total = 0;
+        uint32_t count = 0, i = 0;
+        if (CTDB_OK != load_delta_header(db, delta_pos, &prev_pos, &total, &count)) goto err;
+        uint64_t hashes[512];
+        while (i < count) {
+            uint32_t chunk = count - i < 512 ? count - i : 512, j = 0;
+            if (chunk * sizeof(uint64_t) != read_at(db, delta_pos + CTDB_DELTA_HEADER_SIZE + i * sizeof(uint64_t), hashes, chunk * sizeof(uint64_t))) goto err;
+            for (; j < chunk; j++) {
+                if (CTDB_OK != push_hash(&(filter->delta), &(filter->delta_count), &cap, swapping_uint64_t(hashes[j]))) goto err;
+            }
+            i += chunk;
+        }
+        delta_pos = prev_pos;
+    }
+    if (1 < filter->delta_count) qsort(filter->delta, filter->delta_count, sizeof(uint64_t), hash_cmp);
+    return filter;
+
+err:
+    filter_release_locked(base);
+    filter_release_locked(filter);
+    return NULL;
+}
+
+//0 only if the key is surely not in the footer, any error leaves it to the search
+static int filter_may_contain(struct ctdb *db, struct ctdb_footer *footer, char *key, uint16_t key_len) {
+    pthread_mutex_lock(&(db->filter_lock));
+    struct ctdb_filter *filter = db->filter;
+    if (NULL == filter || filter->filter_pos != footer->filter_pos || filter->delta_pos != footer->delta_pos) {
+        if (NULL == (filter = load_filter_view(db, footer, db->filter))) {
+            pthread_mutex_unlock(&(db->filter_lock));
+            return 1;
+        }
+        filter_release_locked(db->filter);
+        db->filter = filter;  //the reference of the cache
+    }
+    filter->refs += 1;
+    pthread_mutex_unlock(&(db->filter_lock));
+
+    uint64_t hash = key_hash(key, key_len);
+    struct ctdb_filter *base = NULL != filter->base ? filter->base : filter;
+    int res = filter_bits(base->bits, base->blocks, base->hashes, hash, 0) ||
+              (0 < filter->delta_count &&
+               NULL != bsearch(&hash, filter->delta, filter->delta_count, sizeof(hash), hash_cmp));
+    filter_release(db, filter);
+    return res;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MEMTABLE
+///////////////////////////////////////////////////////////////////////////////
+//a buffered put appends its value and leaf but not the path to them: the commit logs the keys in a block
+//chained from the footer, and a skiplist per log generation keeps them in memory for the readers. A commit
+//that takes the log past 'memtable_flush_bytes' applies it to the trie instead, every node it changes is
+//written once, and the next log is a new generation
+#define CTDB_MEMTABLE_HEIGHT 16
+#define CTDB_LOG_ENTRY_SIZE(key_len) (CTDB_I16_LEN + (key_len) + CTDB_I64_LEN + CTDB_CHAR_LEN)  //key_len, key, leaf_pos, is_live
+
+struct memtable_version{
+    off_t leaf_pos;
+    off_t log_pos;  //the block that logged it, the footers from there on see it (0 for the puts of a transaction)
+    uint8_t is_live;
+    struct memtable_version *older;
+};
+
+struct memtable_entry{
+    struct memtable_version *versions;  //the newest first
+    uint16_t key_len;
+    char *key;  //behind the levels
+    struct memtable_entry *next[];
+};
+
+struct ctdb_memtable{
+    off_t first_pos;  //the first block of the generation, 0 for the puts of a transaction
+    off_t head_pos;  //the last block in it, no other generation has a block in between
+    uint64_t rand;  //the heights of the entries
+    struct memtable_entry *head;  //every level, no key
+};
+
+//the keys of a scan, copied out of the skiplists in key order
+struct memtable_scan{
+    struct memtable_item{
+        uint32_t key_offset;  //in 'keys'
+        uint16_t key_len;
+        off_t leaf_pos;
+        uint8_t is_live;
+    } *items;
+    uint32_t count;
+    uint32_t cap;
+    uint32_t next;  //the first one not given to the traversal yet
+    char *keys;
+    uint32_t keys_len;
+    uint32_t keys_cap;
+};
+
+static inline int key_cmp(char *a, uint16_t a_len, char *b, uint16_t b_len) {
+    int res = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    return 0 != res ? res : (int)a_len - (int)b_len;
+}
+
+static struct ctdb_memtable *memtable_new(off_t first_pos) {
+    struct ctdb_memtable *mt = calloc(1, sizeof(*mt));
+    if (NULL == mt) return NULL;
+    if (NULL == (mt->head = calloc(1, sizeof(struct memtable_entry) + CTDB_MEMTABLE_HEIGHT * sizeof(struct memtable_entry *)))) {
+        free(mt);
+        return NULL;
+    }
+    mt->first_pos = first_pos;
+    mt->head_pos = first_pos;
+    mt->rand = 0x9e3779b97f4a7c15ULL;
+    return mt;
+}
+
+static void memtable_free(struct ctdb_memtable *mt) {
+    if (NULL == mt) return;
+    struct memtable_entry *entry = mt->head->next[0];
+    while (NULL != entry) {
+        struct memtable_entry *next = entry->next[0];
+        struct memtable_version *version = entry->versions;
+        while (NULL != version) {
+            struct memtable_version *older = version->older;
+            free(version);
+            version = older;
+        }
+        free(entry);
+        entry = next;
+    }
+    free(mt->head);
+    free(mt);
+}
+
+//the first entry at or after 'key', 'prev' gets the last entry before it on every level
+static struct memtable_entry *memtable_seek(struct ctdb_memtable *mt, char *key, uint16_t key_len, struct memtable_entry **prev) {
+    struct memtable_entry *entry = mt->head;
+    int level = CTDB_MEMTABLE_HEIGHT - 1;
+    for (; 0 <= level; level--) {
+        while (NULL != entry->next[level] && 0 > key_cmp(entry->next[level]->key, entry->next[level]->key_len, key, key_len)) {
+            entry = entry->next[level];
+        }
+        if (NULL != prev) prev[level] = entry;
+    }
+    return entry->next[0];
+}
+
+static int memtable_put(struct ctdb_memtable *mt, char *key, uint16_t key_len, off_t leaf_pos, off_t log_pos, uint8_t is_live) {
+    struct memtable_entry *prev[CTDB_MEMTABLE_HEIGHT];
+    struct memtable_entry *entry = memtable_seek(mt, key, key_len, prev);
+    struct memtable_version *version = malloc(sizeof(*version));
+    if (NULL == version) return CTDB_ERR;
+    *version = (struct memtable_version){.leaf_pos = leaf_pos, .log_pos = log_pos, .is_live = is_live, .older = NULL};
+    if (NULL != entry && 0 == key_cmp(entry->key, entry->key_len, key, key_len)) {
+        version->older = entry->versions;
+        entry->versions = version;
+        return CTDB_OK;
+    }
+
+    int height = 1;
+    for (; height < CTDB_MEMTABLE_HEIGHT; height++) {  //a quarter of the entries go up a level
+        mt->rand ^= mt->rand << 13;
+        mt->rand ^= mt->rand >> 7;
+        mt->rand ^= mt->rand << 17;
+        if (0 != (mt->rand & 3)) break;
+    }
+    if (NULL == (entry = malloc(sizeof(*entry) + height * sizeof(struct memtable_entry *) + key_len))) {
+        free(version);
+        return CTDB_ERR;
+    }
+    entry->versions = version;
+    entry->key_len = key_len;
+    entry->key = (char *)&(entry->next[height]);
+    memcpy(entry->key, key, key_len);
+    int level = 0;
+    for (; level < height; level++) {
+        entry->next[level] = prev[level]->next[level];
+        prev[level]->next[level] = entry;
+    }
+    return CTDB_OK;
+}
+
+//the newest version a footer at 'log_pos' sees
+static inline struct memtable_version *memtable_visible(struct memtable_entry *entry, off_t log_pos) {
+    struct memtable_version *version = entry->versions;
+    while (NULL != version && version->log_pos > log_pos) {
+        version = version->older;
+    }
+    return version;
+}
+
+static int load_log_header(struct ctdb *db, off_t log_pos, off_t *prev_pos, off_t *first_pos, uint64_t *total, uint32_t *count, uint32_t *len) {
+    struct serializer ser = SERIALIZER_INIT(CTDB_LOG_HEADER_SIZE);
+    if (CTDB_LOG_HEADER_SIZE != read_at(db, log_pos, ser.buf, ser.buf_len)) return CTDB_ERR;
+    if (SERIALIZER_OK != SERIALIZER_READ_NUM(ser, *prev_pos, int64_t) ||
+        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, *first_pos, int64_t) ||
+        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, *total, uint64_t) ||
+        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, *count, uint32_t) ||
+        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, *len, uint32_t) ||
+        log_pos <= *prev_pos || log_pos < *first_pos) {
+        return CTDB_ERR;
+    }
+    return CTDB_OK;
+}
+
+//the keys of the block at 'log_pos' become the newest versions in 'mt'
+static int load_log(struct ctdb *db, off_t log_pos, struct ctdb_memtable *mt) {
+    off_t prev_pos = 0, first_pos = 0;
+    uint64_t total = 0;
+    uint32_t count = 0, len = 0, done = 0, i = 0;
+    char *buf = NULL;
+    if (CTDB_OK != load_log_header(db, log_pos, &prev_pos, &first_pos, &total, &count, &len)) goto err;
+    if (NULL == (buf = malloc(len))) goto err;
+    while (done < len) {
+        ssize_t res = read_at(db, log_pos + CTDB_LOG_HEADER_SIZE + done, buf + done, len - done);
+        if (0 >= res) goto err;
+        done += res;
+    }
+    struct serializer ser = {.buf = buf, .buf_len = len, .offset = 0};
+    char key[CTDB_MAX_KEY_LEN];
+    for (; i < count; i++) {
+        uint16_t key_len = 0;
+        off_t leaf_pos = 0;
+        uint8_t is_live = 0;
+        if (SERIALIZER_OK != SERIALIZER_READ_NUM(ser, key_len, uint16_t) ||
+            CTDB_MAX_KEY_LEN < key_len ||
+            SERIALIZER_OK != SERIALIZER_READ_STR(ser, key, key_len) ||
+            SERIALIZER_OK != SERIALIZER_READ_NUM(ser, leaf_pos, int64_t) ||
+            SERIALIZER_OK != SERIALIZER_READ_NUM(ser, is_live, uint8_t)) {
+            goto err;
+        }
+        if (CTDB_OK != memtable_put(mt, key, key_len, leaf_pos, log_pos, is_live)) goto err;
+    }
+    mt->head_pos = log_pos;
+    free(buf);
+    return CTDB_OK;
+
+err:
+    free(buf);
+    return CTDB_ERR;
+}
+
+//the generation that 'footer' sees, with 'memtable_lock' held for reading, or NULL (unlocked) if the log cannot be read.
+//The cache is extended by the blocks logged since, or replaced by the generation of another flush
+static struct ctdb_memtable *memtable_rdlock(struct ctdb *db, struct ctdb_footer *footer) {
+    off_t *blocks = NULL;
+    uint32_t blocks_count = 0, blocks_cap = 0;
+    struct ctdb_memtable *new_mt = NULL;
+    while (1) {
+        pthread_rwlock_rdlock(&(db->memtable_lock));
+        struct ctdb_memtable *mt = db->memtable;
+        if (NULL != mt && mt->first_pos <= footer->log_pos && footer->log_pos <= mt->head_pos) {
+            free(blocks);
+            return mt;
+        }
+        pthread_rwlock_unlock(&(db->memtable_lock));
+
+        pthread_rwlock_wrlock(&(db->memtable_lock));
+        mt = db->memtable;
+        if (NULL == mt || footer->log_pos < mt->first_pos || mt->head_pos < footer->log_pos) {
+            off_t log_pos = footer->log_pos, prev_pos = 0, first_pos = 0;
+            uint64_t total = 0;
+            uint32_t count = 0, len = 0;
+            blocks_count = 0;
+            while (0 < log_pos && (NULL == mt || log_pos != mt->head_pos)) {  //back to the cached blocks, or to the first one
+                if (blocks_count == blocks_cap) {
+                    blocks_cap = 0 < blocks_cap ? blocks_cap * 2 : 64;
+                    off_t *new_blocks = realloc(blocks, blocks_cap * sizeof(off_t));
+                    if (NULL == new_blocks) goto err;
+                    blocks = new_blocks;
+                }
+                blocks[blocks_count++] = log_pos;
+                if (CTDB_OK != load_log_header(db, log_pos, &prev_pos, &first_pos, &total, &count, &len)) goto err;
+                log_pos = prev_pos;
+            }
+            if (0 >= log_pos) {  //another generation
+                if (NULL == (new_mt = memtable_new(blocks[blocks_count - 1]))) goto err;
+                mt = new_mt;
+            }
+            for (; 0 < blocks_count; blocks_count--) {  //the oldest first
+                if (CTDB_OK != load_log(db, blocks[blocks_count - 1], mt)) goto err;
+            }
+            if (NULL != new_mt) {
+                memtable_free(db->memtable);
+                db->memtable = new_mt;
+                new_mt = NULL;
+            }
+        }
+        pthread_rwlock_unlock(&(db->memtable_lock));
+    }
+
+err:
+    pthread_rwlock_unlock(&(db->memtable_lock));  //a block that was half loaded is newer than 'head_pos', nobody sees it
+    memtable_free(new_mt);
+    free(blocks);
+    return NULL;
+}
+
+//the leaf of 'key' in the buffered puts that 'trans' sees: 0 if it is not there, -1 on error
+static off_t memtable_get(struct ctdb_transaction *trans, char *key, uint16_t key_len) {
+    struct memtable_entry *entry = NULL;
+    if (NULL != trans->pending) {
+        entry = memtable_seek(trans->pending, key, key_len, NULL);
+        if (NULL != entry && 0 == key_cmp(entry->key, entry->key_len, key, key_len)) return entry->versions->leaf_pos;
+    }
+    if (0 >= trans->footer.log_pos) return 0;
+    struct ctdb_memtable *mt = memtable_rdlock(trans->db, &(trans->footer));
+    if (NULL == mt) return -1;
+    off_t leaf_pos = 0;
+    entry = memtable_seek(mt, key, key_len, NULL);
+    if (NULL != entry && 0 == key_cmp(entry->key, entry->key_len, key, key_len)) {
+        struct memtable_version *version = memtable_visible(entry, trans->footer.log_pos);
+        if (NULL != version) leaf_pos = version->leaf_pos;
+    }
+    pthread_rwlock_unlock(&(trans->db->memtable_lock));
+    return leaf_pos;
+}
+
+static int scan_push(struct memtable_scan *scan, char *key, uint16_t key_len, off_t leaf_pos, uint8_t is_live) {
+    if (scan->count == scan->cap) {
+        uint32_t new_cap = 0 < scan->cap ? scan->cap * 2 : 256;
+        struct memtable_item *items = realloc(scan->items, new_cap * sizeof(struct memtable_item));
+        if (NULL == items) return CTDB_ERR;
+        scan->items = items;
+        scan->cap = new_cap;
+    }
+    if (scan->keys_cap < scan->keys_len + key_len) {
+        uint32_t new_cap = (scan->keys_len + key_len) * 2;
+        char *keys = realloc(scan->keys, new_cap);
+        if (NULL == keys) return CTDB_ERR;
+        scan->keys = keys;
+        scan->keys_cap = new_cap;
+    }
+    memcpy(scan->keys + scan->keys_len, key, key_len);
+    scan->items[scan->count++] = (struct memtable_item){.key_offset = scan->keys_len, .key_len = key_len, .leaf_pos = leaf_pos, .is_live = is_live};
+    scan->keys_len += key_len;
+    return CTDB_OK;
+}
+
+static void scan_free(struct memtable_scan *scan) {
+    free(scan->items);
+    free(scan->keys);
+}
+
+static int memtable_collect(struct ctdb_memtable *mt, char *prefix, uint16_t prefix_len, off_t log_pos, struct memtable_scan *scan) {
+    struct memtable_entry *entry = 0 < prefix_len ? memtable_seek(mt, prefix, prefix_len, NULL) : mt->head->next[0];
+    for (; NULL != entry && prefix_len <= entry->key_len && (0 == prefix_len || 0 == memcmp(entry->key, prefix, prefix_len)); entry = entry->next[0]) {
+        struct memtable_version *version = memtable_visible(entry, log_pos);
+        if (NULL != version && CTDB_OK != scan_push(scan, entry->key, entry->key_len, version->leaf_pos, version->is_live)) return CTDB_ERR;
+    }
+    return CTDB_OK;
+}
+
+//the buffered keys under 'prefix' that 'trans' sees, in key order, its own puts over the log
+static int memtable_scan_of(struct ctdb_transaction *trans, char *prefix, uint16_t prefix_len, struct memtable_scan *scan) {
+    struct memtable_scan own = {.count = 0}, logged = {.count = 0};
+    if (NULL != trans->pending && CTDB_OK != memtable_collect(trans->pending, prefix, prefix_len, 0, &own)) goto err;
+    if (0 < trans->footer.log_pos) {
+        struct ctdb_memtable *mt = memtable_rdlock(trans->db, &(trans->footer));
+        if (NULL == mt) goto err;
+        int res = memtable_collect(mt, prefix, prefix_len, trans->footer.log_pos, &logged);
+        pthread_rwlock_unlock(&(trans->db->memtable_lock));
+        if (CTDB_OK != res) goto err;
+    }
+    uint32_t i = 0, j = 0;
+    while (i < own.count || j < logged.count) {
+        struct memtable_item *a = i < own.count ? &(own.items[i]) : NULL, *b = j < logged.count ? &(logged.items[j]) : NULL;
+        int cmp = NULL == a ? 1 : NULL == b ? -1 : key_cmp(own.keys + a->key_offset, a->key_len, logged.keys + b->key_offset, b->key_len);
+        if (0 >= cmp) {
+            if (CTDB_OK != scan_push(scan, own.keys + a->key_offset, a->key_len, a->leaf_pos, a->is_live)) goto err;
+            i++;
+            if (0 == cmp) j++;  //put again by the transaction
+        } else {
+            if (CTDB_OK != scan_push(scan, logged.keys + b->key_offset, b->key_len, b->leaf_pos, b->is_live)) goto err;
+            j++;
+        }
+    }
+    scan_free(&own);
+    scan_free(&logged);
+    return CTDB_OK;
+
+err:
+    scan_free(&own);
+    scan_free(&logged);
+    return CTDB_ERR;
+}
+
+//the buffered keys before 'key' (NULL for all the rest) go to the traversal, 'is_hidden' if one of them is 'key'
+static int scan_until(struct ctdb *db, struct memtable_scan *scan, char *key, uint16_t key_len, int64_t now, ctdb_traversal *traversal, uint8_t *is_hidden) {
+    for (; scan->next < scan->count; scan->next++) {
+        struct memtable_item *item = &(scan->items[scan->next]);
+        int cmp = NULL == key ? -1 : key_cmp(scan->keys + item->key_offset, item->key_len, key, key_len);
+        if (0 < cmp) break;
+        if (0 == cmp) *is_hidden = 1;
+        struct ctdb_leaf leaf = {.version = 0, .value_len = 0, .value_pos = -1};
+        if (CTDB_OK != load_leaf(db, item->leaf_pos, &leaf)) return CTDB_ERR;
+        if (LEAF_IS_LIVE(leaf, now) && CTDB_OK != traversal(db->fd, scan->keys + item->key_offset, item->key_len, leaf)) return CTDB_ERR;
+    }
+    return CTDB_OK;
+}
+
+//the puts of the transaction, newest per key, in one block behind the last one of the generation
+static int dump_log(struct ctdb_transaction *trans, uint64_t total, uint32_t count, uint32_t len) {
+    struct ctdb *db = trans->db;
+    struct ctdb_footer *footer = &(trans->footer);
+    off_t prev_pos = footer->log_pos, first_pos = 0;
+    if (0 < prev_pos) {
+        off_t prev_prev_pos = 0;
+        uint64_t prev_total = 0;
+        uint32_t prev_count = 0, prev_len = 0;
+        if (CTDB_OK != load_log_header(db, prev_pos, &prev_prev_pos, &first_pos, &prev_total, &prev_count, &prev_len)) return CTDB_ERR;
+        if (0 == first_pos) first_pos = prev_pos;  //that was the first block
+    }
+    uint32_t buf_len = CTDB_LOG_HEADER_SIZE + len;
+    char *buf = malloc(buf_len);
+    if (NULL == buf) return CTDB_ERR;
+    struct serializer ser = {.buf = buf, .buf_len = buf_len, .offset = 0};
+    if (SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, prev_pos, int64_t) ||
+        SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, first_pos, int64_t) ||
+        SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, total, uint64_t) ||
+        SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, count, uint32_t) ||
+        SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, len, uint32_t)) {
+        goto err;
+    }
+    struct memtable_entry *entry = trans->pending->head->next[0];
+    for (; NULL != entry; entry = entry->next[0]) {
+        if (SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, entry->key_len, uint16_t) ||
+            SERIALIZER_OK != SERIALIZER_WRITE_BYTES(ser, entry->key, entry->key_len) ||
+            SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, entry->versions->leaf_pos, int64_t) ||
+            SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, entry->versions->is_live, uint8_t)) {
+            goto err;
+        }
+    }
+    off_t log_pos = append_to_end(db, buf, buf_len);
+    if (0 >= log_pos) goto err;
+    footer->log_pos = log_pos;
+    trans->written_bytes += buf_len;  //garbage once flushed, never counted as live
+    free(buf);
+    return CTDB_OK;
+
+err:
+    free(buf);
+    return CTDB_ERR;
+}
+
+//the nodes of the batch under 'node_pos' are written, the children first
+static off_t batch_write(struct ctdb *db, struct ctdb_batch *batch, off_t node_pos) {
+    if (CTDB_BATCH_BASE > node_pos) return node_pos;  //in the file already
+    struct ctdb_node *node = malloc(sizeof(*node));
+    if (NULL == node || CTDB_OK != batch_load(batch, node_pos, node)) goto err;
+    int items_index = 0;
+    for (; items_index < node->items_count; items_index++) {
+        off_t sub_node_pos = batch_write(db, batch, node->items[items_index].sub_node_pos);
+        if (0 >= sub_node_pos) goto err;
+        node->items[items_index].sub_node_pos = sub_node_pos;
+    }
+    node_pos = dump_node(db, NULL, node);
+    free(node);
+    return node_pos;
+
+err:
+    free(node);
+    return -1;
+}
+
+//every buffered key the transaction sees goes to the trie, in key order. The nodes stay in the batch until
+//the last key, so a node on the paths of many keys is written once. The leaves a key had before in the same
+//log are not counted as dead, a vacuum counts them again
+static int flush_memtable(struct ctdb_transaction *trans) {
+    struct ctdb *db = trans->db;
+    struct ctdb_footer *footer = &(trans->footer);
+    struct memtable_scan scan = {.count = 0};
+    struct ctdb_batch batch = {.count = 0};
+    if (CTDB_OK != memtable_scan_of(trans, NULL, 0, &scan)) goto err;
+
+    off_t root_pos = footer->root_pos;
+    uint64_t dead_bytes = 0;
+    uint32_t i = 0;
+    for (; i < scan.count; i++) {
+        struct memtable_item *item = &(scan.items[i]);
+        struct ctdb_node root = {.prefix_len = 0, .leaf_pos = 0, .items_count = 0};
+        if (0 < root_pos) {
+            if (CTDB_OK != load_batch_node(db, &batch, root_pos, &root)) goto err;
+            dead_bytes += NODE_DISK_SIZE(&root);
+        }
+        root_pos = append_node_to_file(db, &batch, &root, scan.keys + item->key_offset, item->key_len, 0, item->leaf_pos, item->is_live, &dead_bytes, NULL);
+        if (0 >= root_pos) goto err;
+    }
+    dead_bytes -= batch.loaded_bytes;  //the copies in the batch were never in the file
+
+    uint64_t appended_bytes = db->appended_bytes;
+    if (0 < root_pos && 0 >= (root_pos = batch_write(db, &batch, root_pos))) goto err;
+    appended_bytes = db->appended_bytes - appended_bytes;
+    trans->written_bytes += appended_bytes;
+    footer->live_bytes += appended_bytes - dead_bytes;
+    footer->root_pos = root_pos;
+    footer->log_pos = 0;
+    STATS_ADD(db, memtable_flushes, 1);
+    batch_free(&batch);
+    scan_free(&scan);
+    return CTDB_OK;
+
+err:
+    batch_free(&batch);
+    scan_free(&scan);
+    return CTDB_ERR;
+}
+
+//the puts of the transaction are logged, or the whole log goes to the trie once it is big enough
+static int commit_memtable(struct ctdb_transaction *trans) {
+    struct ctdb_footer *footer = &(trans->footer);
+    if (NULL == trans->pending && 0 >= footer->log_pos) return CTDB_OK;  //nothing is buffered
+    uint64_t total = 0;
+    uint32_t count = 0, len = 0;
+    if (0 < footer->log_pos) {
+        off_t prev_pos = 0, first_pos = 0;
+        uint32_t prev_count = 0, prev_len = 0;
+        if (CTDB_OK != load_log_header(trans->db, footer->log_pos, &prev_pos, &first_pos, &total, &prev_count, &prev_len)) return CTDB_ERR;
+    }
+    if (NULL != trans->pending) {
+        struct memtable_entry *entry = trans->pending->head->next[0];
+        for (; NULL != entry; entry = entry->next[0]) {
+            count += 1;
+            len += CTDB_LOG_ENTRY_SIZE(entry->key_len);
+        }
+        total += CTDB_LOG_HEADER_SIZE + len;
+    }
+    uint64_t flush_bytes = __atomic_load_n(&(trans->db->memtable_flush_bytes), __ATOMIC_RELAXED);
+    if (trans->is_flushing || 0 == flush_bytes || flush_bytes <= total) return flush_memtable(trans);
+    if (NULL == trans->pending) return CTDB_OK;  //the log stays as it is
+    return dump_log(trans, total, count, len);
+}
+
+//the puts that were just logged extend the cached generation, the next readers need not read the block back
+static void memtable_cache_log(struct ctdb *db, off_t prev_log_pos, off_t log_pos, struct ctdb_memtable *pending) {
+    pthread_rwlock_wrlock(&(db->memtable_lock));
+    struct ctdb_memtable *mt = db->memtable;
+    if (0 >= prev_log_pos) {  //the first block of a generation
+        if (NULL != (mt = memtable_new(log_pos))) {
+            memtable_free(db->memtable);
+            db->memtable = mt;
+        }
+    } else if (NULL != mt && mt->head_pos != prev_log_pos) {
+        mt = NULL;  //read from the file when it is asked for
+    }
+    struct memtable_entry *entry = NULL != mt ? pending->head->next[0] : NULL;
+    for (; NULL != entry; entry = entry->next[0]) {
+        if (CTDB_OK != memtable_put(mt, entry->key, entry->key_len, entry->versions->leaf_pos, log_pos, entry->versions->is_live)) {
+            memtable_free(db->memtable);
+            db->memtable = mt = NULL;
+            break;
+        }
+    }
+    if (NULL != mt) mt->head_pos = log_pos;
+    pthread_rwlock_unlock(&(db->memtable_lock));
+}
+
+static void free_pending(struct ctdb_transaction *trans) {
+    memtable_free(trans->pending);
+    trans->pending = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// INDEX
+///////////////////////////////////////////////////////////////////////////////
+#define INDEX_CHECK_SEED 0x6a09e667f3bcc909ULL  //a second hash, two keys must agree on 128 bits to be mistaken
+#define INDEX_MATCHES(index, footer) \
+    ((index)->footer.root_pos == (footer)->root_pos && (index)->footer.tran_count == (footer)->tran_count && \
+     (index)->footer.del_count == (footer)->del_count)
+
+//a mapped '<path>-idx', immutable, replaced ones stay mapped until ctdb_close (a reader may still probe them)
+struct ctdb_index{
+    struct ctdb_footer footer;  //of the root it was built for
+    uint64_t slots;  //a power of 2, open addressing
+    char *map;
+    size_t map_len;
+    struct ctdb_index *retired;
+};
+
+struct index_slot{
+    uint64_t hash;
+    uint64_t check;
+    off_t leaf_pos;  //0 for an empty slot
+};
+
+static int index_travel(struct ctdb *db, off_t trav_pos, char *key, uint16_t key_len, struct index_slot *table, uint64_t slots, uint64_t *count) {
+    struct ctdb_node trav = {.prefix_len = 0, .leaf_pos = 0, .items_count = 0};
+    if (CTDB_OK != load_node(db, trav_pos, &trav)) return CTDB_ERR;
+    if (CTDB_MAX_KEY_LEN < key_len + trav.prefix_len) return CTDB_ERR;
+    memcpy(key + key_len, trav.prefix, trav.prefix_len);
+    key_len += trav.prefix_len;
+    if (0 < trav.leaf_pos) {
+        struct ctdb_leaf leaf = {.version = 0, .value_len = 0, .value_pos = -1};
+        if (CTDB_OK != load_leaf(db, trav.leaf_pos, &leaf)) return CTDB_ERR;
+        if (0 < leaf.value_len) {
+            if (slots / 2 < ++*count) return CTDB_ERR;  //more keys than the root counted
+            uint64_t hash = key_hash(key, key_len), slot = hash & (slots - 1);
+            while (0 < table[slot].leaf_pos) {
+                slot = (slot + 1) & (slots - 1);
+            }
+            table[slot] = (struct index_slot){.hash = hash, .check = key_hash_seeded(key, key_len, INDEX_CHECK_SEED), .leaf_pos = trav.leaf_pos};
+        }
+    }
+    int items_index = 0;
+    for (; items_index < trav.items_count; items_index++) {
+        if (CTDB_OK != index_travel(db, trav.items[items_index].sub_node_pos, key, key_len, table, slots, count)) return CTDB_ERR;
+    }
+    return CTDB_OK;
+}
+
+static struct ctdb_index *map_index(struct ctdb *db, int fd) {
+    struct ctdb_index *index = calloc(1, sizeof(*index));
+    struct stat st;
+    char magic[CTDB_MAGIC_LEN];
+    if (NULL == index || 0 != fstat(fd, &st) || CTDB_INDEX_HEADER_SIZE > st.st_size) goto err;
+    index->map_len = st.st_size;
+    index->map = mmap(NULL, index->map_len, PROT_READ, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == index->map) goto err;
+    struct serializer ser = {.buf = index->map, .buf_len = CTDB_INDEX_HEADER_SIZE, .offset = 0};
+    off_t footer_pos = 0;
+    if (SERIALIZER_OK != SERIALIZER_READ_BYTES(ser, magic, CTDB_MAGIC_LEN) ||
+        0 != memcmp(magic, CTDB_INDEX_MAGIC_STR, CTDB_MAGIC_LEN) ||
+        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, footer_pos, int64_t) ||
+        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, index->slots, uint64_t)) {
+        goto err;
+    }
+    if (0 == index->slots || 0 != (index->slots & (index->slots - 1)) ||
+        CTDB_INDEX_HEADER_SIZE + index->slots * CTDB_INDEX_SLOT_SIZE != index->map_len) {
+        goto err;
+    }
+    //the footer must still be in the file, a file written again from scratch has another one there
+    if (CTDB_OK != parse_footer(db, footer_pos, file_end(db), &(index->footer))) goto err;
+    return index;
+
+err:
+    if (NULL != index && NULL != index->map && MAP_FAILED != index->map) munmap(index->map, index->map_len);
+    free(index);
+    return NULL;
+}
+
+static void install_index(struct ctdb *db, struct ctdb_index *index) {
+    index->retired = __atomic_load_n(&(db->index), __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&(db->index), &(index->retired), index, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+static void load_index(struct ctdb *db) {
+    char index_path[PATH_MAX];
+    if (sizeof(index_path) <= snprintf(index_path, sizeof(index_path), "%s%s", db->path, CTDB_INDEX_SUFFIX)) return;
+    int fd = open(index_path, O_RDONLY);
+    if (0 > fd) return;  //none, or not readable, the trie answers everything
+    struct ctdb_index *index = map_index(db, fd);
+    close(fd);
+    if (NULL != index) install_index(db, index);
+}
+
+static void close_index(struct ctdb *db) {
+    struct ctdb_index *index = db->index;
+    while (NULL != index) {
+        struct ctdb_index *retired = index->retired;
+        munmap(index->map, index->map_len);
+        free(index);
+        index = retired;
+    }
+    db->index = NULL;
+}
+
+//the leaf of the key, 0 if the index has no such key, -1 without an index for the root of 'footer'
+static off_t index_probe(struct ctdb *db, struct ctdb_footer *footer, char *key, uint16_t key_len) {
+    struct ctdb_index *index = __atomic_load_n(&(db->index), __ATOMIC_ACQUIRE);
+    if (NULL == index || !INDEX_MATCHES(index, footer)) return -1;
+    uint64_t hash = key_hash(key, key_len), check = key_hash_seeded(key, key_len, INDEX_CHECK_SEED);
+    uint64_t slot = hash & (index->slots - 1), probes = 0;
+    for (; probes < index->slots; probes++) {
+        struct serializer ser = {.buf = index->map + CTDB_INDEX_HEADER_SIZE + slot * CTDB_INDEX_SLOT_SIZE, .buf_len = CTDB_INDEX_SLOT_SIZE, .offset = 0};
+        struct index_slot entry = {.hash = 0, .check = 0, .leaf_pos = 0};
+        if (SERIALIZER_OK != SERIALIZER_READ_NUM(ser, entry.hash, uint64_t) ||
+            SERIALIZER_OK != SERIALIZER_READ_NUM(ser, entry.check, uint64_t) ||
+            SERIALIZER_OK != SERIALIZER_READ_NUM(ser, entry.leaf_pos, int64_t)) {
+            return -1;
+        }
+        if (0 >= entry.leaf_pos) return 0;
+        if (hash == entry.hash && check == entry.check) return entry.leaf_pos;
+        slot = (slot + 1) & (index->slots - 1);
+    }
+    return 0;
+}
+
+//written next to the file and renamed over the old one, then mapped
+static int dump_index(struct ctdb *db, struct ctdb_footer *footer) {
+    char index_path[PATH_MAX], tmp_path[PATH_MAX];
+    char key[CTDB_MAX_KEY_LEN];
+    struct index_slot *table = NULL;
+    char *buf = NULL;
+    int fd = -1;
+    if (sizeof(index_path) <= snprintf(index_path, sizeof(index_path), "%s%s", db->path, CTDB_INDEX_SUFFIX) ||
+        sizeof(tmp_path) <= snprintf(tmp_path, sizeof(tmp_path), "%s%s.tmp", db->path, CTDB_INDEX_SUFFIX)) {
+        goto err;
+    }
+
+    //at most half full, the root counts the keys
+    uint64_t keys = 0, slots = 16, count = 0;
+    struct ctdb_node root = {.prefix_len = 0, .leaf_pos = 0, .items_count = 0};
+    if (0 < footer->root_pos) {
+        if (CTDB_OK != load_node(db, footer->root_pos, &root)) goto err;
+        keys = root.count;
+    }
+    while (slots < keys * 2) {
+        slots *= 2;
+    }
+    if (NULL == (table = calloc(slots, sizeof(*table)))) goto err;
+    if (0 < footer->root_pos && CTDB_OK != index_travel(db, footer->root_pos, key, 0, table, slots, &count)) goto err;
+
+    if (0 > (fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0666))) goto err;
+    uint64_t i = 0, batch = 4096;
+    if (NULL == (buf = malloc(batch * CTDB_INDEX_SLOT_SIZE))) goto err;
+    struct serializer ser = {.buf = buf, .buf_len = CTDB_INDEX_HEADER_SIZE, .offset = 0};
+    if (SERIALIZER_OK != SERIALIZER_WRITE_BYTES(ser, CTDB_INDEX_MAGIC_STR, CTDB_MAGIC_LEN) ||
+        SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, footer->pos, int64_t) ||
+        SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, slots, uint64_t) ||
+        CTDB_INDEX_HEADER_SIZE != write(fd, buf, CTDB_INDEX_HEADER_SIZE)) {
+        goto err;
+    }
+    while (i < slots) {
+        ser = (struct serializer){.buf = buf, .buf_len = batch * CTDB_INDEX_SLOT_SIZE, .offset = 0};
+        for (; i < slots && ser.offset < (off_t)ser.buf_len; i++) {
+            if (SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, table[i].hash, uint64_t) ||
+                SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, table[i].check, uint64_t) ||
+                SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, table[i].leaf_pos, int64_t)) {
+                goto err;
+            }
+        }
+        if (ser.offset != write(fd, buf, ser.offset)) goto err;
+    }
+    STATS_ADD(db, fsyncs, 1);
+    if (0 != fdatasync(fd) || 0 != rename(tmp_path, index_path)) goto err;
+
+    struct ctdb_index *index = map_index(db, fd);
+    if (NULL == index) goto err;
+    install_index(db, index);
+    close(fd);
+    free(table);
+    free(buf);
+    return CTDB_OK;
+
+err:
+    if (0 <= fd) {
+        close(fd);
+        unlink(tmp_path);
+    }
+    free(table);
+    free(buf);
+    return CTDB_ERR;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// USAGE
+///////////////////////////////////////////////////////////////////////////////
+static void footer_usage(struct ctdb *db, struct ctdb_footer *footer, struct ctdb_usage *usage) {
+    usage->file_bytes = footer->pos + CTDB_FOOTER_SIZE;
+    if (0 < db->segment_size) usage->file_bytes = db->sealed_bytes + SEGMENT_OFFSET(footer->pos) + CTDB_FOOTER_SIZE;
+    usage->live_bytes = footer->live_bytes < usage->file_bytes ? footer->live_bytes : usage->file_bytes;  //it is an estimate
+    usage->dead_bytes = usage->file_bytes - usage->live_bytes;
+    usage->garbage_ratio = (double)usage->dead_bytes / usage->file_bytes;
+}
+
+static void check_vacuum_policy(struct ctdb *db, struct ctdb_footer *footer) {
+    ctdb_vacuum_hook *hook = db->vacuum_hook;
+    if (NULL == hook) return;
+    struct ctdb_usage usage;
+    footer_usage(db, footer, &usage);
+    if (usage.file_bytes < db->vacuum_min_bytes || usage.garbage_ratio < db->vacuum_ratio) {
+        db->is_vacuum_fired = 0;  //armed again
+        return;
+    }
+    if (db->is_vacuum_fired) return;
+    db->is_vacuum_fired = 1;
+    hook(db->vacuum_arg, db, &usage);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// API
+///////////////////////////////////////////////////////////////////////////////
+struct ctdb *ctdb_open(char *path) {
+    return ctdb_open_segmented(path, 0);  //or whatever the file was created with
+}
+
+struct ctdb *ctdb_open_segmented(char *path, off_t segment_size) {
+    struct ctdb *db = NULL;
+    int fd = -1;
+    if (NULL == path || 0 > segment_size || (1LL << CTDB_SEGMENT_SHIFT) <= segment_size) goto err;
+
+    db = calloc(1, sizeof(*db));
+    if (NULL == db) goto err;
+    pthread_mutex_init(&(db->filter_lock), NULL);
+    pthread_rwlock_init(&(db->pinned_lock), NULL);
+    pthread_mutex_init(&(db->pinning_lock), NULL);
+    pthread_mutex_init(&(db->pipeline_lock), NULL);
+    pthread_mutex_init(&(db->readers_lock), NULL);
+    pthread_cond_init(&(db->pipeline_cond), NULL);
+    pthread_rwlock_init(&(db->memtable_lock), NULL);
+    db->pending_fd = -1;
+    db->pinned_levels = CTDB_PINNED_LEVELS;
+    if (NULL == (db->path = strdup(path))) goto err;
+    int i = 0;
+    for (; i < CTDB_MAX_SEGMENTS; i++) {
+        db->segment_fds[i] = -1;
+    }
+
+    if (-1 == access(path, F_OK)) {
+        fd = open(path, O_RDWR | O_CREAT, 0666);
+        if (0 > fd) goto err;
+        db->fd = fd;
+        db->segment_size = segment_size;
+        if (SERIALIZER_OK != dump_header(db, 0)) goto err;
+        db->end_pos = CTDB_HEADER_SIZE;
+        if (SERIALIZER_OK != dump_footer(db, &(struct ctdb_footer){ .tran_count=0, .del_count=0, .root_pos=0, .prev_pos=0, .live_bytes=0 })) goto err;
+        if (CTDB_OK != sync_file(db)) goto err;
+    } else {
+        fd = open(path, O_RDWR);
+        if (0 > fd) goto err;
+        db->fd = fd;
+        if (SERIALIZER_OK != check_header(db)) goto err;
+        if (0 < db->segment_size && CTDB_OK != find_segments(db)) goto err;
+    }
+    if (CTDB_OK != open_committed(db, path)) goto err;
+    load_index(db);
+    struct ctdb_footer committed;
+    read_committed(db, &committed);
+    pin_root(db, committed.root_pos);  //best effort, the file answers what is not pinned
+    return db;
+
+err:
+    if (NULL != db) {
+        close_committed(db);
+        close_segments(db);
+        pthread_mutex_destroy(&(db->filter_lock));
+        pthread_rwlock_destroy(&(db->pinned_lock));
+        pthread_mutex_destroy(&(db->pinning_lock));
+        pthread_mutex_destroy(&(db->pipeline_lock));
+        pthread_mutex_destroy(&(db->readers_lock));
+        pthread_cond_destroy(&(db->pipeline_cond));
+        pthread_rwlock_destroy(&(db->memtable_lock));
+        free(db->path);
+        free(db);
+    }
+    if (0 <= fd) close(fd);
+    return NULL;
+}
+
+void ctdb_close(struct ctdb **db) {
+    if (NULL == db || NULL == *db) return;
+    pipeline_close(*db);
+    close_committed(*db);
+    close_segments(*db);
+    if (0 <= (*db)->fd) 
+        close((*db)->fd);
+    filter_release_locked((*db)->filter);
+    close_index(*db);
+    free_pinned((*db)->pinned);
+    pthread_rwlock_destroy(&((*db)->pinned_lock));
+    pthread_mutex_destroy(&((*db)->pinning_lock));
+    pthread_mutex_destroy(&((*db)->filter_lock));
+    pthread_mutex_destroy(&((*db)->pipeline_lock));
+    pthread_mutex_destroy(&((*db)->readers_lock));
+    pthread_cond_destroy(&((*db)->pipeline_cond));
+    memtable_free((*db)->memtable);
+    dedup_free((*db)->dedup);
+    pthread_rwlock_destroy(&((*db)->memtable_lock));
+    free((*db)->path);
+    free((*db)->histograms);
+    free(*db);
+    *db = NULL;
+}
+
+int ctdb_set_preallocate(struct ctdb *db, off_t chunk_size) {
+    if (NULL == db || 0 > chunk_size) return CTDB_ERR;
+    db->prealloc_size = chunk_size;
+    return CTDB_OK;
+}
+
+int ctdb_set_pinned_levels(struct ctdb *db, uint8_t levels) {
+    if (NULL == db) return CTDB_ERR;
+    struct ctdb_footer committed;
+    read_committed(db, &committed);
+    pthread_mutex_lock(&(db->pinning_lock));
+    db->pinned_levels = levels;
+    struct ctdb_pinned *pinned = db->pinned;
+    pthread_rwlock_wrlock(&(db->pinned_lock));
+    __atomic_store_n(&(db->pinned), NULL, __ATOMIC_RELEASE);  //pinned again below, to the new depth
+    pthread_rwlock_unlock(&(db->pinned_lock));
+    pthread_mutex_unlock(&(db->pinning_lock));
+    free_pinned(pinned);
+    return pin_root(db, committed.root_pos);
+}
+
+int ctdb_set_memtable(struct ctdb *db, uint64_t flush_bytes) {
+    if (NULL == db) return CTDB_ERR;
+    __atomic_store_n(&(db->memtable_flush_bytes), flush_bytes, __ATOMIC_RELAXED);  //the next commit flushes if the log is already bigger
+    return CTDB_OK;
+}
+
+int ctdb_set_dedup(struct ctdb *db, uint32_t min_len) {
+    if (NULL == db) return CTDB_ERR;
+    if (0 < min_len && NULL == db->dedup && NULL == (db->dedup = dedup_new())) return CTDB_ERR;
+    if (0 == min_len) {
+        dedup_free(db->dedup);
+        db->dedup = NULL;
+    }
+    db->dedup_min_len = min_len;
+    return CTDB_OK;
+}
+
+int ctdb_flush_memtable(struct ctdb_transaction *trans) {
+    if (NULL == trans || 1 != trans->is_isvalid || trans->is_readonly) return CTDB_ERR;
+    trans->is_flushing = 1;  //on commit
+    return CTDB_OK;
+}
+
+struct ctdb_transaction *ctdb_transaction_begin(struct ctdb *db) {
+    struct ctdb_transaction *trans = calloc(1, sizeof(*trans));
+    if (NULL != trans && CTDB_OK != reader_enter(db)) {
+        free(trans);
+        return NULL;
+    }
+    if (NULL != trans) {
+        trans->is_reader = 1;
+        read_latest(db, &(trans->footer));  //the last transaction, published by whichever process committed it, or pipelined by this one
+        trans->is_isvalid = 1;
+        trans->db = db;
+        struct ctdb_pinned *pinned = __atomic_load_n(&(db->pinned), __ATOMIC_ACQUIRE);
+        if (0 < db->pinned_levels && (NULL == pinned || pinned->root_pos != trans->footer.root_pos)) {
+            pin_root(db, trans->footer.root_pos);  //another process committed
+        }
+    }
+    return trans;
+}
+
+//the leaf that 'key' has in 'trans', live or not: 0 if it has none, -1 on error
+static off_t find_leaf(struct ctdb_transaction *trans, char *key, uint16_t key_len) {
+    off_t leaf_pos = 0;
+    if (NULL != trans->pending || 0 < trans->footer.log_pos) {  //the buffered puts are newer than the trie
+        if (0 > (leaf_pos = memtable_get(trans, key, key_len))) return -1;
+    }
+    if (0 < leaf_pos) {
+        STATS_ADD(trans->db, memtable_hits, 1);
+        return leaf_pos;
+    }
+    if (0 >= trans->footer.root_pos) return 0;
+    if (0 <= (leaf_pos = index_probe(trans->db, &(trans->footer), key, key_len))) {
+        STATS_ADD(trans->db, index_probes, 1);
+        return leaf_pos;  //the index has every key of the root
+    }
+    //the filter of the footer has not seen the puts of 'trans' (they are in its filter_hashes until the commit)
+    if (0 < trans->footer.filter_pos && 0 == trans->filter_count && !filter_may_contain(trans->db, &(trans->footer), key, key_len)) {
+        STATS_ADD(trans->db, filter_negatives, 1);
+        return 0;
+    }
+
+    //search the prefix nodes related to key from the file
+    STATS_ADD(trans->db, lookups, 1);
+    off_t sub_node_pos = find_node_from_file(trans->db, trans->footer.root_pos, key, key_len, 0, 0, NULL);  //not fuzzy match
+    if (0 >= sub_node_pos) return 0;  //node not found
+
+    //load node from the file
+    struct ctdb_node sub_node = {.prefix_len = 0, .leaf_pos = 0, .items_count = 0};
+    if (CTDB_OK != load_node(trans->db, sub_node_pos, &sub_node)) return -1;
+    return sub_node.leaf_pos;  //0 if the node has no leaf
+}
+
+struct ctdb_leaf ctdb_get(struct ctdb_transaction *trans, char *key, uint16_t key_len) {
+    TRACE_BEGIN(NULL != trans ? trans->db : NULL, CTDB_OP_GET, key_len);
+    if (NULL == trans || 1 != trans->is_isvalid) goto err;  //verify that the transaction has not been committed or rolled back
+    if (0 >= key_len || CTDB_MAX_KEY_LEN < key_len || NULL == key) goto err;
+    off_t leaf_pos = find_leaf(trans, key, key_len);
+    if (0 >= leaf_pos) goto err;
+
+    //load leaf from the file
+    struct ctdb_leaf leaf = {.version = 0, .value_len = 0, .value_pos = -1};
+    if (CTDB_OK != load_leaf(trans->db, leaf_pos, &leaf)) goto err;
+    if (!LEAF_IS_LIVE(leaf, time(NULL))) goto err;  //the data has been deleted or has expired
+    TRACE_END(trans->db);
+    return leaf;
+
+err:
+    TRACE_END(NULL != trans ? trans->db : NULL);
+    return (struct ctdb_leaf){.version = 0, .value_len = 0, .value_pos = -1};
+}
+
+int ctdb_put(struct ctdb_transaction *trans, char *key, uint16_t key_len, char *value, uint32_t value_len) {
+    return ctdb_put_expire(trans, key, key_len, value, value_len, 0);  //never expires
+}
+
+//the value comes from 'value', or from 'value_fd' if it is NULL. With a 'check' it is written if the leaf
+//the key has passes it, CTDB_CONFLICT otherwise
+static int put_value(struct ctdb_transaction *trans, char *key, uint16_t key_len, char *value, int value_fd, uint32_t value_len, int64_t expire, struct put_check *check) {
+    TRACE_BEGIN(NULL != trans ? trans->db : NULL, CTDB_OP_PUT, key_len);
     if (NULL == trans || 1 != trans->is_isvalid) goto err;  //verify that the transaction has not been committed or rolled back
     if (0 >= key_len || CTDB_MAX_KEY_LEN < key_len || NULL == key) goto err;
-    if (CTDB_MAX_VALUE_LEN < value_len || NULL == value) goto err;  //if value_len is 0, that means delete (whether it exists or not)
+    if (CTDB_MAX_VALUE_LEN < value_len || (NULL == value && 0 > value_fd)) goto err;  //if value_len is 0, that means delete (whether it exists or not)
+    if (trans->is_readonly) goto err;  //snapshots cannot be written
+    if (CTDB_OK != writer_begin(trans)) goto err;
 
+    //buffered, the path to the leaf is written by the flush of the memtable
+    uint8_t is_buffered = NULL != trans->pending || 0 < trans->footer.log_pos || 0 < __atomic_load_n(&(trans->db->memtable_flush_bytes), __ATOMIC_RELAXED);
     struct ctdb_node root = {.prefix_len = 0, .leaf_pos = 0, .items_count = 0};
-    if (0 < trans->footer.root_pos) {
-        if (CTDB_OK != load_node(trans->db->fd, trans->footer.root_pos, &root)) goto err;
+    uint64_t dead_bytes = 0;
+    if (!is_buffered && 0 < trans->footer.root_pos) {
+        if (CTDB_OK != load_node(trans->db, trans->footer.root_pos, &root)) goto err;
+        TRACE_DEPTH(1);
+        dead_bytes += NODE_DISK_SIZE(&root);
+    }
+
+    //append the value and leaf node to the file, a checked one where its key is found
+    uint64_t appended_bytes = trans->db->appended_bytes;
+    off_t new_leaf_pos = 0;
+    uint8_t is_live = 0 < value_len;
+    uint64_t shared_bytes = 0;
+    if (NULL == check) {
+        if (0 >= (new_leaf_pos = dump_value_leaf(trans->db, value, value_fd, value_len, trans->footer.tran_count, expire, &shared_bytes))) goto err;
+    } else {
+        check->value = value;
+        check->value_len = value_len;
+        check->version = trans->footer.tran_count;
+        check->expire = expire;
+    }
+
+    if (is_buffered) {
+        if (NULL != check) {  //no path to copy, the search is the only descent
+            struct ctdb_leaf old_leaf = {.version = 0, .value_len = 0, .value_pos = -1};
+            off_t old_leaf_pos = find_leaf(trans, key, key_len);
+            if (0 > old_leaf_pos || (0 < old_leaf_pos && CTDB_OK != load_leaf(trans->db, old_leaf_pos, &old_leaf))) goto err;
+            if (CTDB_OK != check_leaf(trans->db, check, LEAF_IS_LIVE(old_leaf, time(NULL)) ? &old_leaf : NULL, &new_leaf_pos, &is_live)) goto err;
+        }
+        if (NULL == trans->pending && NULL == (trans->pending = memtable_new(0))) goto err;
+        if (CTDB_OK != memtable_put(trans->pending, key, key_len, new_leaf_pos, 0, is_live)) goto err;
+    } else {
+        //update the prefix nodes (append only)
+        off_t new_root_pos = append_node_to_file(trans->db, NULL, &root, key, key_len, 0, new_leaf_pos, is_live, &dead_bytes, check);
+        if (0 >= new_root_pos) goto err;
+        trans->footer.root_pos = new_root_pos;
+    }
+    if (NULL != check) shared_bytes = check->shared_bytes;
+    trans->payload_bytes += key_len + value_len;
+    appended_bytes = trans->db->appended_bytes - appended_bytes;  //everything from the value to the new root
+    trans->written_bytes += appended_bytes;
+    if (0 >= value_len) dead_bytes += CTDB_LEAF_SIZE;  //the leaf of a delete is garbage from the start
+    trans->footer.live_bytes += appended_bytes + shared_bytes - dead_bytes;  //a shared value counts once per leaf, as it is dead once per leaf
+
+    //cumulative the operation count (the transaction is not written to the file until committed)
+    trans->footer.tran_count += 1;
+    if (0 >= value_len)
+        trans->footer.del_count += 1;
+    if (0 < trans->footer.filter_pos && 0 < value_len &&
+        CTDB_OK != push_hash(&(trans->filter_hashes), &(trans->filter_count), &(trans->filter_cap), key_hash(key, key_len))) {
+        trans->footer.filter_pos = 0;  //better no filter than one that misses the key
+        trans->footer.delta_pos = 0;
+    }
+    TRACE_END(trans->db);
+    return CTDB_OK;
+
+err:
+    TRACE_END(NULL != trans ? trans->db : NULL);
+    return NULL != check && check->is_conflict ? CTDB_CONFLICT : CTDB_ERR;
+}
+
+int ctdb_put_expire(struct ctdb_transaction *trans, char *key, uint16_t key_len, char *value, uint32_t value_len, int64_t expire) {
+    if (NULL == value) return CTDB_ERR;
+    return put_value(trans, key, key_len, value, -1, value_len, expire, NULL);
+}
+
+int ctdb_put_from_fd(struct ctdb_transaction *trans, char *key, uint16_t key_len, int fd, uint32_t value_len) {
+    if (0 > fd) return CTDB_ERR;
+    return put_value(trans, key, key_len, NULL, fd, value_len, 0, NULL);  //never expires
+}
+
+int ctdb_del(struct ctdb_transaction *trans, char *key, uint16_t key_len) {
+    return ctdb_put(trans, key, key_len, "", 0);
+}
+
+int ctdb_cas(struct ctdb_transaction *trans, char *key, uint16_t key_len, uint64_t expected_version, char *value, uint32_t value_len) {
+    if (NULL == value) return CTDB_ERR;
+    struct put_check check = {.kind = CHECK_VERSION, .expected_version = expected_version};
+    return put_value(trans, key, key_len, value, -1, value_len, 0, &check);
+}
+
+int ctdb_put_if_absent(struct ctdb_transaction *trans, char *key, uint16_t key_len, char *value, uint32_t value_len) {
+    if (NULL == value || 0 >= value_len) return CTDB_ERR;  //a delete of a key that is not there
+    struct put_check check = {.kind = CHECK_ABSENT};
+    return put_value(trans, key, key_len, value, -1, value_len, 0, &check);
+}
+
+int ctdb_incr(struct ctdb_transaction *trans, char *key, uint16_t key_len, int64_t delta, int64_t *counter) {
+    struct put_check check = {.kind = CHECK_INCR, .delta = delta};
+    int res = put_value(trans, key, key_len, check.counter_buf, -1, CTDB_I64_LEN, 0, &check);
+    if (CTDB_OK == res && NULL != counter) *counter = check.counter;
+    return res;
+}
+
+int ctdb_read_value(struct ctdb *db, struct ctdb_leaf *leaf, char *value) {
+    if (NULL == db || NULL == leaf || NULL == value || 0 >= leaf->value_pos) return CTDB_ERR;
+    uint32_t done = 0;
+    while (done < leaf->value_len) {
+        ssize_t res = read_at(db, leaf->value_pos + done, value + done, leaf->value_len - done);
+        if (0 > res && EINTR == errno) continue;
+        if (0 >= res) return CTDB_ERR;
+        done += res;
+    }
+    return CTDB_OK;
+}
+
+int ctdb_read_value_at(struct ctdb *db, struct ctdb_leaf *leaf, uint32_t offset, char *buf, uint32_t len, uint32_t *read_len) {
+    if (NULL == db || NULL == leaf || NULL == buf || NULL == read_len || 0 >= leaf->value_pos) return CTDB_ERR;
+    *read_len = 0;
+    if (leaf->value_len <= offset) return CTDB_OK;  //past the end, nothing to read
+    if (leaf->value_len - offset < len) len = leaf->value_len - offset;
+    struct ctdb_leaf part = {.version = leaf->version, .value_len = len, .value_pos = leaf->value_pos + offset};
+    if (CTDB_OK != ctdb_read_value(db, &part, buf)) return CTDB_ERR;
+    *read_len = len;
+    return CTDB_OK;
+}
+
+int ctdb_send_value(struct ctdb *db, struct ctdb_leaf *leaf, int out_fd) {
+    if (NULL == db || NULL == leaf || 0 > out_fd || 0 >= leaf->value_pos) return CTDB_ERR;
+    off_t offset = 0;
+    int fd = segment_fd(db, leaf->value_pos, &offset);
+    if (0 > fd) return CTDB_ERR;
+    uint32_t done = 0;
+    while (done < leaf->value_len) {
+        ssize_t res = sendfile(out_fd, fd, &offset, leaf->value_len - done);
+        STATS_ADD(db, syscalls, 1);
+        if (0 > res && EINTR == errno) continue;
+        if (0 >= res) return CTDB_ERR;
+        STATS_ADD(db, bytes_read, res);
+        done += res;
+    }
+    return CTDB_OK;
+}
+
+//'ticket' NULL returns once the footer is durable, otherwise once it is written (the syncer does the rest)
+static int commit(struct ctdb_transaction *trans, uint64_t *ticket) {
+    TRACE_BEGIN(NULL != trans ? trans->db : NULL, CTDB_OP_COMMIT, 0);
+    if (NULL == trans || 1 != trans->is_isvalid) goto err;  //verify that the transaction has not been committed or rolled back
+    if (trans->is_readonly) goto err;  //snapshots are released, not committed
+    trans->is_isvalid = 0;  //the transaction that have been used (commit, rollback) cannot be used any more
+
+    struct ctdb *db = trans->db;
+    //nothing was put, the footer is written all the same, unless another writer committed since it began
+    if (CTDB_OK != (trans->is_forced ? writer_lock(trans) : writer_begin(trans))) goto err;
+    if (0 != __atomic_load_n(&(db->failed_ticket), __ATOMIC_ACQUIRE)) goto err;  //it may be built on a root that is not durable
+    struct ctdb_footer committed;
+    read_latest(db, &committed);
+    if (!trans->is_forced && !FOOTER_EQUAL(&committed, &(trans->base))) goto err;  //another transaction of this handle committed first
+    trans->footer.prev_pos = committed.pos;  //the history chain
+    if (CTDB_OK != dump_delta(trans)) goto err;
+    free_filter_hashes(trans);
+    off_t prev_log_pos = trans->footer.log_pos;
+    if (CTDB_OK != commit_memtable(trans)) goto err;
+    //save the 'transaction flag', which means that the transaction was committed successfully
+    if (CTDB_OK != dump_footer(db, &(trans->footer))) goto err;
+    if (NULL == ticket && __atomic_load_n(&(db->durable_ticket), __ATOMIC_ACQUIRE) == db->written_ticket) {  //nothing in flight
+        if (CTDB_OK != sync_file(db)) goto err;
+        if (CTDB_OK != lock_committed(db)) goto err;
+        publish_committed(db, &(trans->footer));  //new transactions and snapshots, in every process, start from here
+        unlock_committed(db);
+    } else {  //behind the footers in the pipeline
+        uint64_t pushed = 0;
+        if (CTDB_OK != pipeline_push(db, &(trans->footer), &pushed)) goto err;
+        if (NULL != ticket) {
+            *ticket = pushed;
+        } else if (CTDB_OK != pipeline_wait(db, pushed)) {
+            goto err;
+        }
+    }
+    if (NULL != trans->pending && 0 < trans->footer.log_pos) memtable_cache_log(db, prev_log_pos, trans->footer.log_pos, trans->pending);
+    writer_unlock(trans);
+    free_pending(trans);
+    STATS_ADD(db, commits, 1);
+    STATS_ADD(db, commit_payload_bytes, trans->payload_bytes);
+    STATS_ADD(db, commit_written_bytes, trans->written_bytes + CTDB_FOOTER_SIZE);
+    TRACE_END(db);
+    pin_root(db, trans->footer.root_pos);  //mostly copied, the writer just wrote the path that changed
+    check_vacuum_policy(db, &(trans->footer));  //outside of the locks, the hook may well start a vacuum
+    return CTDB_OK;
+
+err:
+    if (NULL != trans) {
+        writer_unlock(trans);
+        free_filter_hashes(trans);
+        free_pending(trans);
+    }
+    TRACE_END(NULL != trans ? trans->db : NULL);
+    return CTDB_ERR;
+}
+
+int ctdb_transaction_commit(struct ctdb_transaction *trans) {
+    return commit(trans, NULL);
+}
+
+int ctdb_transaction_commit_async(struct ctdb_transaction *trans, uint64_t *ticket) {
+    if (NULL == ticket) return CTDB_ERR;
+    return commit(trans, ticket);
+}
+
+int ctdb_wait_durable(struct ctdb *db, uint64_t ticket) {
+    if (NULL == db || 0 == ticket || __atomic_load_n(&(db->written_ticket), __ATOMIC_ACQUIRE) < ticket) return CTDB_ERR;
+    return pipeline_wait(db, ticket);
+}
+
+void ctdb_transaction_rollback(struct ctdb_transaction *trans) {
+    if (NULL != trans) {
+        trans->is_isvalid = 0;  //the transaction that have been used (commit, rollback) cannot be used any more
+        writer_unlock(trans);
+        free_filter_hashes(trans);
+        free_pending(trans);
+    }
+}
+
+void ctdb_transaction_free(struct ctdb_transaction **trans){
+    if (NULL == trans || NULL == *trans) return;
+    writer_unlock(*trans);  //neither committed nor rolled back
+    if ((*trans)->is_reader) reader_exit((*trans)->db);
+    free_filter_hashes(*trans);
+    free_pending(*trans);
+    free(*trans);
+    *trans = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// iterator
+///////////////////////////////////////////////////////////////////////////////
+//'key' is a buffer of CTDB_MAX_KEY_LEN shared by the whole traversal, each node appends its prefix behind 'key_len'.
+//The buffered keys of 'scan' go in between, in key order, and hide the leaves they were put over
+static int iterator_travel(struct ctdb *db, off_t trav_pos, char *key, uint16_t key_len, int64_t now, struct memtable_scan *scan, ctdb_traversal *traversal) {
+    TRACE_BEGIN(db, CTDB_OP_ITER_STEP, key_len);  //one step: the node and its leaf, without the callback
+    struct ctdb_node trav = {.prefix_len = 0, .leaf_pos = 0, .items_count = 0};
+    if (CTDB_OK != load_node(db, trav_pos, &trav)) goto over;
+    TRACE_DEPTH(1);
+    if ((trav.prefix_len + key_len) <= CTDB_MAX_KEY_LEN) {
+        memcpy(key + key_len, trav.prefix, trav.prefix_len);
+        uint16_t prefix_key_len = key_len + trav.prefix_len;
+
+        struct ctdb_leaf leaf = {.version = 0, .value_len = 0, .value_pos = -1};
+        if (0 < trav.leaf_pos) {
+            if (CTDB_OK != load_leaf(db, trav.leaf_pos, &leaf)) goto over;
+        }
+        TRACE_END(db);
+        uint8_t is_hidden = 0;
+        if (0 < trav.leaf_pos && CTDB_OK != scan_until(db, scan, key, prefix_key_len, now, traversal, &is_hidden)) return CTDB_ERR;
+        if (0 < prefix_key_len && !is_hidden && LEAF_IS_LIVE(leaf, now)) { //the data has not been deleted
+            if (CTDB_OK != traversal(db->fd, key, prefix_key_len, leaf)){
+                return CTDB_ERR; //the traversal operation has been cancelled
+            }
+        }
+
+        int items_index = 0;
+        for (; items_index < trav.items_count; items_index++) {
+            if (CTDB_OK != iterator_travel(db, trav.items[items_index].sub_node_pos, key, prefix_key_len, now, scan, traversal)){
+                return CTDB_ERR; //something wrong, or the traversal operation has been cancelled
+            }
+        }
+        return CTDB_OK;
+    }
+    TRACE_END(db);
+    return CTDB_OK;
+
+over:
+    TRACE_END(db);
+    return CTDB_ERR;
+}
+
+int ctdb_iterator_travel(struct ctdb_transaction *trans, char *key, uint16_t key_len, ctdb_traversal *traversal) {
+    struct memtable_scan scan = {.count = 0};
+    if (NULL == trans || 1 != trans->is_isvalid) goto err;  //verify that the transaction has not been committed or rolled back
+    if (CTDB_MAX_KEY_LEN < key_len) goto err;
+    if (CTDB_OK != memtable_scan_of(trans, key, key_len, &scan)) goto err;
+
+    //search the prefix nodes related to key from the file
+    uint16_t matched_prefix_len = 0;
+    STATS_ADD(trans->db, lookups, 1);
+    off_t sub_node_pos = find_node_from_file(trans->db, trans->footer.root_pos, key, key_len, 0, 1, &matched_prefix_len);  //fuzzy match
+    if (0 >= sub_node_pos && 0 == scan.count) goto err;  //no data found
+
+    //traverse from the starting node, then the buffered keys after its last one
+    int64_t now = time(NULL);
+    char prefix_key[CTDB_MAX_KEY_LEN];
+    memcpy(prefix_key, key, matched_prefix_len);
+    if (0 < sub_node_pos && CTDB_OK != iterator_travel(trans->db, sub_node_pos, prefix_key, matched_prefix_len, now, &scan, traversal)) goto err;
+    uint8_t is_hidden = 0;
+    if (CTDB_OK != scan_until(trans->db, &scan, NULL, 0, now, traversal, &is_hidden)) goto err;
+    scan_free(&scan);
+    return CTDB_OK;
+
+err:
+    scan_free(&scan);
+    return CTDB_ERR;
+}
+
+//a subtree, or one leaf of a node that was split, the partitions are in key order
+struct scan_part{
+    off_t node_pos;  //0 for a leaf
+    off_t leaf_pos;
+    uint64_t count;  //the live keys, the biggest subtree is split first
+    uint16_t key_len;
+    char *key;  //the key before the prefix of the node, or the key of the leaf
+    uint8_t is_buffered;
+    uint8_t is_done;
+    char *buf;  //key_len, key, leaf, one after the other
+    size_t buf_len;
+    size_t buf_cap;
+};
+
+struct scan{
+    struct ctdb *db;
+    ctdb_traversal *traversal;
+    int64_t now;
+    uint8_t is_ordered;
+    uint32_t window;  //partitions a worker may run ahead of the delivery
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint8_t is_stopped;  //an error, or the traversal cancelled
+    uint32_t next_part;
+    uint32_t delivered;
+    uint32_t parts_count;
+    struct scan_part *parts;
+};
+
+static int scan_emit(struct scan *scan, struct scan_part *part, char *key, uint16_t key_len, struct ctdb_leaf *leaf) {
+    if (!part->is_buffered) return scan->traversal(scan->db->fd, key, key_len, *leaf);
+    size_t entry_len = sizeof(uint16_t) + key_len + sizeof(*leaf);
+    if (part->buf_cap < part->buf_len + entry_len) {
+        size_t new_cap = part->buf_cap * 2 > part->buf_len + entry_len ? part->buf_cap * 2 : part->buf_len + entry_len + 4096;
+        char *new_buf = realloc(part->buf, new_cap);
+        if (NULL == new_buf) return CTDB_ERR;
+        part->buf = new_buf;
+        part->buf_cap = new_cap;
+    }
+    memcpy(part->buf + part->buf_len, &key_len, sizeof(uint16_t));
+    memcpy(part->buf + part->buf_len + sizeof(uint16_t), key, key_len);
+    memcpy(part->buf + part->buf_len + sizeof(uint16_t) + key_len, leaf, sizeof(*leaf));
+    part->buf_len += entry_len;
+    return CTDB_OK;
+}
+
+static int scan_travel(struct scan *scan, struct scan_part *part, off_t trav_pos, char *key, uint16_t key_len) {
+    if (__atomic_load_n(&(scan->is_stopped), __ATOMIC_RELAXED)) return CTDB_ERR;
+    struct ctdb_node trav = {.prefix_len = 0, .leaf_pos = 0, .items_count = 0};
+    if (CTDB_OK != load_node(scan->db, trav_pos, &trav)) return CTDB_ERR;
+    if (CTDB_MAX_KEY_LEN < key_len + trav.prefix_len) return CTDB_OK;  //as the iterator, skipped
+    memcpy(key + key_len, trav.prefix, trav.prefix_len);
+    key_len += trav.prefix_len;
+    if (0 < trav.leaf_pos) {
+        struct ctdb_leaf leaf = {.version = 0, .value_len = 0, .value_pos = -1};
+        if (CTDB_OK != load_leaf(scan->db, trav.leaf_pos, &leaf)) return CTDB_ERR;
+        if (0 < key_len && LEAF_IS_LIVE(leaf, scan->now) && CTDB_OK != scan_emit(scan, part, key, key_len, &leaf)) return CTDB_ERR;
+    }
+    int items_index = 0;
+    for (; items_index < trav.items_count; items_index++) {
+        if (CTDB_OK != scan_travel(scan, part, trav.items[items_index].sub_node_pos, key, key_len)) return CTDB_ERR;
+    }
+    return CTDB_OK;
+}
+
+static int scan_part_run(struct scan *scan, struct scan_part *part) {
+    char key[CTDB_MAX_KEY_LEN];
+    memcpy(key, part->key, part->key_len);
+    if (0 < part->node_pos) return scan_travel(scan, part, part->node_pos, key, part->key_len);
+    struct ctdb_leaf leaf = {.version = 0, .value_len = 0, .value_pos = -1};
+    if (CTDB_OK != load_leaf(scan->db, part->leaf_pos, &leaf)) return CTDB_ERR;
+    return LEAF_IS_LIVE(leaf, scan->now) ? scan_emit(scan, part, key, part->key_len, &leaf) : CTDB_OK;
+}
+
+//claims the next partition, NULL once there are none or the scan stopped. Ordered workers stay within the window
+static struct scan_part *scan_claim(struct scan *scan, uint8_t is_buffered) {
+    struct scan_part *part = NULL;
+    pthread_mutex_lock(&(scan->lock));
+    while (is_buffered && !scan->is_stopped && scan->next_part < scan->parts_count &&
+           scan->delivered + scan->window <= scan->next_part) {
+        pthread_cond_wait(&(scan->cond), &(scan->lock));
+    }
+    if (!scan->is_stopped && scan->next_part < scan->parts_count) {
+        part = &(scan->parts[scan->next_part++]);
+        part->is_buffered = is_buffered;
+    }
+    pthread_mutex_unlock(&(scan->lock));
+    return part;
+}
+
+static void scan_finish(struct scan *scan, struct scan_part *part, int res) {
+    pthread_mutex_lock(&(scan->lock));
+    part->is_done = 1;
+    if (CTDB_OK != res) __atomic_store_n(&(scan->is_stopped), 1, __ATOMIC_RELAXED);  //read by the running partitions
+    pthread_cond_broadcast(&(scan->cond));
+    pthread_mutex_unlock(&(scan->lock));
+}
+
+static void *scan_worker(void *arg) {
+    struct scan *scan = arg;
+    struct scan_part *part = NULL;
+    while (NULL != (part = scan_claim(scan, scan->is_ordered))) {
+        scan_finish(scan, part, scan_part_run(scan, part));
+    }
+    return NULL;
+}
+
+//the caller delivers the partitions in order, and runs the next one itself (unbuffered) when no worker has claimed it
+static void scan_deliver(struct scan *scan) {
+    uint32_t i = 0;
+    for (; i < scan->parts_count; i++) {
+        struct scan_part *part = &(scan->parts[i]);
+        pthread_mutex_lock(&(scan->lock));
+        if (!scan->is_stopped && i == scan->next_part) {
+            scan->next_part += 1;
+            part->is_buffered = 0;
+            pthread_mutex_unlock(&(scan->lock));
+            scan_finish(scan, part, scan_part_run(scan, part));
+        } else {
+            while (!part->is_done && !scan->is_stopped) {
+                pthread_cond_wait(&(scan->cond), &(scan->lock));
+            }
+            pthread_mutex_unlock(&(scan->lock));
+            size_t pos = 0;
+            while (part->is_done && pos < part->buf_len && !__atomic_load_n(&(scan->is_stopped), __ATOMIC_RELAXED)) {
+                uint16_t key_len = 0;
+                struct ctdb_leaf leaf;
+                memcpy(&key_len, part->buf + pos, sizeof(uint16_t));
+                memcpy(&leaf, part->buf + pos + sizeof(uint16_t) + key_len, sizeof(leaf));
+                if (CTDB_OK != scan->traversal(scan->db->fd, part->buf + pos + sizeof(uint16_t), key_len, leaf)) {
+                    scan_finish(scan, part, CTDB_ERR);
+                }
+                pos += sizeof(uint16_t) + key_len + sizeof(leaf);
+            }
+        }
+        pthread_mutex_lock(&(scan->lock));
+        free(part->buf);
+        part->buf = NULL;
+        scan->delivered = i + 1;
+        uint8_t is_stopped = scan->is_stopped;
+        pthread_cond_broadcast(&(scan->cond));
+        pthread_mutex_unlock(&(scan->lock));
+        if (is_stopped) break;
+    }
+}
+
+static void free_scan_parts(struct scan *scan) {
+    uint32_t i = 0;
+    for (; NULL != scan->parts && i < scan->parts_count; i++) {
+        free(scan->parts[i].key);
+        free(scan->parts[i].buf);
+    }
+    free(scan->parts);
+}
+
+//the biggest subtree is replaced by its leaf and its children until there are 'target' partitions
+static int scan_split(struct scan *scan, off_t node_pos, char *key, uint16_t key_len, uint32_t target) {
+    struct ctdb_node *node = malloc(sizeof(*node));
+    if (NULL == node || NULL == (scan->parts = calloc(1, sizeof(struct scan_part)))) goto err;
+    scan->parts_count = 1;
+    scan->parts[0] = (struct scan_part){.node_pos = node_pos, .count = UINT64_MAX, .key_len = key_len, .key = malloc(key_len + 1)};
+    if (NULL == scan->parts[0].key) goto err;
+    memcpy(scan->parts[0].key, key, key_len);
+    while (scan->parts_count < target) {
+        uint32_t biggest = UINT32_MAX, i = 0;
+        for (; i < scan->parts_count; i++) {
+            if (0 < scan->parts[i].node_pos && 1 < scan->parts[i].count &&
+                (UINT32_MAX == biggest || scan->parts[biggest].count < scan->parts[i].count)) {
+                biggest = i;
+            }
+        }
+        if (UINT32_MAX == biggest) break;  //only leaves and single keys left
+        struct scan_part split = scan->parts[biggest];
+        if (CTDB_OK != load_node(scan->db, split.node_pos, node)) goto err;
+        uint16_t split_key_len = split.key_len + node->prefix_len;
+        if (CTDB_MAX_KEY_LEN < split_key_len) {
+            scan->parts[biggest].count = 1;  //left to the worker, which skips it
+            continue;
+        }
+        char *split_key = realloc(split.key, split_key_len + 1);
+        if (NULL == split_key) goto err;
+        scan->parts[biggest].key = split_key;
+        memcpy(split_key + split.key_len, node->prefix, node->prefix_len);
+        uint8_t has_leaf = 0 < node->leaf_pos && 0 < split_key_len;  //the root has no key, nor a leaf to visit
+        uint32_t added = has_leaf + node->items_count;
+        if (0 < added) {
+            struct scan_part *parts = realloc(scan->parts, (scan->parts_count + added - 1) * sizeof(struct scan_part));
+            if (NULL == parts) goto err;
+            scan->parts = parts;
+        }
+        struct scan_part *parts = scan->parts;
+        memmove(parts + biggest + added, parts + biggest + 1, (scan->parts_count - biggest - 1) * sizeof(struct scan_part));
+        memset(parts + biggest, 0, added * sizeof(struct scan_part));
+        scan->parts_count += added - 1;
+        if (has_leaf) {
+            parts[biggest] = (struct scan_part){.node_pos = 0, .leaf_pos = node->leaf_pos, .count = 1, .key_len = split_key_len, .key = split_key};
+        }
+        int items_index = 0;
+        for (; items_index < node->items_count; items_index++) {  //the children share the key of the node
+            struct scan_part *part = &(parts[biggest + has_leaf + items_index]);
+            *part = (struct scan_part){.node_pos = node->items[items_index].sub_node_pos, .count = node->items[items_index].sub_count,
+                                       .key_len = split_key_len, .key = malloc(split_key_len + 1)};
+            if (NULL == part->key) {
+                if (!has_leaf) free(split_key);
+                goto err;
+            }
+            memcpy(part->key, split_key, split_key_len);
+        }
+        if (!has_leaf) free(split_key);
     }
+    free(node);
+    return CTDB_OK;
+
+err:
+    free(node);
+    return CTDB_ERR;
+}
+
+int ctdb_parallel_travel(struct ctdb_transaction *trans, char *key, uint16_t key_len, int threads, int mode, ctdb_traversal *traversal) {
+    pthread_t workers[CTDB_SCAN_MAX_THREADS];
+    int started = 0;
+    struct scan scan = {.parts = NULL, .parts_count = 0};
+    if (NULL == trans || 1 != trans->is_isvalid) goto err;  //verify that the transaction has not been committed or rolled back
+    if (CTDB_MAX_KEY_LEN < key_len || NULL == traversal || 1 > threads || CTDB_SCAN_MAX_THREADS < threads) goto err;
+    if (CTDB_SCAN_UNORDERED != mode && CTDB_SCAN_ORDERED != mode) goto err;
+
+    uint16_t matched_prefix_len = 0;
+    STATS_ADD(trans->db, lookups, 1);
+    off_t sub_node_pos = find_node_from_file(trans->db, trans->footer.root_pos, key, key_len, 0, 1, &matched_prefix_len);  //fuzzy match
+    if (0 >= sub_node_pos) goto err;  //no data found
+
+    scan = (struct scan){.db = trans->db, .traversal = traversal, .now = time(NULL), .is_ordered = CTDB_SCAN_ORDERED == mode,
+                         .window = threads * 4, .parts = NULL, .parts_count = 0};
+    if (CTDB_OK != scan_split(&scan, sub_node_pos, key, matched_prefix_len, threads * 8)) goto err;
+    pthread_mutex_init(&(scan.lock), NULL);
+    pthread_cond_init(&(scan.cond), NULL);
+    for (; started < threads - 1 && 1 < scan.parts_count; started++) {  //the caller is one of them
+        if (0 != pthread_create(&workers[started], NULL, scan_worker, &scan)) break;  //fewer threads, the same result
+    }
+    if (scan.is_ordered) {
+        scan_deliver(&scan);
+    } else {
+        scan_worker(&scan);
+    }
+    pthread_mutex_lock(&(scan.lock));
+    pthread_cond_broadcast(&(scan.cond));  //the workers waiting for the window, after a stop
+    pthread_mutex_unlock(&(scan.lock));
+    int i = 0;
+    for (; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_mutex_destroy(&(scan.lock));
+    pthread_cond_destroy(&(scan.cond));
+    int res = scan.is_stopped ? CTDB_ERR : CTDB_OK;
+    free_scan_parts(&scan);
+    return res;
+
+err:
+    free_scan_parts(&scan);
+    return CTDB_ERR;
+}
+
+//the first live key of the subtree that is after 'target' (or equal to it, if 'inclusive'), a NULL 'target' takes the very first
+static int next_travel(struct ctdb *db, off_t trav_pos, char *key, uint16_t key_len, char *target, uint16_t target_len, uint8_t inclusive, int64_t now, uint16_t *next_key_len, struct ctdb_leaf *leaf) {
+    struct ctdb_node trav = {.prefix_len = 0, .leaf_pos = 0, .items_count = 0};
+    if (CTDB_OK != load_node(db, trav_pos, &trav)) return CTDB_ERR;
+    STATS_ADD(db, lookup_depth, 1);
+    if (CTDB_MAX_KEY_LEN < key_len + trav.prefix_len) return CTDB_ERR;
+    memcpy(key + key_len, trav.prefix, trav.prefix_len);
+    uint16_t prefix_key_len = key_len + trav.prefix_len;
+
+    uint8_t skip_leaf = 0;
+    if (NULL != target) {
+        uint16_t overlap = (prefix_key_len < target_len ? prefix_key_len : target_len) - key_len;
+        int cmp = memcmp(key + key_len, target + key_len, overlap);
+        if (0 > cmp) return CTDB_ERR;  //the whole subtree is before the target
+        if (0 < cmp || prefix_key_len > target_len) {
+            target = NULL;  //the whole subtree is after the target
+        } else if (prefix_key_len == target_len) {
+            skip_leaf = !inclusive;
+            target = NULL;  //the children are after the target
+        } else {
+            skip_leaf = 1;  //the target is further down
+        }
+    }
+    if (!skip_leaf && 0 < trav.leaf_pos) {
+        if (CTDB_OK != load_leaf(db, trav.leaf_pos, leaf)) return CTDB_ERR;
+        if (LEAF_IS_LIVE(*leaf, now)) {  //the data has not been deleted
+            *next_key_len = prefix_key_len;
+            return CTDB_OK;
+        }
+    }
+
+    int items_index = 0;
+    for (; items_index < trav.items_count; items_index++) {
+        struct ctdb_node_item *item = &(trav.items[items_index]);
+        uint8_t bounded = 0;
+        if (NULL != target) {
+            uint8_t target_char = target[prefix_key_len];
+            if (item->sub_prefix_char < target_char) continue;
+            bounded = item->sub_prefix_char == target_char;
+        }
+        if (CTDB_OK == next_travel(db, item->sub_node_pos, key, prefix_key_len, bounded ? target : NULL, target_len, inclusive, now, next_key_len, leaf)) {
+            return CTDB_OK;
+        }
+    }
+    return CTDB_ERR;
+}
+
+int ctdb_next(struct ctdb_transaction *trans, char *key, uint16_t key_len, uint8_t inclusive, char *next_key, uint16_t *next_key_len, struct ctdb_leaf *leaf) {
+    if (NULL == trans || 1 != trans->is_isvalid) goto err;  //verify that the transaction has not been committed or rolled back
+    if (CTDB_MAX_KEY_LEN < key_len || (0 < key_len && NULL == key)) goto err;
+    if (NULL == next_key || NULL == next_key_len || NULL == leaf) goto err;
+    if (0 >= trans->footer.root_pos) goto err;
+
+    char target[CTDB_MAX_KEY_LEN];  //'next_key' may be the buffer of 'key'
+    if (0 < key_len) memcpy(target, key, key_len);
+    STATS_ADD(trans->db, lookups, 1);
+    return next_travel(trans->db, trans->footer.root_pos, next_key, 0, target, key_len, inclusive, time(NULL), next_key_len, leaf);
+
+err:
+    return CTDB_ERR;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// count
+///////////////////////////////////////////////////////////////////////////////
+int ctdb_count_prefix(struct ctdb_transaction *trans, char *key, uint16_t key_len, uint64_t *count) {
+    if (NULL == trans || 1 != trans->is_isvalid) goto err;  //verify that the transaction has not been committed or rolled back
+    if (CTDB_MAX_KEY_LEN < key_len || NULL == count) goto err;
+    *count = 0;
+    if (0 >= trans->footer.root_pos) return CTDB_OK;  //empty
+
+    STATS_ADD(trans->db, lookups, 1);
+    off_t sub_node_pos = find_node_from_file(trans->db, trans->footer.root_pos, key, key_len, 0, 1, NULL);  //fuzzy match
+    if (0 >= sub_node_pos) return CTDB_OK;  //no data found
+    struct ctdb_node sub_node = {.prefix_len = 0, .leaf_pos = 0, .items_count = 0};
+    if (CTDB_OK != load_node(trans->db, sub_node_pos, &sub_node)) goto err;
+    *count = sub_node.count;
+    return CTDB_OK;
+
+err:
+    return CTDB_ERR;
+}
+
+//skip whole subtrees by their counts, the leaf of a node is live if the items do not add up to its count
+static int rank_travel(struct ctdb *db, off_t trav_pos, char *key, uint16_t key_len, uint64_t rank, uint16_t *rank_key_len, struct ctdb_leaf *leaf) {
+    struct ctdb_node trav = {.prefix_len = 0, .leaf_pos = 0, .items_count = 0};
+    if (CTDB_OK != load_node(db, trav_pos, &trav)) return CTDB_ERR;
+    STATS_ADD(db, lookup_depth, 1);
+    if (CTDB_MAX_KEY_LEN < key_len + trav.prefix_len) return CTDB_ERR;
+    memcpy(key + key_len, trav.prefix, trav.prefix_len);
+    key_len += trav.prefix_len;
+
+    uint64_t items_count = 0;
+    int items_index = 0;
+    for (; items_index < trav.items_count; items_index++) {
+        items_count += trav.items[items_index].sub_count;
+    }
+    if (items_count < trav.count) {  //the leaf of this node comes first
+        if (0 == rank) {
+            *rank_key_len = key_len;
+            return load_leaf(db, trav.leaf_pos, leaf);
+        }
+        rank -= 1;
+    }
+    for (items_index = 0; items_index < trav.items_count; items_index++) {
+        struct ctdb_node_item *item = &(trav.items[items_index]);
+        if (rank < item->sub_count) return rank_travel(db, item->sub_node_pos, key, key_len, rank, rank_key_len, leaf);
+        rank -= item->sub_count;
+    }
+    return CTDB_ERR;  //out of range
+}
 
-    //append the value and leaf node to the file
-    off_t value_pos = append_to_end(trans->db->fd, value, value_len);
-    if (0 >= value_pos) goto err;
-    struct ctdb_leaf new_leaf = {.version = trans->footer.tran_count, .value_len = value_len, .value_pos = value_pos};
-    off_t new_leaf_pos = dump_leaf(trans->db->fd, &new_leaf);
-    if (0 >= new_leaf_pos) goto err;
+int ctdb_seek_rank(struct ctdb_transaction *trans, char *key, uint16_t key_len, uint64_t rank, char *rank_key, uint16_t *rank_key_len, struct ctdb_leaf *leaf) {
+    if (NULL == trans || 1 != trans->is_isvalid) goto err;  //verify that the transaction has not been committed or rolled back
+    if (CTDB_MAX_KEY_LEN < key_len || NULL == rank_key || NULL == rank_key_len || NULL == leaf) goto err;
+    if (0 >= trans->footer.root_pos) goto err;
 
-    //update the prefix nodes (append only)
-    char filled_prefix_key[CTDB_MAX_KEY_LEN + 1] = {[0 ... CTDB_MAX_KEY_LEN] = 0};
-    if (filled_prefix_key != strncpy(filled_prefix_key, key, key_len)) goto err;
-    off_t new_root_pos = append_node_to_file(trans->db->fd, &root, filled_prefix_key, key_len, 0, new_leaf_pos);
-    if (0 >= new_root_pos) goto err;
-    trans->footer.root_pos = new_root_pos;
+    uint16_t matched_prefix_len = 0;
+    char prefix[CTDB_MAX_KEY_LEN];  //'rank_key' may be the buffer of 'key'
+    if (0 < key_len) memcpy(prefix, key, key_len);
+    STATS_ADD(trans->db, lookups, 1);
+    off_t sub_node_pos = find_node_from_file(trans->db, trans->footer.root_pos, key, key_len, 0, 1, &matched_prefix_len);  //fuzzy match
+    if (0 >= sub_node_pos) goto err;  //no data found
+    if (0 < matched_prefix_len) memmove(rank_key, key, matched_prefix_len);
+    if (CTDB_OK != rank_travel(trans->db, sub_node_pos, rank_key, matched_prefix_len, rank, rank_key_len, leaf)) goto err;
+    int64_t now = time(NULL);
+    if (LEAF_IS_LIVE(*leaf, now)) return CTDB_OK;
 
-    //cumulative the operation count (the transaction is not written to the file until committed)
-    trans->footer.tran_count += 1;
-    if (0 >= value_len || NULL == value)
-        trans->footer.del_count += 1;
+    //counted until a vacuum drops it, the next live key stands in for it
+    char target[CTDB_MAX_KEY_LEN];
+    uint16_t target_len = *rank_key_len;
+    memcpy(target, rank_key, target_len);
+    if (CTDB_OK != next_travel(trans->db, trans->footer.root_pos, rank_key, 0, target, target_len, 0, now, rank_key_len, leaf)) goto err;
+    if (*rank_key_len < key_len || 0 != memcmp(rank_key, prefix, key_len)) goto err;  //no live key left under 'key'
     return CTDB_OK;
 
 err:
     return CTDB_ERR;
 }
 
-int ctdb_del(struct ctdb_transaction *trans, char *key, uint8_t key_len) {
-    return ctdb_put(trans, key, key_len, "", 0);
+///////////////////////////////////////////////////////////////////////////////
+// snapshot
+///////////////////////////////////////////////////////////////////////////////
+struct ctdb_snapshot *ctdb_snapshot_acquire(struct ctdb *db) {
+    if (NULL == db) return NULL;
+    int i = 0;
+    for (; i < CTDB_MAX_SNAPSHOTS; i++) {
+        struct ctdb_snapshot *snap = &(db->snapshots[i]);
+        uint32_t free_refs = 0;
+        if (0 != __atomic_load_n(&snap->refs, __ATOMIC_RELAXED) ||
+            !__atomic_compare_exchange_n(&snap->refs, &free_refs, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            continue;  //the slot is taken by another reader
+        }
+        if (CTDB_OK != reader_enter(db)) {
+            __atomic_store_n(&snap->refs, 0, __ATOMIC_RELEASE);
+            return NULL;
+        }
+        //the slot is ours, announce the pin before the root is read, then check that the root did not move
+        //since: a compaction either sees the pin or committed before the root was read
+        struct ctdb_footer footer, again;
+        __atomic_store_n(&snap->pinned, CTDB_PIN_ANNOUNCED, __ATOMIC_SEQ_CST);
+        read_committed(db, &footer);
+        while (1) {
+            __atomic_store_n(&snap->pinned, footer.tran_count + 1, __ATOMIC_SEQ_CST);
+            read_committed(db, &again);
+            if (FOOTER_EQUAL(&again, &footer)) break;
+            footer = again;  //committed in between, pin the newer one
+        }
+        snap->trans = (struct ctdb_transaction){.is_isvalid = 1, .is_readonly = 1, .is_reader = 1, .db = db, .footer = footer};
+        return snap;
+    }
+    return NULL;  //too many live snapshots
 }
 
-int ctdb_transaction_commit(struct ctdb_transaction *trans) {
-    if (NULL == trans || 1 != trans->is_isvalid) goto err;  //verify that the transaction has not been committed or rolled back
-    trans->is_isvalid = 0;  //the transaction that have been used (commit, rollback) cannot be used any more
+struct ctdb_snapshot *ctdb_snapshot_retain(struct ctdb_snapshot *snap) {
+    if (NULL == snap) return NULL;
+    __atomic_fetch_add(&snap->refs, 1, __ATOMIC_RELAXED);
+    return snap;
+}
 
-    struct ctdb *db = trans->db;
-    //save the 'transaction flag', which means that the transaction was committed successfully
-    if (CTDB_OK != dump_footer(db->fd, &(trans->footer))) goto err;
-    if (-1 == fsync(db->fd)) goto err;
-    return CTDB_OK;
+void ctdb_snapshot_release(struct ctdb_snapshot **snap) {
+    if (NULL == snap || NULL == *snap) return;
+    struct ctdb_snapshot *released = *snap;
+    *snap = NULL;
+    uint32_t refs = __atomic_load_n(&released->refs, __ATOMIC_RELAXED);
+    while (1 < refs) {  //other threads still hold it
+        if (__atomic_compare_exchange_n(&released->refs, &refs, refs - 1, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) return;
+    }
+    //the last reference: unpin, then free the slot for the next acquire
+    __atomic_store_n(&released->pinned, 0, __ATOMIC_RELEASE);
+    reader_exit(released->trans.db);
+    __atomic_store_n(&released->refs, 0, __ATOMIC_RELEASE);
+}
 
-err:
-    return CTDB_ERR;
+int ctdb_oldest_snapshot(struct ctdb *db, uint64_t *tran_count) {
+    if (NULL == db || NULL == tran_count) return CTDB_ERR;
+    uint64_t oldest = 0;
+    int i = 0;
+    for (; i < CTDB_MAX_SNAPSHOTS; i++) {
+        uint64_t pinned = __atomic_load_n(&db->snapshots[i].pinned, __ATOMIC_SEQ_CST);
+        if (CTDB_PIN_ANNOUNCED == pinned) {  //not read yet, it gets the last committed root or a newer one
+            struct ctdb_footer footer;
+            read_committed(db, &footer);
+            pinned = footer.tran_count + 1;
+        }
+        if (0 < pinned && (0 == oldest || pinned < oldest)) oldest = pinned;
+    }
+    if (0 == oldest) return CTDB_ERR;  //no live snapshot
+    *tran_count = oldest - 1;
+    return CTDB_OK;
 }
 
-void ctdb_transaction_rollback(struct ctdb_transaction *trans) {
-    if (NULL != trans) {
-        trans->is_isvalid = 0;  //the transaction that have been used (commit, rollback) cannot be used any more
+///////////////////////////////////////////////////////////////////////////////
+// history
+///////////////////////////////////////////////////////////////////////////////
+//every footer links to the one committed before it, old roots stay readable since nothing is overwritten
+int ctdb_history(struct ctdb *db, ctdb_history_traversal *traversal) {
+    if (NULL == db || NULL == traversal) return CTDB_ERR;
+    struct ctdb_footer footer;
+    read_committed(db, &footer);
+    while (1) {
+        if (CTDB_OK != traversal(footer)) return CTDB_ERR;  //the traversal operation has been cancelled
+        if (0 >= footer.prev_pos) return CTDB_OK;  //the first one
+        if (CTDB_OK != parse_footer(db, footer.prev_pos, footer.pos, &footer)) return CTDB_ERR;
     }
 }
 
-void ctdb_transaction_free(struct ctdb_transaction **trans){
-    if (NULL == trans || NULL == *trans) return;
-    free(*trans);
-    *trans = NULL;
+//'footer_pos' is the 'pos' of a footer of the history (a tran_count is not unique: vacuum, compaction, ...)
+struct ctdb_transaction *ctdb_transaction_begin_at(struct ctdb *db, off_t footer_pos) {
+    if (NULL == db) return NULL;
+    struct ctdb_transaction *trans = calloc(1, sizeof(*trans));
+    if (NULL == trans) return NULL;
+    if (CTDB_OK != reader_enter(db)) {
+        free(trans);
+        return NULL;
+    }
+    *trans = (struct ctdb_transaction){.is_isvalid = 1, .is_readonly = 1, .is_reader = 1, .db = db};
+    struct ctdb_footer footer;
+    read_committed(db, &footer);
+    while (footer_pos != footer.pos) {  //only the footers of the chain, not whatever is at 'footer_pos'
+        if (footer_pos > footer.pos || 0 >= footer.prev_pos || CTDB_OK != parse_footer(db, footer.prev_pos, footer.pos, &footer)) {
+            ctdb_transaction_free(&trans);  //not a committed footer
+            return NULL;
+        }
+    }
+    trans->footer = footer;
+    return trans;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// iterator
+// diff
 ///////////////////////////////////////////////////////////////////////////////
-static int iterator_travel(int fd, struct ctdb_node *trav, char *key, uint8_t key_len, ctdb_traversal *traversal) {
-    if ((trav->prefix_len + key_len) <= CTDB_MAX_KEY_LEN) {
-        char prefix_key[CTDB_MAX_KEY_LEN + 1] = {[0 ... CTDB_MAX_KEY_LEN] = 0};
-        if (0 > snprintf(prefix_key, CTDB_MAX_KEY_LEN, "%.*s%.*s", key_len, key, trav->prefix_len, trav->prefix)) goto over;
-        uint8_t prefix_key_len = key_len + trav->prefix_len;
+//copy-on-write: a subtree both versions share is at the same position, it is never loaded
+static int diff_emit(struct ctdb *db, char *key, uint16_t key_len, off_t old_leaf_pos, off_t new_leaf_pos, ctdb_diff_callback *callback) {
+    if (old_leaf_pos == new_leaf_pos) return CTDB_OK;
+    struct ctdb_leaf old_leaf = {.version = 0, .value_len = 0, .value_pos = -1};
+    struct ctdb_leaf new_leaf = {.version = 0, .value_len = 0, .value_pos = -1};
+    if (0 < old_leaf_pos && CTDB_OK != load_leaf(db, old_leaf_pos, &old_leaf)) return CTDB_ERR;
+    if (0 < new_leaf_pos && CTDB_OK != load_leaf(db, new_leaf_pos, &new_leaf)) return CTDB_ERR;
+    int kind = CTDB_DIFF_CHANGED;
+    if (0 == old_leaf.value_len && 0 == new_leaf.value_len) return CTDB_OK;  //deleted in both
+    if (0 == old_leaf.value_len) kind = CTDB_DIFF_ADDED;
+    if (0 == new_leaf.value_len) kind = CTDB_DIFF_DELETED;
+    return callback(db->fd, key, key_len, kind, old_leaf, new_leaf);
+}
 
-        if (0 < trav->leaf_pos) {
-            struct ctdb_leaf leaf = {.version = 0, .value_len = 0, .value_pos = -1};
-            if (CTDB_OK != load_leaf(fd, trav->leaf_pos, &leaf)) goto over;
-            if (0 < prefix_key_len && 0 < leaf.value_len) { //the data has not been deleted
-                if (CTDB_OK != traversal(fd, prefix_key, prefix_key_len, leaf)){
-                    goto over; //the traversal operation has been cancelled
-                }
-            }
+//the subtree, from 'skip' bytes into the prefix of the node, is only in one of the versions
+static int diff_one_side(struct ctdb *db, off_t trav_pos, uint16_t skip, char *key, uint16_t key_len, uint8_t is_old, ctdb_diff_callback *callback) {
+    struct ctdb_node trav = {.prefix_len = 0, .leaf_pos = 0, .items_count = 0};
+    if (CTDB_OK != load_node(db, trav_pos, &trav)) return CTDB_ERR;
+    if (CTDB_MAX_KEY_LEN < key_len + trav.prefix_len - skip) return CTDB_ERR;
+    memcpy(key + key_len, trav.prefix + skip, trav.prefix_len - skip);
+    key_len += trav.prefix_len - skip;
+    if (CTDB_OK != diff_emit(db, key, key_len, is_old ? trav.leaf_pos : 0, is_old ? 0 : trav.leaf_pos, callback)) return CTDB_ERR;
+    int items_index = 0;
+    for (; items_index < trav.items_count; items_index++) {
+        if (CTDB_OK != diff_one_side(db, trav.items[items_index].sub_node_pos, 0, key, key_len, is_old, callback)) return CTDB_ERR;
+    }
+    return CTDB_OK;
+}
+
+//both positions stand for the same key, 'key_len' bytes of 'key', the prefixes of the versions may be split differently
+static int diff_travel(struct ctdb *db, off_t old_pos, uint16_t old_skip, off_t new_pos, uint16_t new_skip, char *key, uint16_t key_len, ctdb_diff_callback *callback) {
+    if (old_pos == new_pos && old_skip == new_skip) return CTDB_OK;  //shared subtree
+    if (0 >= old_pos) return diff_one_side(db, new_pos, new_skip, key, key_len, 0, callback);
+    if (0 >= new_pos) return diff_one_side(db, old_pos, old_skip, key, key_len, 1, callback);
+
+    struct ctdb_node old_node = {.prefix_len = 0, .leaf_pos = 0, .items_count = 0};
+    struct ctdb_node new_node = {.prefix_len = 0, .leaf_pos = 0, .items_count = 0};
+    if (CTDB_OK != load_node(db, old_pos, &old_node) || CTDB_OK != load_node(db, new_pos, &new_node)) return CTDB_ERR;
+    uint16_t old_rest = old_node.prefix_len - old_skip, new_rest = new_node.prefix_len - new_skip, matched = 0;
+    while (matched < old_rest && matched < new_rest && old_node.prefix[old_skip + matched] == new_node.prefix[new_skip + matched]) {
+        matched++;
+    }
+    if (matched < old_rest && matched < new_rest) {  //the versions branch off inside the prefixes, in key order
+        if ((uint8_t)old_node.prefix[old_skip + matched] < (uint8_t)new_node.prefix[new_skip + matched]) {
+            if (CTDB_OK != diff_one_side(db, old_pos, old_skip, key, key_len, 1, callback)) return CTDB_ERR;
+            return diff_one_side(db, new_pos, new_skip, key, key_len, 0, callback);
         }
+        if (CTDB_OK != diff_one_side(db, new_pos, new_skip, key, key_len, 0, callback)) return CTDB_ERR;
+        return diff_one_side(db, old_pos, old_skip, key, key_len, 1, callback);
+    }
+    if (CTDB_MAX_KEY_LEN < key_len + matched) return CTDB_ERR;
+    memcpy(key + key_len, old_node.prefix + old_skip, matched);
+    key_len += matched;
 
-        int items_index = 0;
-        for (; items_index < trav->items_count; items_index++) {
-            off_t sub_node_pos = trav->items[items_index].sub_node_pos;
-            struct ctdb_node sub_node = {.prefix_len = 0, .leaf_pos = 0, .items_count = 0};
-            if (CTDB_OK != load_node(fd, sub_node_pos, &sub_node)) goto over;
-            if (CTDB_OK != iterator_travel(fd, &sub_node, prefix_key, prefix_key_len, traversal)){
-                goto over; //something wrong, or the traversal operation has been cancelled
+    if (matched == old_rest && matched == new_rest) {  //both nodes end here, merge the items
+        if (CTDB_OK != diff_emit(db, key, key_len, old_node.leaf_pos, new_node.leaf_pos, callback)) return CTDB_ERR;
+        int old_index = 0, new_index = 0, res = CTDB_OK;
+        while (CTDB_OK == res && (old_index < old_node.items_count || new_index < new_node.items_count)) {
+            struct ctdb_node_item *old_item = old_index < old_node.items_count ? &(old_node.items[old_index]) : NULL;
+            struct ctdb_node_item *new_item = new_index < new_node.items_count ? &(new_node.items[new_index]) : NULL;
+            if (NULL == new_item || (NULL != old_item && old_item->sub_prefix_char < new_item->sub_prefix_char)) {
+                res = diff_one_side(db, old_item->sub_node_pos, 0, key, key_len, 1, callback);
+                old_index++;
+            } else if (NULL == old_item || new_item->sub_prefix_char < old_item->sub_prefix_char) {
+                res = diff_one_side(db, new_item->sub_node_pos, 0, key, key_len, 0, callback);
+                new_index++;
+            } else {
+                res = diff_travel(db, old_item->sub_node_pos, 0, new_item->sub_node_pos, 0, key, key_len, callback);
+                old_index++;
+                new_index++;
             }
         }
+        return res;
     }
+
+    //one node ends here, the prefix of the other goes on, and meets at most one item of the first
+    uint8_t is_old_ended = matched == old_rest;
+    struct ctdb_node *ended = is_old_ended ? &old_node : &new_node;
+    off_t going_pos = is_old_ended ? new_pos : old_pos;
+    uint16_t going_skip = (is_old_ended ? new_skip : old_skip) + matched;
+    uint8_t going_char = (is_old_ended ? new_node.prefix : old_node.prefix)[going_skip];
+    uint8_t is_going_done = 0;
+    if (CTDB_OK != diff_emit(db, key, key_len, is_old_ended ? old_node.leaf_pos : 0, is_old_ended ? 0 : new_node.leaf_pos, callback)) return CTDB_ERR;
+    int items_index = 0;
+    for (; items_index < ended->items_count; items_index++) {
+        struct ctdb_node_item *item = &(ended->items[items_index]);
+        int res = CTDB_OK;
+        if (!is_going_done && going_char < item->sub_prefix_char) {
+            is_going_done = 1;
+            if (CTDB_OK != diff_one_side(db, going_pos, going_skip, key, key_len, !is_old_ended, callback)) return CTDB_ERR;
+        }
+        if (going_char == item->sub_prefix_char) {
+            is_going_done = 1;
+            res = is_old_ended ?
+                diff_travel(db, item->sub_node_pos, 0, going_pos, going_skip, key, key_len, callback) :
+                diff_travel(db, going_pos, going_skip, item->sub_node_pos, 0, key, key_len, callback);
+        } else {
+            res = diff_one_side(db, item->sub_node_pos, 0, key, key_len, is_old_ended, callback);
+        }
+        if (CTDB_OK != res) return CTDB_ERR;
+    }
+    if (!is_going_done) return diff_one_side(db, going_pos, going_skip, key, key_len, !is_old_ended, callback);
     return CTDB_OK;
+}
 
-over:
+int ctdb_diff(struct ctdb_transaction *trans_old, struct ctdb_transaction *trans_new, ctdb_diff_callback *callback) {
+    if (NULL == trans_old || 1 != trans_old->is_isvalid) goto err;  //verify that the transactions have not been committed or rolled back
+    if (NULL == trans_new || 1 != trans_new->is_isvalid) goto err;
+    if (trans_old->db != trans_new->db || NULL == callback) goto err;  //positions of the same file only
+
+    char key[CTDB_MAX_KEY_LEN];
+    return diff_travel(trans_old->db, trans_old->footer.root_pos, 0, trans_new->footer.root_pos, 0, key, 0, callback);
+
+err:
     return CTDB_ERR;
 }
 
-int ctdb_iterator_travel(struct ctdb_transaction *trans, char *key, uint8_t key_len, ctdb_traversal *traversal) {
-    if (NULL == trans || 1 != trans->is_isvalid) goto err;  //verify that the transaction has not been committed or rolled back
-    if (CTDB_MAX_KEY_LEN < key_len) goto err;
+///////////////////////////////////////////////////////////////////////////////
+// replication
+///////////////////////////////////////////////////////////////////////////////
+//the file only grows, a follower is a byte-identical prefix of the primary and catches up by appending its tail
+static int read_full(int fd, char *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t res = read(fd, buf + done, len - done);
+        if (0 > res && EINTR == errno) continue;
+        if (0 >= res) return CTDB_ERR;  //the stream ended early
+        done += res;
+    }
+    return CTDB_OK;
+}
 
-    //search the prefix nodes related to key from the file
-    char filled_prefix_key[CTDB_MAX_KEY_LEN + 1] = {[0 ... CTDB_MAX_KEY_LEN] = 0};
-    if (filled_prefix_key != strncpy(filled_prefix_key, key, key_len)) goto err;
-    uint8_t matched_prefix_len = 0;
-    off_t sub_node_pos = find_node_from_file(trans->db->fd, trans->footer.root_pos, filled_prefix_key, key_len, 0, 1, &matched_prefix_len);  //fuzzy match
-    if (0 >= sub_node_pos) goto err;  //no data found
+static int write_full(int fd, char *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t res = write(fd, buf + done, len - done);
+        if (0 > res && EINTR == errno) continue;
+        if (0 >= res) return CTDB_ERR;
+        done += res;
+    }
+    return CTDB_OK;
+}
 
-    //load the starting node of traversal from the file
-    struct ctdb_node sub_node = {.prefix_len = 0, .leaf_pos = 0, .items_count = 0};
-    if (CTDB_OK == load_node(trans->db->fd, sub_node_pos, &sub_node)){
-        return iterator_travel(trans->db->fd, &sub_node, filled_prefix_key, matched_prefix_len, traversal);
+off_t ctdb_committed_end(struct ctdb *db) {
+    if (NULL == db) return -1;
+    struct ctdb_footer footer;
+    read_committed(db, &footer);
+    return footer.pos + CTDB_FOOTER_SIZE;
+}
+
+int ctdb_ship(struct ctdb *db, off_t since, int fd) {
+    if (NULL == db || CTDB_HEADER_SIZE > since) return CTDB_ERR;
+    if (0 < db->segment_size) return CTDB_ERR;  //a frame is one range of one file
+    off_t end = ctdb_committed_end(db);
+    if (since > end) return CTDB_ERR;  //the follower is not a prefix of this file
+    if (since == end) return CTDB_OK;  //up to date
+
+    struct serializer ser = SERIALIZER_INIT(CTDB_FRAME_HEADER_SIZE);
+    if (SERIALIZER_OK != SERIALIZER_WRITE_STR(ser, CTDB_FRAME_MAGIC_STR, CTDB_MAGIC_LEN) ||
+        SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, since, int64_t) ||
+        SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, end - since, int64_t)) {
+        return CTDB_ERR;
+    }
+    if (CTDB_OK != write_full(fd, ser.buf, ser.buf_len)) return CTDB_ERR;
+    off_t offset = since;
+    while (offset < end) {  //pipe, socket or file, the bytes never pass through user space
+        ssize_t res = sendfile(fd, db->fd, &offset, end - offset);
+        STATS_ADD(db, syscalls, 1);
+        if (0 > res && EINTR == errno) continue;
+        if (0 >= res) return CTDB_ERR;
+        STATS_ADD(db, bytes_read, res);
+    }
+    return CTDB_OK;
+}
+
+int ctdb_follow(struct ctdb *db, int fd) {
+    if (NULL == db || 0 < db->segment_size) return CTDB_ERR;
+    char magic_str[CTDB_MAGIC_LEN + 1] = {[0 ... CTDB_MAGIC_LEN] = 0};
+    off_t start = 0, len = 0;
+    struct serializer ser = SERIALIZER_INIT(CTDB_FRAME_HEADER_SIZE);
+    if (CTDB_OK != read_full(fd, ser.buf, ser.buf_len)) return CTDB_ERR;
+    if (SERIALIZER_OK != SERIALIZER_READ_STR(ser, magic_str, CTDB_MAGIC_LEN) ||
+        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, start, int64_t) ||
+        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, len, int64_t) ||
+        0 != strncmp(magic_str, CTDB_FRAME_MAGIC_STR, CTDB_MAGIC_LEN) || CTDB_FOOTER_SIZE > len) {
+        return CTDB_ERR;
+    }
+
+    struct ctdb_transaction trans = {.is_isvalid = 1, .db = db};  //appends like any writer
+    if (CTDB_OK != writer_lock(&trans)) return CTDB_ERR;
+    struct ctdb_footer committed, footer;
+    read_committed(db, &committed);
+    if (start != committed.pos + CTDB_FOOTER_SIZE) goto err;  //shipped from another position
+
+    char buf[64 * 1024];
+    off_t offset = 0;
+    while (offset < len) {
+        size_t chunk_len = len - offset < sizeof(buf) ? len - offset : sizeof(buf);
+        if (CTDB_OK != read_full(fd, buf, chunk_len)) goto truncate;
+        if (chunk_len != write_at(db, start + offset, buf, chunk_len)) goto truncate;
+        offset += chunk_len;
+    }
+
+    //the range must end with a footer that chains back to the last one of this file
+    if (CTDB_OK != parse_footer(db, start + len - CTDB_FOOTER_SIZE, start + len, &footer)) goto truncate;
+    struct ctdb_footer prev = footer;
+    while (prev.prev_pos > committed.pos) {
+        if (CTDB_OK != parse_footer(db, prev.prev_pos, prev.pos, &prev)) goto truncate;
     }
+    if (prev.prev_pos != committed.pos) goto truncate;
+    if (CTDB_OK != sync_file(db)) goto truncate;
+    db->end_pos = start + len;
+
+    if (CTDB_OK != lock_committed(db)) goto err;
+    publish_committed(db, &footer);  //readers of the follower, in every process, see the new commits
+    unlock_committed(db);
+    writer_unlock(&trans);
+    return CTDB_OK;
 
+truncate:
+    if (0 == ftruncate(db->fd, start)) STATS_ADD(db, syscalls, 1);  //drop the partial range
 err:
+    writer_unlock(&trans);
     return CTDB_ERR;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 // vacuum
 ///////////////////////////////////////////////////////////////////////////////
-off_t vacuum_travel(int old_fd, int new_fd, struct ctdb_node *trav) {
+//the counts are rebuilt on the way back up, expired keys are dropped, 'live_bytes' adds up all that is copied
+//appended to 'new_db' straight from the file
+//a value that is shared by leaves is copied once, 'shared' maps the old positions to the new ones
+static off_t vacuum_value(struct ctdb *old_db, struct ctdb *new_db, struct ctdb_leaf *leaf, struct ctdb_dedup *shared) {
+    if (NULL != shared) {
+        struct dedup_slot *slot = dedup_find(shared, leaf->value_pos);
+        if (0 < slot->value_pos) {
+            STATS_ADD(new_db, dedup_hits, 1);
+            STATS_ADD(new_db, dedup_bytes, leaf->value_len);
+            return slot->value_pos;
+        }
+    }
+    off_t new_value_pos = append_pos(new_db, leaf->value_len);
+    if (0 >= new_value_pos) return -1;
+    off_t offset = 0, new_offset = 0;
+    int fd = segment_fd(old_db, leaf->value_pos, &offset);
+    int new_fd = segment_fd(new_db, new_value_pos, &new_offset);
+    if (0 > fd || 0 > new_fd || new_offset != lseek(new_fd, new_offset, SEEK_SET)) return -1;
+    STATS_ADD(new_db, syscalls, 2);
+    if (leaf->value_len != sendfile(new_fd, fd, &offset, leaf->value_len)) return -1;
+    new_db->end_pos = new_offset + leaf->value_len;
+    STATS_ADD(old_db, bytes_read, leaf->value_len);
+    STATS_ADD(new_db, bytes_written, leaf->value_len);
+    if (NULL != shared && CTDB_OK != dedup_add(shared, leaf->value_pos, new_value_pos, leaf->value_len)) return -1;
+    return new_value_pos;
+}
+
+static off_t vacuum_travel(struct ctdb *old_db, struct ctdb *new_db, struct ctdb_node *trav, int64_t now, struct ctdb_dedup *shared, uint64_t *live_bytes) {
+    trav->count = 0;
     if (0 < trav->leaf_pos) {
         struct ctdb_leaf leaf = {.version = 0, .value_len = 0, .value_pos = -1};
-        if (CTDB_OK != load_leaf(old_fd, trav->leaf_pos, &leaf)) goto err;
-        if (0 < leaf.value_len) {
+        if (CTDB_OK != load_leaf(old_db, trav->leaf_pos, &leaf)) goto err;
+        if (LEAF_IS_LIVE(leaf, now)) {
             //append the leaf to the new_file
-            off_t new_value_pos = lseek(new_fd, 0, SEEK_END);
+            off_t new_value_pos = vacuum_value(old_db, new_db, &leaf, shared);
             if (0 >= new_value_pos) goto err;
-            off_t offset = leaf.value_pos;
-            if (leaf.value_len != sendfile(new_fd, old_fd, &offset, leaf.value_len)) goto err;
-            
-            struct ctdb_leaf new_leaf = {.version = leaf.version, .value_len = leaf.value_len, .value_pos = new_value_pos};
-            off_t new_leaf_pos = dump_leaf(new_fd, &new_leaf);
+
+            struct ctdb_leaf new_leaf = {.version = leaf.version, .value_len = leaf.value_len, .value_pos = new_value_pos, .expire = leaf.expire};
+            off_t new_leaf_pos = dump_leaf(new_db, &new_leaf);
             if (0 >= new_leaf_pos) goto err;
             trav->leaf_pos = new_leaf_pos;
+            trav->count = 1;
+            *live_bytes += leaf.value_len + CTDB_LEAF_SIZE;
+        } else {
+            trav->leaf_pos = 0;  //deleted or expired, nothing to point to in the new file
         }
     }
 
@@ -586,40 +3818,582 @@ off_t vacuum_travel(int old_fd, int new_fd, struct ctdb_node *trav) {
     for (; items_index < trav->items_count; items_index++) {
         off_t old_sub_node_pos = trav->items[items_index].sub_node_pos;
         struct ctdb_node old_sub_node = {.prefix_len = 0, .leaf_pos = 0, .items_count = 0};
-        if (CTDB_OK != load_node(old_fd, old_sub_node_pos, &old_sub_node)) goto err;
-        off_t new_sub_node_pos = vacuum_travel(old_fd, new_fd, &old_sub_node); //traverse to the next node of the tree
+        if (CTDB_OK != load_node(old_db, old_sub_node_pos, &old_sub_node)) goto err;
+        off_t new_sub_node_pos = vacuum_travel(old_db, new_db, &old_sub_node, now, shared, live_bytes); //traverse to the next node of the tree
         if (0 >= new_sub_node_pos) goto err;
         trav->items[items_index].sub_node_pos = new_sub_node_pos; //update item pos
+        trav->items[items_index].sub_count = old_sub_node.count;
+        trav->count += old_sub_node.count;
     }
-    return dump_node(new_fd, trav); //append the node to the end of file
+    *live_bytes += NODE_DISK_SIZE(trav);
+    return dump_node(new_db, NULL, trav); //append the node to the end of file
 
 err:
     return -1;
 }
 
-int ctdb_vacuum(struct ctdb_transaction *trans, struct ctdb *new_db) {
+//packed, the values first and contiguous in key order, then the nodes in blocks of a page: a subtree is laid
+//out breadth-first until the page is full, and its frontier starts the next blocks, so a search reads a page
+//for several levels. A node is followed by its leaf, and never crosses a page unless it is bigger than one
+struct packed_node{
+    off_t old_pos;
+    off_t new_pos;
+    off_t value_pos;  //in the new file, 0 without a live leaf
+    uint64_t count;
+};
+
+struct vacuum_pack{
+    struct ctdb *old_db;
+    struct ctdb *new_db;
+    int64_t now;
+    struct ctdb_dedup *shared;
+    uint64_t live_bytes;
+    struct packed_node *nodes;  //sorted by 'old_pos' once all are there
+    uint64_t nodes_count;
+    uint64_t nodes_cap;
+};
+
+static int packed_node_cmp(const void *a, const void *b) {
+    const struct packed_node *i = a, *j = b;
+    return i->old_pos < j->old_pos ? -1 : (i->old_pos > j->old_pos);
+}
+
+static struct packed_node *packed_find(struct vacuum_pack *pack, off_t old_pos) {
+    struct packed_node key = {.old_pos = old_pos};
+    return bsearch(&key, pack->nodes, pack->nodes_count, sizeof(key), packed_node_cmp);
+}
+
+//the values in key order, every node is listed with its live count
+static int pack_values(struct vacuum_pack *pack, off_t trav_pos, uint64_t *count) {
+    struct ctdb_node trav = {.prefix_len = 0, .leaf_pos = 0, .items_count = 0};
+    if (CTDB_OK != load_node(pack->old_db, trav_pos, &trav)) return CTDB_ERR;
+    if (pack->nodes_count == pack->nodes_cap) {
+        uint64_t new_cap = 0 < pack->nodes_cap ? pack->nodes_cap * 2 : 1024;
+        struct packed_node *nodes = realloc(pack->nodes, new_cap * sizeof(struct packed_node));
+        if (NULL == nodes) return CTDB_ERR;
+        pack->nodes = nodes;
+        pack->nodes_cap = new_cap;
+    }
+    uint64_t index = pack->nodes_count++;  //the array moves as it grows
+    pack->nodes[index] = (struct packed_node){.old_pos = trav_pos, .new_pos = 0, .value_pos = 0, .count = 0};
+    *count = 0;
+    if (0 < trav.leaf_pos) {
+        struct ctdb_leaf leaf = {.version = 0, .value_len = 0, .value_pos = -1};
+        if (CTDB_OK != load_leaf(pack->old_db, trav.leaf_pos, &leaf)) return CTDB_ERR;
+        if (LEAF_IS_LIVE(leaf, pack->now)) {
+            if (0 >= (pack->nodes[index].value_pos = vacuum_value(pack->old_db, pack->new_db, &leaf, pack->shared))) return CTDB_ERR;
+            pack->live_bytes += leaf.value_len + CTDB_LEAF_SIZE;
+            *count = 1;
+        }
+    }
+    int items_index = 0;
+    for (; items_index < trav.items_count; items_index++) {
+        uint64_t sub_count = 0;
+        if (CTDB_OK != pack_values(pack, trav.items[items_index].sub_node_pos, &sub_count)) return CTDB_ERR;
+        *count += sub_count;
+    }
+    pack->nodes[index].count = *count;
+    pack->live_bytes += NODE_DISK_SIZE(&trav);
+    return CTDB_OK;
+}
+
+//the position of every node, from 'start' (aligned to a page) to 'end'
+static int pack_layout(struct vacuum_pack *pack, off_t root_pos, off_t start, off_t *end) {
+    off_t *pending = NULL, *queue = NULL;
+    uint64_t pending_count = 0, queue_cap = 0;
+    struct ctdb_node *node = malloc(sizeof(*node));
+    if (NULL == node || NULL == (pending = malloc(pack->nodes_count * sizeof(off_t)))) goto err;
+    off_t cursor = start;
+    pending[pending_count++] = root_pos;
+    while (0 < pending_count) {
+        uint64_t queue_count = 1, head = 0;
+        if (0 == queue_cap && NULL == (queue = malloc((queue_cap = 1024) * sizeof(off_t)))) goto err;
+        queue[0] = pending[--pending_count];
+        for (; head < queue_count; head++) {
+            struct packed_node *packed = packed_find(pack, queue[head]);
+            if (NULL == packed || CTDB_OK != load_node(pack->old_db, queue[head], node)) goto err;
+            off_t size = NODE_DISK_SIZE(node) + (0 < packed->value_pos ? CTDB_LEAF_SIZE : 0);
+            off_t room = CTDB_PAGE_SIZE - cursor % CTDB_PAGE_SIZE;
+            if (size > room) {
+                if (0 < head) {  //the page is full, the frontier waits on the stack (the leftmost on top)
+                    uint64_t i = queue_count;
+                    while (head < i) {
+                        pending[pending_count++] = queue[--i];
+                    }
+                    break;
+                }
+                cursor += room;  //a block starts on a new page
+            }
+            packed->new_pos = cursor;
+            cursor += size;
+            if (queue_cap < queue_count + node->items_count) {
+                off_t *new_queue = realloc(queue, (queue_cap = (queue_count + node->items_count) * 2) * sizeof(off_t));
+                if (NULL == new_queue) goto err;
+                queue = new_queue;
+            }
+            int items_index = 0;
+            for (; items_index < node->items_count; items_index++) {
+                queue[queue_count++] = node->items[items_index].sub_node_pos;
+            }
+        }
+    }
+    *end = cursor;
+    free(node);
+    free(pending);
+    free(queue);
+    return CTDB_OK;
+
+err:
+    free(node);
+    free(pending);
+    free(queue);
+    return CTDB_ERR;
+}
+
+//every node is written where the layout put it, with its leaf behind it
+static int pack_nodes(struct vacuum_pack *pack) {
+    struct ctdb_node *node = malloc(sizeof(*node));
+    struct serializer ser = SERIALIZER_INIT(CTDB_NODE_SIZE + CTDB_MAX_CHAR_RANGE * CTDB_ITEMS_SIZE + CTDB_LEAF_SIZE);
+    if (NULL == node) return CTDB_ERR;
+    uint64_t i = 0;
+    for (; i < pack->nodes_count; i++) {
+        struct packed_node *packed = &(pack->nodes[i]);
+        struct ctdb_leaf leaf = {.version = 0, .value_len = 0, .value_pos = -1};
+        if (CTDB_OK != load_node(pack->old_db, packed->old_pos, node)) goto err;
+        if (0 < packed->value_pos && CTDB_OK != load_leaf(pack->old_db, node->leaf_pos, &leaf)) goto err;
+        node->leaf_pos = 0 < packed->value_pos ? packed->new_pos + NODE_DISK_SIZE(node) : 0;
+        node->count = packed->count;
+        int items_index = 0;
+        for (; items_index < node->items_count; items_index++) {
+            struct packed_node *sub = packed_find(pack, node->items[items_index].sub_node_pos);
+            if (NULL == sub) goto err;
+            node->items[items_index].sub_node_pos = sub->new_pos;
+            node->items[items_index].sub_count = sub->count;
+        }
+        ser.offset = 0;
+        if (CTDB_OK != encode_node(node, &ser)) goto err;
+        if (0 < packed->value_pos) {
+            leaf.value_pos = packed->value_pos;
+            if (CTDB_OK != encode_leaf(&leaf, &ser)) goto err;
+            STATS_ADD(pack->new_db, leaf_dumps, 1);
+        }
+        if (ser.offset != write_at(pack->new_db, packed->new_pos, ser.buf, ser.offset)) goto err;
+        STATS_ADD(pack->new_db, node_dumps, 1);
+    }
+    free(node);
+    return CTDB_OK;
+
+err:
+    free(node);
+    return CTDB_ERR;
+}
+
+static off_t vacuum_packed(struct ctdb *old_db, struct ctdb *new_db, off_t root_pos, int64_t now, struct ctdb_dedup *shared, uint64_t *live_bytes) {
+    struct vacuum_pack pack = {.old_db = old_db, .new_db = new_db, .now = now, .shared = shared, .live_bytes = 0, .nodes = NULL, .nodes_count = 0, .nodes_cap = 0};
+    uint64_t count = 0;
+    off_t end = 0;
+    if (CTDB_OK != pack_values(&pack, root_pos, &count)) goto err;
+    qsort(pack.nodes, pack.nodes_count, sizeof(struct packed_node), packed_node_cmp);
+    off_t start = (file_end(new_db) + CTDB_PAGE_SIZE - 1) / CTDB_PAGE_SIZE * CTDB_PAGE_SIZE;
+    if (CTDB_OK != pack_layout(&pack, root_pos, start, &end)) goto err;
+    if (CTDB_OK != pack_nodes(&pack)) goto err;
+    new_db->end_pos = end;
+    new_db->appended_bytes += end - start;
+    *live_bytes = pack.live_bytes;
+    off_t new_root_pos = packed_find(&pack, root_pos)->new_pos;
+    free(pack.nodes);
+    return new_root_pos;
+
+err:
+    free(pack.nodes);
+    return -1;
+}
+
+static int vacuum(struct ctdb_transaction *trans, struct ctdb *new_db, uint8_t is_packed) {
+    struct ctdb_dedup *shared = NULL;
     if (NULL == trans || 1 != trans->is_isvalid) goto err; //verify that the transaction has not been committed or rolled back
     if (NULL == new_db) goto err;
+    if (NULL != trans->pending || 0 < trans->footer.log_pos) goto err;  //the memtable is flushed first, only the trie is copied
 
     //copy the values to new_db
     struct ctdb_node root_node = {.prefix_len = 0, .leaf_pos = 0, .items_count = 0};
-    if (CTDB_OK != load_node(trans->db->fd, trans->footer.root_pos, &root_node)) goto err;
-    off_t new_root_pos = vacuum_travel(trans->db->fd, new_db->fd, &root_node);
+    if (CTDB_OK != load_node(trans->db, trans->footer.root_pos, &root_node)) goto err;
+    uint64_t live_bytes = 0;
+    off_t new_root_pos = -1;
+    if ((0 < trans->db->dedup_min_len || 0 < new_db->dedup_min_len) && NULL == (shared = dedup_new())) goto err;  //the values may be shared
+    if (is_packed && 0 == new_db->segment_size) {
+        new_root_pos = vacuum_packed(trans->db, new_db, trans->footer.root_pos, time(NULL), shared, &live_bytes);
+    } else {  //a segment could roll over in the middle of the blocks
+        new_root_pos = vacuum_travel(trans->db, new_db, &root_node, time(NULL), shared, &live_bytes);
+    }
     if (0 >= new_root_pos) goto err;
     
     //commit a new transaction for new_db
     struct ctdb_transaction new_db_trans = { 
         .is_isvalid = 1, 
+        .is_forced = 1, 
         .db = new_db, 
         .footer = {
             .tran_count = trans->footer.tran_count, 
             .del_count = 0, 
-            .root_pos = new_root_pos
+            .root_pos = new_root_pos,
+            .live_bytes = live_bytes
         }
     };
-    ctdb_transaction_commit(&new_db_trans);
+    if (0 < trans->footer.filter_pos &&
+        CTDB_OK != rebuild_filter(trans->db, &(trans->footer), new_db, new_root_pos, &(new_db_trans.footer.filter_pos))) {
+        goto err;
+    }
+    if (CTDB_OK != ctdb_transaction_commit(&new_db_trans)) goto err;
+    if (NULL != __atomic_load_n(&(trans->db->index), __ATOMIC_ACQUIRE) && CTDB_OK != dump_index(new_db, &(new_db_trans.footer))) goto err;
+    dedup_free(shared);
+    return CTDB_OK;
+
+err:
+    dedup_free(shared);
+    return CTDB_ERR;
+}
+
+int ctdb_vacuum(struct ctdb_transaction *trans, struct ctdb *new_db) {
+    return vacuum(trans, new_db, 0);
+}
+
+int ctdb_vacuum_packed(struct ctdb_transaction *trans, struct ctdb *new_db) {
+    return vacuum(trans, new_db, 1);
+}
+
+int ctdb_build_filter(struct ctdb_transaction *trans, uint32_t bits_per_key) {
+    if (NULL == trans || 1 != trans->is_isvalid || trans->is_readonly) goto err;
+    if (0 == bits_per_key || 64 < bits_per_key) goto err;
+    if (CTDB_OK != writer_begin(trans)) goto err;
+    off_t filter_pos = 0;
+    if (CTDB_OK != dump_filter(trans->db, trans->footer.root_pos, bits_per_key, &filter_pos)) goto err;
+    trans->footer.filter_pos = filter_pos;
+    trans->footer.delta_pos = 0;
+    free_filter_hashes(trans);  //the keys put so far are in the filter
+    return CTDB_OK;
+
+err:
+    return CTDB_ERR;
+}
+
+int ctdb_build_index(struct ctdb_transaction *trans) {
+    if (NULL == trans || 1 != trans->is_isvalid || trans->is_writer) return CTDB_ERR;  //nothing put, the footer is in the file
+    if (0 >= trans->footer.pos) return CTDB_ERR;
+    return dump_index(trans->db, &(trans->footer));
+}
+
+int ctdb_usage(struct ctdb *db, struct ctdb_usage *usage) {
+    if (NULL == db || NULL == usage) return CTDB_ERR;
+    struct ctdb_footer footer;
+    read_committed(db, &footer);
+    footer_usage(db, &footer, usage);
+    return CTDB_OK;
+}
+
+int ctdb_set_vacuum_policy(struct ctdb *db, double ratio, uint64_t min_bytes, ctdb_vacuum_hook *hook, void *arg) {
+    if (NULL == db || 0 >= ratio || 1 < ratio) return CTDB_ERR;
+    db->vacuum_ratio = ratio;
+    db->vacuum_min_bytes = min_bytes;
+    db->vacuum_arg = arg;
+    db->vacuum_hook = hook;
+    db->is_vacuum_fired = 0;
+    return CTDB_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// segments
+///////////////////////////////////////////////////////////////////////////////
+#define IS_VICTIM(pos) (SEGMENT_OF(pos) <= tail && is_victim[SEGMENT_OF(pos)])
+
+//the live bytes of every segment: the nodes, and the leaves and values of the keys that are not deleted
+static int segment_usage_travel(struct ctdb *db, off_t trav_pos, uint32_t tail, uint64_t *live) {
+    struct ctdb_node trav = {.prefix_len = 0, .leaf_pos = 0, .items_count = 0};
+    if (tail < SEGMENT_OF(trav_pos) || CTDB_OK != load_node(db, trav_pos, &trav)) return CTDB_ERR;
+    live[SEGMENT_OF(trav_pos)] += NODE_DISK_SIZE(&trav);
+    if (0 < trav.leaf_pos) {
+        struct ctdb_leaf leaf = {.version = 0, .value_len = 0, .value_pos = -1};
+        if (CTDB_OK != load_leaf(db, trav.leaf_pos, &leaf)) return CTDB_ERR;
+        if (0 < leaf.value_len) {
+            if (tail < SEGMENT_OF(trav.leaf_pos) || tail < SEGMENT_OF(leaf.value_pos)) return CTDB_ERR;
+            live[SEGMENT_OF(trav.leaf_pos)] += CTDB_LEAF_SIZE;
+            live[SEGMENT_OF(leaf.value_pos)] += leaf.value_len;
+        }
+    }
+    int items_index = 0;
+    for (; items_index < trav.items_count; items_index++) {
+        if (CTDB_OK != segment_usage_travel(db, trav.items[items_index].sub_node_pos, tail, live)) return CTDB_ERR;
+    }
+    return CTDB_OK;
+}
+
+//whatever is in a victim is appended again, and so is the path to it, the rest stays where it is
+static off_t compact_travel(struct ctdb *db, off_t trav_pos, uint32_t tail, uint8_t *is_victim) {
+    char *value = NULL;
+    struct ctdb_node trav = {.prefix_len = 0, .leaf_pos = 0, .items_count = 0};
+    if (CTDB_OK != load_node(db, trav_pos, &trav)) goto err;
+    uint8_t is_moved = IS_VICTIM(trav_pos);
+    if (0 < trav.leaf_pos) {
+        struct ctdb_leaf leaf = {.version = 0, .value_len = 0, .value_pos = -1};
+        if (CTDB_OK != load_leaf(db, trav.leaf_pos, &leaf)) goto err;
+        if (0 >= leaf.value_len) {
+            if (IS_VICTIM(trav.leaf_pos)) {  //the leaf of a delete is dropped rather than moved
+                trav.leaf_pos = 0;
+                is_moved = 1;
+            }
+        } else if (IS_VICTIM(trav.leaf_pos) || IS_VICTIM(leaf.value_pos)) {
+            if (IS_VICTIM(leaf.value_pos)) {
+                if (NULL == (value = malloc(leaf.value_len))) goto err;
+                if (CTDB_OK != ctdb_read_value(db, &leaf, value)) goto err;
+                uint64_t shared_bytes = 0;  //the same value under another key was moved already
+                if (0 >= (leaf.value_pos = append_value_shared(db, value, leaf.value_len, &shared_bytes))) goto err;
+                free(value);
+                value = NULL;
+            }
+            if (0 >= (trav.leaf_pos = dump_leaf(db, &leaf))) goto err;
+            is_moved = 1;
+        }
+    }
+    int items_index = 0;
+    for (; items_index < trav.items_count; items_index++) {
+        off_t sub_node_pos = compact_travel(db, trav.items[items_index].sub_node_pos, tail, is_victim);
+        if (0 >= sub_node_pos) goto err;
+        if (sub_node_pos != trav.items[items_index].sub_node_pos) {
+            trav.items[items_index].sub_node_pos = sub_node_pos;
+            is_moved = 1;
+        }
+    }
+    return is_moved ? dump_node(db, NULL, &trav) : trav_pos;
+
+err:
+    free(value);
+    return -1;
+}
+
+int ctdb_compact_segments(struct ctdb_transaction *trans, double ratio, uint32_t *compacted) {
+    uint64_t *live = NULL;
+    uint8_t *is_victim = NULL;
+    if (NULL == trans || 1 != trans->is_isvalid || trans->is_readonly || NULL == compacted) goto err;
+    struct ctdb *db = trans->db;
+    uint64_t pinned = 0;
+    if (0 == db->segment_size) goto err;
+    if (CTDB_OK == ctdb_oldest_snapshot(db, &pinned)) goto err;  //a snapshot may still read the victims
+    if (CTDB_OK != writer_begin(trans)) goto err;
+    if (NULL != trans->pending || 0 < trans->footer.log_pos) goto err;  //the memtable is flushed first, the log blocks would not move
+
+    //the sealed segments with enough garbage, never the tail (it is still appended to)
+    uint32_t tail = db->tail_segment, victims = 0, segment = 0;
+    if (NULL == (live = calloc(tail + 1, sizeof(*live))) || NULL == (is_victim = calloc(tail + 1, sizeof(*is_victim)))) goto err;
+    if (0 < trans->footer.root_pos && CTDB_OK != segment_usage_travel(db, trans->footer.root_pos, tail, live)) goto err;
+    for (; segment < tail; segment++) {
+        off_t offset = 0;
+        int fd = segment_fd(db, SEGMENT_POS(segment, 0), &offset);
+        off_t size = 0 <= fd ? lseek(fd, 0, SEEK_END) : -1;
+        STATS_ADD(db, syscalls, 1);
+        if (CTDB_HEADER_SIZE >= size) continue;  //compacted already
+        if ((double)(size - CTDB_HEADER_SIZE - live[segment]) < ratio * (size - CTDB_HEADER_SIZE)) continue;
+        is_victim[segment] = 1;
+        victims += 1;
+    }
+    if (0 < victims && 0 < trans->footer.root_pos) {
+        dedup_clear(db->dedup);  //some of the values are in the victims
+        off_t new_root_pos = compact_travel(db, trans->footer.root_pos, tail, is_victim);
+        if (0 >= new_root_pos) goto err;
+        trans->footer.root_pos = new_root_pos;  //the same keys, 'live_bytes' does not change
+        if (0 < trans->footer.filter_pos) {  //the filter and its log may be in the victims too
+            if (CTDB_OK != rebuild_filter(db, &(trans->footer), db, new_root_pos, &(trans->footer.filter_pos))) goto err;
+            trans->footer.delta_pos = 0;
+            free_filter_hashes(trans);
+        }
+    }
+    if (CTDB_OK != ctdb_transaction_commit(trans)) goto err;
+
+    //nothing committed points into the victims any more, but another transaction or snapshot, of this handle or
+    //of another process, may still read an older root: then they stay, all garbage, for the next compaction.
+    //The readers that begin meanwhile wait, and get the new root
+    pthread_mutex_lock(&(db->readers_lock));
+    uint8_t is_alone = db->readers == trans->is_reader && CTDB_OK == lock_readers(db, F_WRLCK, F_OFD_SETLK);
+    if (!is_alone) {
+        victims = 0;
+        memset(is_victim, 0, tail + 1);
+    }
+    for (segment = 0; segment < tail; segment++) {
+        off_t offset = 0;
+        int fd = segment_fd(db, SEGMENT_POS(segment, 0), &offset);
+        if (!is_victim[segment] || 0 > fd) continue;
+        off_t size = lseek(fd, 0, SEEK_END);
+        STATS_ADD(db, syscalls, 2);
+        if (0 == segment) {  //the header of the file stays, it has the segment size
+            if (0 == ftruncate(fd, CTDB_HEADER_SIZE) && CTDB_HEADER_SIZE < size) db->sealed_bytes -= size - CTDB_HEADER_SIZE;
+            continue;
+        }
+        char path[PATH_MAX];
+        if (sizeof(path) <= snprintf(path, sizeof(path), CTDB_SEGMENT_FMT, db->path, segment) || -1 == unlink(path)) continue;
+        close(__atomic_exchange_n(&db->segment_fds[segment], -1, __ATOMIC_ACQ_REL));
+        if (0 < size) db->sealed_bytes -= size;
+    }
+    if (0 < victims) sync_dir(db);
+    if (is_alone) lock_readers(db, 0 < db->readers ? F_RDLCK : F_UNLCK, F_OFD_SETLK);
+    pthread_mutex_unlock(&(db->readers_lock));
+    *compacted = victims;
+    free(live);
+    free(is_victim);
     return CTDB_OK;
 
 err:
+    if (NULL != trans && trans->is_isvalid) ctdb_transaction_rollback(trans);
+    free(live);
+    free(is_victim);
     return CTDB_ERR;
 }
+
+///////////////////////////////////////////////////////////////////////////////
+// commit notification
+///////////////////////////////////////////////////////////////////////////////
+uint32_t ctdb_commit_seq(struct ctdb *db) {
+    if (NULL == db) return 0;
+    return __atomic_load_n(&db->committed->seq, __ATOMIC_ACQUIRE) & ~1U;
+}
+
+int ctdb_wait_commit(struct ctdb *db, uint32_t seq, int timeout_ms) {
+    if (NULL == db) return CTDB_ERR;
+    struct ctdb_commit_record *rec = db->committed;
+    struct timespec deadline, timeout;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (1000000000L <= deadline.tv_nsec) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    int res = CTDB_ERR;
+    __atomic_fetch_add(&rec->waiters, 1, __ATOMIC_SEQ_CST);
+    while (1) {
+        uint32_t cur = __atomic_load_n(&rec->seq, __ATOMIC_SEQ_CST);
+        if (0 == (cur & 1) && cur != seq) {
+            res = CTDB_OK;
+            break;
+        }
+        struct timespec *wait_for = NULL;  //forever
+        if (0 <= timeout_ms) {
+            clock_gettime(CLOCK_MONOTONIC, &timeout);
+            timeout.tv_sec = deadline.tv_sec - timeout.tv_sec;
+            timeout.tv_nsec = deadline.tv_nsec - timeout.tv_nsec;
+            if (0 > timeout.tv_nsec) {
+                timeout.tv_sec -= 1;
+                timeout.tv_nsec += 1000000000L;
+            }
+            if (0 > timeout.tv_sec) break;  //timed out
+            wait_for = &timeout;
+        }
+        STATS_ADD(db, syscalls, 1);
+        futex(&rec->seq, FUTEX_WAIT, cur, wait_for);  //returns at once if 'seq' has moved on
+    }
+    __atomic_fetch_sub(&rec->waiters, 1, __ATOMIC_RELAXED);
+    return res;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// stats
+///////////////////////////////////////////////////////////////////////////////
+int ctdb_get_stats(struct ctdb *db, struct ctdb_stats *stats) {
+    if (NULL == db || NULL == stats) return CTDB_ERR;
+    memset(stats, 0, sizeof(*stats));
+    int i = 0;
+    for (; i < CTDB_STATS_SLOTS; i++) {
+        struct ctdb_stats *slot = &(db->stats_slots[i].stats);
+        stats->node_loads += __atomic_load_n(&slot->node_loads, __ATOMIC_RELAXED);
+        stats->node_dumps += __atomic_load_n(&slot->node_dumps, __ATOMIC_RELAXED);
+        stats->leaf_loads += __atomic_load_n(&slot->leaf_loads, __ATOMIC_RELAXED);
+        stats->leaf_dumps += __atomic_load_n(&slot->leaf_dumps, __ATOMIC_RELAXED);
+        stats->bytes_read += __atomic_load_n(&slot->bytes_read, __ATOMIC_RELAXED);
+        stats->bytes_written += __atomic_load_n(&slot->bytes_written, __ATOMIC_RELAXED);
+        stats->syscalls += __atomic_load_n(&slot->syscalls, __ATOMIC_RELAXED);
+        stats->fsyncs += __atomic_load_n(&slot->fsyncs, __ATOMIC_RELAXED);
+        stats->footer_scan_steps += __atomic_load_n(&slot->footer_scan_steps, __ATOMIC_RELAXED);
+        stats->cache_hits += __atomic_load_n(&slot->cache_hits, __ATOMIC_RELAXED);
+        stats->lookups += __atomic_load_n(&slot->lookups, __ATOMIC_RELAXED);
+        stats->lookup_depth += __atomic_load_n(&slot->lookup_depth, __ATOMIC_RELAXED);
+        stats->commits += __atomic_load_n(&slot->commits, __ATOMIC_RELAXED);
+        stats->commit_payload_bytes += __atomic_load_n(&slot->commit_payload_bytes, __ATOMIC_RELAXED);
+        stats->commit_written_bytes += __atomic_load_n(&slot->commit_written_bytes, __ATOMIC_RELAXED);
+        stats->filter_negatives += __atomic_load_n(&slot->filter_negatives, __ATOMIC_RELAXED);
+        stats->index_probes += __atomic_load_n(&slot->index_probes, __ATOMIC_RELAXED);
+        stats->memtable_hits += __atomic_load_n(&slot->memtable_hits, __ATOMIC_RELAXED);
+        stats->memtable_flushes += __atomic_load_n(&slot->memtable_flushes, __ATOMIC_RELAXED);
+        stats->dedup_hits += __atomic_load_n(&slot->dedup_hits, __ATOMIC_RELAXED);
+        stats->dedup_bytes += __atomic_load_n(&slot->dedup_bytes, __ATOMIC_RELAXED);
+    }
+    if (0 < stats->lookups)
+        stats->avg_lookup_depth = (double)stats->lookup_depth / stats->lookups;
+    if (0 < stats->commit_payload_bytes)
+        stats->write_amplification = (double)stats->commit_written_bytes / stats->commit_payload_bytes;
+    return CTDB_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// tracing
+///////////////////////////////////////////////////////////////////////////////
+#ifdef CTDB_TRACING
+int ctdb_set_trace_hook(struct ctdb *db, ctdb_trace_hook *hook, void *arg) {
+    if (NULL == db) return CTDB_ERR;
+    db->trace_arg = arg;
+    db->trace_hook = hook;
+    return CTDB_OK;
+}
+
+int ctdb_enable_histograms(struct ctdb *db) {
+    if (NULL == db) return CTDB_ERR;
+    if (NULL == db->histograms) {
+        db->histograms = calloc(CTDB_OP_MAX, sizeof(struct ctdb_histogram));
+        if (NULL == db->histograms) return CTDB_ERR;
+    }
+    return CTDB_OK;
+}
+
+int ctdb_get_histogram(struct ctdb *db, int op, struct ctdb_histogram *hist) {
+    if (NULL == db || NULL == db->histograms || NULL == hist) return CTDB_ERR;
+    if (0 > op || CTDB_OP_MAX <= op) return CTDB_ERR;
+    struct ctdb_histogram *src = db->histograms + op;
+    hist->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    hist->sum_ns = __atomic_load_n(&src->sum_ns, __ATOMIC_RELAXED);
+    hist->max_ns = __atomic_load_n(&src->max_ns, __ATOMIC_RELAXED);
+    int i = 0;
+    for (; i < CTDB_HIST_BUCKETS; i++) {
+        hist->buckets[i] = __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+    }
+    return CTDB_OK;
+}
+#else
+int ctdb_set_trace_hook(struct ctdb *db, ctdb_trace_hook *hook, void *arg) {
+    return CTDB_ERR;  //built without CTDB_TRACING
+}
+
+int ctdb_enable_histograms(struct ctdb *db) {
+    return CTDB_ERR;  //built without CTDB_TRACING
+}
+
+int ctdb_get_histogram(struct ctdb *db, int op, struct ctdb_histogram *hist) {
+    return CTDB_ERR;  //built without CTDB_TRACING
+}
+#endif
+
+uint64_t ctdb_histogram_percentile(struct ctdb_histogram *hist, double percentile) {
+    if (NULL == hist || 0 == hist->count) return 0;
+    uint64_t rank = (uint64_t)(hist->count * percentile / 100.0);
+    if (rank >= hist->count) rank = hist->count - 1;
+    uint64_t seen = 0;
+    int i = 0;
+    for (; i < CTDB_HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen > rank) {
+            if (i < (1 << CTDB_HIST_SUB_BITS)) return i;
+            int shift = (i >> CTDB_HIST_SUB_BITS) - 1;
+            uint64_t mantissa = (i & ((1 << CTDB_HIST_SUB_BITS) - 1)) | (1 << CTDB_HIST_SUB_BITS);
+            uint64_t upper = ((mantissa + 1) << shift) - 1;  //report the upper bound of the bucket
+            return upper < hist->max_ns ? upper : hist->max_ns;
+        }
+    }
+    return hist->max_ns;
+}
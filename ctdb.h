@@ -17,11 +17,17 @@
 
 #ifndef __CTDB_H_
 #define __CTDB_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 #define CTDB_CHAR_LEN 1
+#define CTDB_I16_LEN 2
 #define CTDB_I32_LEN 4
 #define CTDB_I64_LEN 8
 
@@ -29,77 +35,312 @@ extern "C" {
 #define CTDB_HEADER_SIZE 128
 #define CTDB_MAGIC_STR "ctdb"
 #define CTDB_MAGIC_LEN 4
-#define CTDB_VERSION_NUM 1
+#define CTDB_VERSION_NUM 8
 
 //limits
-#define CTDB_MAX_KEY_LEN 64
+#define CTDB_MAX_KEY_LEN 4096
+#define CTDB_MAX_PREFIX_LEN 64  //longer key remainders are chunked into a chain of nodes
 #define CTDB_MAX_CHAR_RANGE 256
 #define CTDB_MAX_VALUE_LEN (1024 * 1024 * 1024) //1G
 
 //node header
-#define CTDB_ITEMS_SIZE (CTDB_CHAR_LEN + CTDB_I64_LEN) //sub_prefix_char, sub_node_pos
-#define CTDB_NODE_SIZE (CTDB_CHAR_LEN + CTDB_MAX_KEY_LEN + CTDB_I64_LEN + CTDB_CHAR_LEN) //prefix_len, prefix, leaf_pos, items_count
-#define CTDB_LEAF_SIZE (CTDB_I64_LEN + CTDB_I32_LEN + CTDB_I64_LEN) //version, value_len, value_pos
+#define CTDB_ITEMS_SIZE (CTDB_CHAR_LEN + CTDB_I64_LEN + CTDB_I64_LEN) //sub_prefix_char, sub_node_pos, sub_count
+#define CTDB_NODE_SIZE (CTDB_CHAR_LEN + CTDB_MAX_PREFIX_LEN + CTDB_I64_LEN + CTDB_I16_LEN + CTDB_I64_LEN) //prefix_len, prefix, leaf_pos, items_count, count
+#define CTDB_LEAF_SIZE (CTDB_I64_LEN + CTDB_I32_LEN + CTDB_I64_LEN + CTDB_I64_LEN) //version, value_len, value_pos, expire
 
 //check sum
 #define CTDB_FOOTER_ALIGNED_BASE (32)
-#define CTDB_FOOTER_SIZE (CTDB_I64_LEN * 5) //cksum_1, tran_count, del_count, root_pos, cksum_2
+#define CTDB_FOOTER_SIZE (CTDB_I64_LEN * 10) //cksum_1, tran_count, del_count, root_pos, prev_pos, live_bytes, filter_pos, delta_pos, log_pos, cksum_2
 
 #define CTDB_OK 0
 #define CTDB_ERR -1
+#define CTDB_CONFLICT -2  //a conditional put found the key in another state, nothing was written
 
-struct ctdb{
-    int fd;
+//the commit record shared by the processes that open the same file
+#define CTDB_SHM_SUFFIX "-shm"
+
+//segments, '<path>' is segment 0 and holds the header, the others are '<path>-seg-<id>'
+#define CTDB_SEGMENT_FMT "%s-seg-%u"
+#define CTDB_SEGMENT_SHIFT 40  //a position is the segment id above the offset in the segment
+#define CTDB_MAX_SEGMENTS 4096  //ids are never reused, a vacuum into a new file starts over
+
+//stats
+#define CTDB_STATS_SLOTS 16
+
+//vacuum, the unit of the packed layout
+#define CTDB_PAGE_SIZE 4096
+
+//streaming, a put from a pipe or a socket is read in chunks of this size
+#define CTDB_STREAM_CHUNK_SIZE (64 * 1024)
+
+//pinned, the root and the level below it are kept decoded by default
+#define CTDB_PINNED_LEVELS 2
+
+//filter, a blocked bloom filter over the live keys and a log of the keys put since it was built
+#define CTDB_FILTER_HEADER_SIZE (CTDB_I64_LEN * 2 + CTDB_I32_LEN)  //blocks, keys, hashes per key, then 64 bytes per block
+#define CTDB_DELTA_HEADER_SIZE (CTDB_I64_LEN * 2 + CTDB_I32_LEN)  //prev_pos, total, count, then a hash per key
+
+//memtable, the keys of buffered puts are logged in blocks chained from the footer until a flush
+#define CTDB_LOG_HEADER_SIZE (CTDB_I64_LEN * 3 + CTDB_I32_LEN * 2)  //prev_pos, first_pos, total, count, len, then the keys
+
+//index, a hash table from the keys to their leaves for one root, kept in '<path>-idx' (other roots search the trie)
+#define CTDB_INDEX_SUFFIX "-idx"
+#define CTDB_INDEX_MAGIC_STR "ctix"
+#define CTDB_INDEX_HEADER_SIZE (CTDB_MAGIC_LEN + CTDB_I64_LEN * 2)  //magic, footer_pos, slots
+#define CTDB_INDEX_SLOT_SIZE (CTDB_I64_LEN * 3)  //hash, check, leaf_pos
+
+//snapshots
+#define CTDB_MAX_SNAPSHOTS 64
+#define CTDB_PIN_ANNOUNCED UINT64_MAX  //a snapshot is reading the last committed root, pinned at it or after it
+
+struct ctdb_stats{
+    uint64_t node_loads;
+    uint64_t node_dumps;
+    uint64_t leaf_loads;
+    uint64_t leaf_dumps;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t syscalls;  //read, write, seek, sync and sendfile calls issued against the file
+    uint64_t fsyncs;
+    uint64_t footer_scan_steps;  //aligned positions probed while searching for the last footer
+    uint64_t cache_hits;  //nodes copied from the pinned levels instead of read
+    uint64_t lookups;  //searches that descend from the root (get, iterator)
+    uint64_t filter_negatives;  //gets answered by the filter without a search
+    uint64_t index_probes;  //gets answered by the index without a search
+    uint64_t memtable_hits;  //gets answered by the buffered puts
+    uint64_t memtable_flushes;  //commits that applied the memtable to the trie
+    uint64_t dedup_hits;  //puts whose leaf points to a value that was already in the file
+    uint64_t dedup_bytes;  //the value bytes they did not append
+    uint64_t lookup_depth;  //nodes visited by those searches
+    uint64_t commits;
+    uint64_t commit_payload_bytes;  //key and value bytes put by the committed transactions
+    uint64_t commit_written_bytes;  //bytes appended to the file by the committed transactions
+
+    //derived by ctdb_get_stats
+    double avg_lookup_depth;
+    double write_amplification;  //commit_written_bytes / commit_payload_bytes
 };
 
+//tracing, the hooks compile to nothing unless the library is built with CTDB_TRACING
+#define CTDB_OP_GET 0
+#define CTDB_OP_PUT 1
+#define CTDB_OP_COMMIT 2
+#define CTDB_OP_FSYNC 3
+#define CTDB_OP_ITER_STEP 4
+#define CTDB_OP_MAX 5
+
+#define CTDB_TRACE_BEGIN 0
+#define CTDB_TRACE_END 1
+
+#define CTDB_HIST_SUB_BITS 3  //linear sub-buckets per power of two (relative error 1/8)
+#define CTDB_HIST_BUCKETS (64 << CTDB_HIST_SUB_BITS)
+
+struct ctdb_histogram{
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[CTDB_HIST_BUCKETS];
+};
+
+//called at the begin and the end of an operation, 'depth' is the number of nodes visited and 'bytes' the bytes read or written
+typedef void ctdb_trace_hook(void *arg, int op, int phase, uint32_t key_len, uint32_t depth, uint64_t bytes);
+
 struct ctdb_node{
     uint8_t prefix_len;
-    char prefix[CTDB_MAX_KEY_LEN + 1];
+    char prefix[CTDB_MAX_PREFIX_LEN + 1];
     off_t leaf_pos;
     
-    uint8_t items_count;
+    uint16_t items_count;
+    uint64_t count;  //live keys in the subtree, the leaf of this node included
     struct ctdb_node_item{
-        char sub_prefix_char;
+        uint8_t sub_prefix_char;
         off_t sub_node_pos;
+        uint64_t sub_count;  //live keys under the sub node
     }items[CTDB_MAX_CHAR_RANGE];
 };
 
 struct ctdb_leaf{
     //int create_time;
-    //int expire;
     //int fingerprint;
     uint64_t version;
     uint32_t value_len;
     off_t value_pos;
+    int64_t expire;  //unix time (seconds) from which the key is gone, 0 never expires
 };
 
 struct ctdb_footer{
     uint64_t tran_count;
     uint64_t del_count;
     off_t root_pos;
+    off_t prev_pos;  //the footer committed before this one, 0 for the first
+    uint64_t live_bytes;  //estimate of the bytes reachable from the root, the rest of the file is garbage
+    off_t filter_pos;  //0 without a filter
+    off_t delta_pos;  //the keys put since the filter was built, 0 for none
+    off_t log_pos;  //the keys buffered since the last flush of the memtable, 0 for none
+    off_t pos;  //where this footer is in the file (not stored)
 };    
 
 struct ctdb_transaction{
     uint8_t is_isvalid;
+    uint8_t is_readonly;
+    uint8_t is_writer;  //holds the writer lock, taken by the first put
+    uint8_t is_reader;  //counted in 'db->readers' until freed
+    uint8_t is_forced;  //its footer is committed over whatever is the last one (a vacuum into a new file, a shard rolled back)
     struct ctdb *db;
     struct ctdb_footer footer;
+    struct ctdb_footer base;  //the last committed one when it became the writer, the commit is refused if it is not the last any more
+
+    uint64_t *filter_hashes;  //the keys put by this transaction, for the delta of the filter
+    uint32_t filter_count;
+    uint32_t filter_cap;
+
+    uint64_t payload_bytes;  //key and value bytes put by this transaction
+    uint64_t written_bytes;  //bytes appended to the file by this transaction
+
+    struct ctdb_memtable *pending;  //the buffered puts of this transaction, logged by the commit
+    uint8_t is_flushing;  //the commit applies the memtable to the trie, whatever its size
+};
+
+//mapped from '<path>-shm', readers poll 'seq' or wait on it (futex) instead of scanning for the last footer
+struct ctdb_commit_record{
+    uint32_t seq;  //odd while the footer is being written, even when complete
+    uint32_t waiters;  //processes sleeping in ctdb_wait_commit
+    struct ctdb_footer footer;
+};
+
+//a read-only view on a committed root, shared by any number of threads
+struct ctdb_snapshot{
+    struct ctdb_transaction trans;  //for ctdb_get and ctdb_iterator_travel
+    uint32_t refs;  //0 means the slot is free
+    uint64_t pinned;  //tran_count + 1 of the pinned footer, 0 while not pinned, CTDB_PIN_ANNOUNCED while acquired
+};
+
+//the garbage ratio is dead_bytes / file_bytes, the header and the footers count as dead
+struct ctdb_usage{
+    uint64_t file_bytes;  //up to the end of the last committed footer
+    uint64_t live_bytes;
+    uint64_t dead_bytes;
+    double garbage_ratio;
+};
+
+//called after the commit that took the garbage ratio of the file to the threshold, the hook decides how to vacuum
+typedef void ctdb_vacuum_hook(void *arg, struct ctdb *db, struct ctdb_usage *usage);
+
+struct ctdb{
+    int fd;
+
+    //segments, 'segment_size' 0 is a single file of any size
+    off_t segment_size;  //kept in the header, a segment rolls over once it would grow past it
+    char *path;
+    uint32_t tail_segment;  //appended to by the writer
+    uint64_t sealed_bytes;  //the segments before the tail
+    off_t end_pos;  //the end of the data in the tail segment, where the writer appends
+    off_t alloc_end;  //blocks are allocated up to here
+    off_t prealloc_size;  //0 allocates on write
+    int segment_fds[CTDB_MAX_SEGMENTS];  //opened on first use, -1 until then
+    uint64_t appended_bytes;  //by the writer of this handle, a put measures itself with it
+
+    //vacuum policy, the hook fires once per crossing of 'vacuum_ratio'
+    double vacuum_ratio;
+    uint64_t vacuum_min_bytes;  //smaller files are never worth a vacuum
+    ctdb_vacuum_hook *vacuum_hook;
+    void *vacuum_arg;
+    uint8_t is_vacuum_fired;
+
+    ctdb_trace_hook *trace_hook;
+    void *trace_arg;
+    struct ctdb_histogram *histograms;  //CTDB_OP_MAX histograms, NULL until enabled
+
+    //the last committed footer, published by the committer and read without locks
+    int shm_fd;  //-1 if the record could not be shared, it is private to this handle then
+    struct ctdb_commit_record *committed;
+    uint32_t writer_refs;  //transactions of this handle holding the writer lock (flock on 'fd'), and the syncer
+    pthread_mutex_t readers_lock;  //for 'readers', held by a compaction while it empties segments
+    uint32_t readers;  //live transactions and snapshots of this handle, a read lock on '<path>-shm' while any
+    struct ctdb_snapshot snapshots[CTDB_MAX_SNAPSHOTS];
+
+    //the filter of the last footer that was asked about, loaded once and shared by the readers
+    pthread_mutex_t filter_lock;
+    struct ctdb_filter *filter;
+
+    struct ctdb_index *index;  //NULL without one
+
+    //the top 'pinned_levels' of the last root, refreshed by commits and by transactions that see a new root
+    pthread_rwlock_t pinned_lock;  //readers copy nodes out, a refresh swaps the whole set
+    pthread_mutex_t pinning_lock;  //one refresh at a time
+    struct ctdb_pinned *pinned;
+    uint8_t pinned_levels;
+
+    //pipelined commits, the footers are written by the committers and made durable in order by 'syncer'
+    pthread_mutex_t pipeline_lock;  //also guards 'writer_refs'
+    pthread_cond_t pipeline_cond;
+    pthread_t syncer;  //started by the first pipelined commit
+    uint8_t is_syncer_running;
+    uint8_t is_closing;
+    struct ctdb_footer pending;  //the last footer written, durable once 'durable_ticket' reaches 'written_ticket'
+    int pending_fd;  //the segment 'pending' is in
+    uint64_t written_ticket;
+    uint64_t durable_ticket;
+    uint64_t failed_ticket;  //the first commit whose sync failed, 0 if none, every commit after it fails too
+
+    //the buffered puts of the log generation that was asked about last, see MEMTABLE
+    pthread_rwlock_t memtable_lock;  //readers search it, a newer log extends it
+    struct ctdb_memtable *memtable;
+    uint64_t memtable_flush_bytes;  //0 writes every put to the trie
+
+    //the values appended since open, by content, see DEDUP
+    uint32_t dedup_min_len;  //0 never shares a value
+    struct ctdb_dedup *dedup;
+
+    //every thread counts into its own slot, the slots are merged by ctdb_get_stats
+    struct ctdb_stats_slot{
+        struct ctdb_stats stats;
+    } __attribute__((aligned(64))) stats_slots[CTDB_STATS_SLOTS];
 };
 
 //API
 struct ctdb *ctdb_open(char *path);
+struct ctdb *ctdb_open_segmented(char *path, off_t segment_size);  //an existing file keeps the size it was created with
+int ctdb_set_preallocate(struct ctdb *db, off_t chunk_size);  //allocate the blocks of the file 'chunk_size' at a time, 0 turns it off
+int ctdb_set_pinned_levels(struct ctdb *db, uint8_t levels);  //levels of the last root kept decoded in memory, 0 turns it off
+//buffer the puts of the following transactions in a log and a memtable, applied to the trie once the log passes
+//'flush_bytes' (0 turns it off, the next commit flushes). Count, rank, next, diff and the parallel scan see the trie only
+int ctdb_set_memtable(struct ctdb *db, uint64_t flush_bytes);
+int ctdb_flush_memtable(struct ctdb_transaction *trans);  //the commit of 'trans' flushes, vacuum and compaction need it first
+//a put of a value of at least 'min_len' bytes points to an equal one appended since open instead of a copy (0 turns it
+//off, set before writing). A vacuum and a compaction keep the values shared
+int ctdb_set_dedup(struct ctdb *db, uint32_t min_len);
 struct ctdb_transaction *ctdb_transaction_begin(struct ctdb *db);
-struct ctdb_leaf ctdb_get(struct ctdb_transaction *trans, char *key, uint8_t key_len);
-int ctdb_put(struct ctdb_transaction *trans, char *key, uint8_t key_len, char *value, uint32_t value_len);
-int ctdb_del(struct ctdb_transaction *trans, char *key, uint8_t key_len);
+struct ctdb_leaf ctdb_get(struct ctdb_transaction *trans, char *key, uint16_t key_len);
+int ctdb_put(struct ctdb_transaction *trans, char *key, uint16_t key_len, char *value, uint32_t value_len);
+int ctdb_put_expire(struct ctdb_transaction *trans, char *key, uint16_t key_len, char *value, uint32_t value_len, int64_t expire);
+int ctdb_del(struct ctdb_transaction *trans, char *key, uint16_t key_len);
+//read-modify-write in the descent of the put, CTDB_CONFLICT leaves the transaction as it was
+int ctdb_cas(struct ctdb_transaction *trans, char *key, uint16_t key_len, uint64_t expected_version, char *value, uint32_t value_len);  //if the key is live at 'expected_version' (ctdb_leaf.version)
+int ctdb_put_if_absent(struct ctdb_transaction *trans, char *key, uint16_t key_len, char *value, uint32_t value_len);  //if the key is deleted, expired or was never put
+int ctdb_incr(struct ctdb_transaction *trans, char *key, uint16_t key_len, int64_t delta, int64_t *counter);  //an 8-byte big-endian counter, from 0 if the key is not live
+int ctdb_read_value(struct ctdb *db, struct ctdb_leaf *leaf, char *value);  //'value' is a buffer of 'leaf->value_len', for any layout
+//streaming, large values without a buffer of their size
+int ctdb_put_from_fd(struct ctdb_transaction *trans, char *key, uint16_t key_len, int fd, uint32_t value_len);  //'value_len' bytes from the offset of 'fd'
+int ctdb_read_value_at(struct ctdb *db, struct ctdb_leaf *leaf, uint32_t offset, char *buf, uint32_t len, uint32_t *read_len);  //short at the end of the value
+int ctdb_send_value(struct ctdb *db, struct ctdb_leaf *leaf, int out_fd);  //the whole value, with sendfile
 int ctdb_transaction_commit(struct ctdb_transaction *trans);
+//pipelined, the footer is written and the next transaction can begin on its root at once, a background thread
+//makes the footers durable in order (one sync for all that wait). After a failed sync the handle has to be reopened
+int ctdb_transaction_commit_async(struct ctdb_transaction *trans, uint64_t *ticket);
+int ctdb_wait_durable(struct ctdb *db, uint64_t ticket);  //CTDB_OK once the commit of 'ticket' is durable, CTDB_ERR if its sync failed
 void ctdb_transaction_rollback(struct ctdb_transaction *trans);
 
 void ctdb_transaction_free(struct ctdb_transaction **trans);
 void ctdb_close(struct ctdb **db);
 
+//commit notification, across processes
+uint32_t ctdb_commit_seq(struct ctdb *db);
+int ctdb_wait_commit(struct ctdb *db, uint32_t seq, int timeout_ms);  //CTDB_OK once a commit moved past 'seq', CTDB_ERR on timeout (-1 waits forever)
+
 //iterator
-typedef int ctdb_traversal(int fd, char *key, uint8_t key_len, struct ctdb_leaf leaf);
-int ctdb_iterator_travel(struct ctdb_transaction *trans, char *key, uint8_t key_len, ctdb_traversal *traversal);
+typedef int ctdb_traversal(int fd, char *key, uint16_t key_len, struct ctdb_leaf leaf);
+int ctdb_iterator_travel(struct ctdb_transaction *trans, char *key, uint16_t key_len, ctdb_traversal *traversal);
 #define CTDB_FOREACH(trans, key, key_len, function_body) \
     ({ \
         ctdb_iterator_travel((trans), (key), (key_len), \
@@ -109,9 +350,73 @@ int ctdb_iterator_travel(struct ctdb_transaction *trans, char *key, uint8_t key_
             }) \
         ); \
     })
+//parallel, the subtree under 'key' is split into partitions that 'threads' threads (the caller included) scan.
+//Unordered calls 'traversal' from all of them at once, ordered calls it from the caller only, in key order
+#define CTDB_SCAN_UNORDERED 0
+#define CTDB_SCAN_ORDERED 1
+#define CTDB_SCAN_MAX_THREADS 64
+int ctdb_parallel_travel(struct ctdb_transaction *trans, char *key, uint16_t key_len, int threads, int mode, ctdb_traversal *traversal);
+//the first key after 'key' (or at it, if 'inclusive') in memcmp order, 'next_key' is a buffer of CTDB_MAX_KEY_LEN
+int ctdb_next(struct ctdb_transaction *trans, char *key, uint16_t key_len, uint8_t inclusive, char *next_key, uint16_t *next_key_len, struct ctdb_leaf *leaf);
+
+//count, every node knows the live keys of its subtree. Expired keys are counted until a vacuum drops them,
+//so the count is an upper bound of what ctdb_get and iteration see
+int ctdb_count_prefix(struct ctdb_transaction *trans, char *key, uint16_t key_len, uint64_t *count);
+//the 'rank'-th (from 0) key starting with 'key', 'rank_key' is a buffer of CTDB_MAX_KEY_LEN. The ranks count the
+//expired keys too: an expired one is never returned, the next live key is (CTDB_ERR if there is none under 'key')
+int ctdb_seek_rank(struct ctdb_transaction *trans, char *key, uint16_t key_len, uint64_t rank, char *rank_key, uint16_t *rank_key_len, struct ctdb_leaf *leaf);
+
+//snapshot
+struct ctdb_snapshot *ctdb_snapshot_acquire(struct ctdb *db);
+struct ctdb_snapshot *ctdb_snapshot_retain(struct ctdb_snapshot *snap);
+void ctdb_snapshot_release(struct ctdb_snapshot **snap);
+int ctdb_oldest_snapshot(struct ctdb *db, uint64_t *tran_count);
+
+//history, read-only transactions on any committed footer
+typedef int ctdb_history_traversal(struct ctdb_footer footer);  //the newest first, CTDB_ERR stops
+int ctdb_history(struct ctdb *db, ctdb_history_traversal *traversal);
+struct ctdb_transaction *ctdb_transaction_begin_at(struct ctdb *db, off_t footer_pos);  //read-only, 'footer.pos' of the history
+
+//diff, the keys that differ between two versions of the same file, in key order
+#define CTDB_DIFF_ADDED 0
+#define CTDB_DIFF_CHANGED 1
+#define CTDB_DIFF_DELETED 2
+typedef int ctdb_diff_callback(int fd, char *key, uint16_t key_len, int kind, struct ctdb_leaf old_leaf, struct ctdb_leaf new_leaf);
+int ctdb_diff(struct ctdb_transaction *trans_old, struct ctdb_transaction *trans_new, ctdb_diff_callback *callback);
+
+//replication, a frame is the header followed by the bytes appended to the primary (single files only)
+#define CTDB_FRAME_MAGIC_STR "ctfr"
+#define CTDB_FRAME_HEADER_SIZE (CTDB_MAGIC_LEN + CTDB_I64_LEN * 2)  //magic, start, len
+off_t ctdb_committed_end(struct ctdb *db);  //the end of the last committed footer
+int ctdb_ship(struct ctdb *db, off_t since, int fd);  //the committed bytes after 'since' (the end of the follower), nothing if up to date
+int ctdb_follow(struct ctdb *db, int fd);  //applies one frame, the follower is truncated back if it does not end with a valid footer
+
+//filter, gets of missing keys are mostly answered without a search. Commits log the keys they put,
+//the filter is dropped once the log grows to half its keys, a vacuum of a file with a filter builds a new one
+int ctdb_build_filter(struct ctdb_transaction *trans, uint32_t bits_per_key);  //over the live keys of 'trans', committed with it
+
+//index, a get on the root it was built for is one probe and one leaf read. Built after a bulk load,
+//or by the vacuum of a file that has one
+int ctdb_build_index(struct ctdb_transaction *trans);  //for the root of 'trans', which must be committed and unchanged
 
 //vacuum
 int ctdb_vacuum(struct ctdb_transaction *trans, struct ctdb *new_db);
+//the values in key order, then the nodes packed by subtree into pages (a single file 'new_db', a segmented one gets ctdb_vacuum)
+int ctdb_vacuum_packed(struct ctdb_transaction *trans, struct ctdb *new_db);
+//segmented files only: moves the live data out of the sealed segments with at least 'ratio' garbage,
+//commits 'trans' and truncates them to the header. Older versions (history, snapshots) lose those segments
+int ctdb_compact_segments(struct ctdb_transaction *trans, double ratio, uint32_t *compacted);
+int ctdb_usage(struct ctdb *db, struct ctdb_usage *usage);  //of the last committed footer
+int ctdb_set_vacuum_policy(struct ctdb *db, double ratio, uint64_t min_bytes, ctdb_vacuum_hook *hook, void *arg);  //NULL 'hook' turns it off
+
+//stats
+int ctdb_get_stats(struct ctdb *db, struct ctdb_stats *stats);
+
+//tracing
+int ctdb_set_trace_hook(struct ctdb *db, ctdb_trace_hook *hook, void *arg);
+int ctdb_enable_histograms(struct ctdb *db);
+int ctdb_get_histogram(struct ctdb *db, int op, struct ctdb_histogram *hist);
+uint64_t ctdb_histogram_percentile(struct ctdb_histogram *hist, double percentile);  //in nanoseconds
 
 #ifdef __cplusplus
 }
@@ -32,7 +32,7 @@
 #include "ctdb.h"
 #include "utils.h"
 
-void test_iter(int count, char *prefix, uint8_t prefix_len) {
+void test_iter(int count, char *prefix, uint16_t prefix_len) {
     int key_len = 32;
     char *path = "./test.db";
     struct ctdb *db = ctdb_open(path);
@@ -58,7 +58,7 @@ void test_iter(int count, char *prefix, uint8_t prefix_len) {
     assert(NULL != (trans = ctdb_transaction_begin(db)));
     int g_iter_count = 0;
     int res = CTDB_FOREACH(trans, prefix, prefix_len, 
-                (int fd, char *key, uint8_t key_len, struct ctdb_leaf leaf){
+                (int fd, char *key, uint16_t key_len, struct ctdb_leaf leaf){
                     g_iter_count += 1;
                     assert(0 < leaf.value_len);
                     assert(0 < leaf.value_pos);
@@ -78,11 +78,308 @@ void test_iter(int count, char *prefix, uint8_t prefix_len) {
     ctdb_close(&db);
 }
 
+//keys longer than a node prefix, sharing a long common prefix
+void test_long_keys(int count) {
+    char *path = "./test_long.db";
+    struct ctdb *db = ctdb_open(path);
+    assert(NULL != db);
+
+    char key[CTDB_MAX_KEY_LEN];
+    uint16_t prefix_len = CTDB_MAX_KEY_LEN - 16;
+    memset(key, 'k', prefix_len);
+
+    struct ctdb_transaction *trans = ctdb_transaction_begin(db);
+    assert(NULL != trans);
+    int i = 0;
+    for(; i < count; i++){
+        uint16_t key_len = prefix_len + snprintf(key + prefix_len, 16, "%d", i);
+        assert(CTDB_OK == ctdb_put(trans, key, key_len, key + prefix_len, key_len - prefix_len));
+    }
+    assert(CTDB_OK == ctdb_transaction_commit(trans));
+    ctdb_transaction_free(&trans);
+
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    for(i = 0; i < count; i++){
+        uint16_t key_len = prefix_len + snprintf(key + prefix_len, 16, "%d", i);
+        struct ctdb_leaf leaf = ctdb_get(trans, key, key_len);
+        assert(key_len - prefix_len == leaf.value_len);
+    }
+    int g_iter_count = 0;
+    int res = CTDB_FOREACH(trans, key, prefix_len + 1,  //the keys starting with "kkk...k1"
+                (int fd, char *iter_key, uint16_t iter_key_len, struct ctdb_leaf leaf){
+                    g_iter_count += 1;
+                    assert(prefix_len < iter_key_len && '1' == iter_key[prefix_len]);
+                    return CTDB_OK; //continue 
+                }
+            );
+    assert(CTDB_OK == res && 0 < g_iter_count);
+    printf("long keys sucess, key_len:%u count:%d iter_count:%d\n", prefix_len + 1, count, g_iter_count);
+    ctdb_transaction_free(&trans);
+    ctdb_close(&db);
+}
+
+static void uint64_to_key(uint64_t num, char *key) {
+    int i = 0;
+    for (; i < 8; i++) key[i] = (char)(num >> (56 - i * 8));  //big-endian, so the keys sort numerically
+}
+
+//fixed-width binary keys, containing 0x00 and every other byte
+void test_binary_keys(int count) {
+    char *path = "./test_binary.db";
+    struct ctdb *db = ctdb_open(path);
+    assert(NULL != db);
+
+    struct ctdb_transaction *trans = ctdb_transaction_begin(db);
+    assert(NULL != trans);
+    char key[8];
+    int i = 0;
+    for(; i < count; i++){
+        uint64_to_key(i, key);  //a node with all 256 children
+        assert(CTDB_OK == ctdb_put(trans, key, 8, key, 8));
+        uint64_to_key(i * 0x9E3779B97F4A7C15ULL, key);
+        assert(CTDB_OK == ctdb_put(trans, key, 8, key, 8));
+    }
+    assert(CTDB_OK == ctdb_transaction_commit(trans));
+    ctdb_transaction_free(&trans);
+
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    uint64_to_key(0, key);
+    assert(8 == ctdb_get(trans, key, 8).value_len);
+    uint64_to_key(count - 1, key);
+    assert(8 == ctdb_get(trans, key, 8).value_len);
+
+    int g_iter_count = 0;
+    char last_key[8] = {0};
+    int res = CTDB_FOREACH(trans, "", 0, 
+                (int fd, char *iter_key, uint16_t iter_key_len, struct ctdb_leaf leaf){
+                    assert(8 == iter_key_len);
+                    assert(0 == g_iter_count || 0 > memcmp(last_key, iter_key, 8));  //ascending
+                    memcpy(last_key, iter_key, 8);
+                    g_iter_count += 1;
+                    return CTDB_OK; //continue 
+                }
+            );
+    assert(CTDB_OK == res && 2 * count - 1 == g_iter_count);  //0 is put twice
+    printf("binary keys sucess, count:%d iter_count:%d\n", 2 * count, g_iter_count);
+    ctdb_transaction_free(&trans);
+    ctdb_close(&db);
+}
+
+//counts and ranks agree with a full traversal, after overwrites and deletes
+void test_count(int count) {
+    char *path = "./test_count.db";
+    struct ctdb *db = ctdb_open(path);
+    assert(NULL != db);
+
+    struct ctdb_transaction *trans = ctdb_transaction_begin(db);
+    assert(NULL != trans);
+    int i = 0;
+    for (; i < count; i++) {
+        char *key = random_str_shortly(random_range(1, 12));
+        assert(CTDB_OK == ctdb_put(trans, key, strlen(key), key, strlen(key)));
+        if (0 == i % 3) assert(CTDB_OK == ctdb_put(trans, key, strlen(key), "again", 5));
+        if (0 == i % 5) assert(CTDB_OK == ctdb_del(trans, key, strlen(key)));
+        if (0 == i % 7) assert(CTDB_OK == ctdb_del(trans, "nothing", 7));
+        free(key);
+    }
+    assert(CTDB_OK == ctdb_transaction_commit(trans));
+    ctdb_transaction_free(&trans);
+
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    char *prefixes[] = {"", "a", "ab", "nothing", "zzzzzzzzzzzzz"};
+    int p = 0;
+    for (; p < sizeof(prefixes) / sizeof(prefixes[0]); p++) {
+        char *prefix = prefixes[p];
+        uint16_t prefix_len = strlen(prefix);
+        uint64_t counted = 0;
+        assert(CTDB_OK == ctdb_count_prefix(trans, prefix, prefix_len, &counted));
+
+        uint64_t g_iter_count = 0;
+        int res = CTDB_FOREACH(trans, prefix, prefix_len, 
+                    (int fd, char *iter_key, uint16_t iter_key_len, struct ctdb_leaf leaf){
+                        char rank_key[CTDB_MAX_KEY_LEN];
+                        uint16_t rank_key_len = 0;
+                        struct ctdb_leaf rank_leaf;
+                        if (0 == g_iter_count % 97) {  //the same key at the same rank
+                            assert(CTDB_OK == ctdb_seek_rank(trans, prefix, prefix_len, g_iter_count, rank_key, &rank_key_len, &rank_leaf));
+                            assert(rank_key_len == iter_key_len && 0 == memcmp(rank_key, iter_key, iter_key_len));
+                            assert(rank_leaf.value_pos == leaf.value_pos);
+                        }
+                        g_iter_count += 1;
+                        return CTDB_OK; //continue 
+                    }
+                );
+        assert(counted == g_iter_count && (CTDB_OK == res || 0 == counted));
+        char rank_key[CTDB_MAX_KEY_LEN];
+        uint16_t rank_key_len = 0;
+        struct ctdb_leaf rank_leaf;
+        assert(CTDB_ERR == ctdb_seek_rank(trans, prefix, prefix_len, counted, rank_key, &rank_key_len, &rank_leaf));
+        printf("count '%s': %lu\n", prefix, counted);
+    }
+    ctdb_transaction_free(&trans);
+    ctdb_close(&db);
+}
+
+//only the keys of the second commit are reported, the shared subtrees are not loaded
+void test_diff(int count) {
+    char *path = "./test_diff.db";
+    struct ctdb *db = ctdb_open(path);
+    assert(NULL != db);
+
+    char key[16];
+    int key_len = 0;
+    struct ctdb_transaction *trans = ctdb_transaction_begin(db);
+    assert(NULL != trans);
+    int i = 0;
+    for (; i < count; i++) {
+        key_len = snprintf(key, sizeof(key), "k%05d", i);
+        assert(CTDB_OK == ctdb_put(trans, key, key_len, key, key_len));
+    }
+    assert(CTDB_OK == ctdb_transaction_commit(trans));
+    off_t old_footer_pos = trans->footer.pos;
+    ctdb_transaction_free(&trans);
+
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    for (i = 0; i < 10; i++) {
+        key_len = snprintf(key, sizeof(key), "k%05d", i * 7);
+        assert(CTDB_OK == ctdb_put(trans, key, key_len, "changed", 7));
+        key_len = snprintf(key, sizeof(key), "k%05d", 100 + i);
+        assert(CTDB_OK == ctdb_del(trans, key, key_len));
+        key_len = snprintf(key, sizeof(key), "k%05dx", 200 + i);  //below an existing key
+        assert(CTDB_OK == ctdb_put(trans, key, key_len, key, key_len));
+    }
+    assert(CTDB_OK == ctdb_put(trans, "a", 1, "a", 1));  //splits the root prefix
+    assert(CTDB_OK == ctdb_transaction_commit(trans));
+    ctdb_transaction_free(&trans);
+
+    struct ctdb_transaction *trans_old = ctdb_transaction_begin_at(db, old_footer_pos);
+    assert(NULL != trans_old);
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    struct ctdb_stats before, after;
+    assert(CTDB_OK == ctdb_get_stats(db, &before));
+    int counts[3] = {0};
+    int res = ctdb_diff(trans_old, trans, ({
+            int __nested_func_ptr__(int fd, char *diff_key, uint16_t diff_key_len, int kind, struct ctdb_leaf old_leaf, struct ctdb_leaf new_leaf) {
+                counts[kind] += 1;
+                return CTDB_OK;
+            }
+            __nested_func_ptr__;
+        }));
+    assert(CTDB_OK == res);
+    assert(CTDB_OK == ctdb_get_stats(db, &after));
+    assert(11 == counts[CTDB_DIFF_ADDED] && 10 == counts[CTDB_DIFF_CHANGED] && 10 == counts[CTDB_DIFF_DELETED]);
+    printf("diff sucess, count:%d added:%d changed:%d deleted:%d node_loads:%lu\n", count, 
+            counts[CTDB_DIFF_ADDED], counts[CTDB_DIFF_CHANGED], counts[CTDB_DIFF_DELETED], after.node_loads - before.node_loads);
+    assert(after.node_loads - before.node_loads < count);  //not a full scan
+
+    memset(counts, 0, sizeof(counts));
+    assert(CTDB_OK == ctdb_diff(trans, trans_old, ({  //backwards
+            int __nested_func_ptr__(int fd, char *diff_key, uint16_t diff_key_len, int kind, struct ctdb_leaf old_leaf, struct ctdb_leaf new_leaf) {
+                counts[kind] += 1;
+                return CTDB_OK;
+            }
+            __nested_func_ptr__;
+        })));
+    assert(10 == counts[CTDB_DIFF_ADDED] && 10 == counts[CTDB_DIFF_CHANGED] && 11 == counts[CTDB_DIFF_DELETED]);
+    ctdb_transaction_free(&trans_old);
+    ctdb_transaction_free(&trans);
+    ctdb_close(&db);
+}
+
+//the same keys as the iterator, in the same order when ordered
+void test_parallel(int count) {
+    char *path = "./test_parallel.db";
+    struct ctdb *db = ctdb_open(path);
+    assert(NULL != db);
+    struct ctdb_transaction *trans = ctdb_transaction_begin(db);
+    assert(NULL != trans);
+    int i = 0;
+    for (; i < count; i++) {
+        char *key = random_str_shortly(random_range(1, 12));
+        assert(CTDB_OK == ctdb_put(trans, key, strlen(key), key, strlen(key)));
+        if (0 == i % 5) assert(CTDB_OK == ctdb_del(trans, key, strlen(key)));
+        free(key);
+    }
+    assert(CTDB_OK == ctdb_transaction_commit(trans));
+    ctdb_transaction_free(&trans);
+
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    char *prefixes[] = {"", "a", "ab"};
+    int p = 0;
+    for (; p < sizeof(prefixes) / sizeof(prefixes[0]); p++) {
+        char *prefix = prefixes[p];
+        uint16_t prefix_len = strlen(prefix);
+        uint64_t counted = 0;
+        assert(CTDB_OK == ctdb_count_prefix(trans, prefix, prefix_len, &counted));
+        char *keys = calloc(counted, CTDB_MAX_KEY_LEN);
+        uint16_t *keys_len = calloc(counted, sizeof(uint16_t));
+        uint64_t iterated = 0;
+        assert(NULL != keys && NULL != keys_len);
+        CTDB_FOREACH(trans, prefix, prefix_len, 
+                (int fd, char *iter_key, uint16_t iter_key_len, struct ctdb_leaf leaf){
+                    memcpy(keys + iterated * CTDB_MAX_KEY_LEN, iter_key, iter_key_len);
+                    keys_len[iterated++] = iter_key_len;
+                    return CTDB_OK;
+                }
+            );
+        assert(counted == iterated);
+
+        uint64_t ordered = 0;
+        assert(CTDB_OK == ctdb_parallel_travel(trans, prefix, prefix_len, 4, CTDB_SCAN_ORDERED, ({
+                int __nested_func_ptr__(int fd, char *key, uint16_t key_len, struct ctdb_leaf leaf) {
+                    assert(key_len == keys_len[ordered] && 0 == memcmp(key, keys + ordered * CTDB_MAX_KEY_LEN, key_len));
+                    assert(key_len == leaf.value_len);
+                    ordered++;
+                    return CTDB_OK;
+                }
+                __nested_func_ptr__;
+            })));
+        assert(counted == ordered);
+
+        uint64_t unordered = 0, unordered_bytes = 0, iterated_bytes = 0;
+        assert(CTDB_OK == ctdb_parallel_travel(trans, prefix, prefix_len, 4, CTDB_SCAN_UNORDERED, ({
+                int __nested_func_ptr__(int fd, char *key, uint16_t key_len, struct ctdb_leaf leaf) {
+                    __atomic_fetch_add(&unordered, 1, __ATOMIC_RELAXED);  //from every thread at once
+                    __atomic_fetch_add(&unordered_bytes, key_len, __ATOMIC_RELAXED);
+                    return CTDB_OK;
+                }
+                __nested_func_ptr__;
+            })));
+        for (i = 0; i < counted; i++) {
+            iterated_bytes += keys_len[i];
+        }
+        assert(counted == unordered && iterated_bytes == unordered_bytes);
+
+        //cancelled by the traversal, the keys before are delivered in order all the same
+        uint64_t cancelled = 0;
+        if (100 < counted) {
+            assert(CTDB_ERR == ctdb_parallel_travel(trans, prefix, prefix_len, 4, CTDB_SCAN_ORDERED, ({
+                    int __nested_func_ptr__(int fd, char *key, uint16_t key_len, struct ctdb_leaf leaf) {
+                        assert(key_len == keys_len[cancelled] && 0 == memcmp(key, keys + cancelled * CTDB_MAX_KEY_LEN, key_len));
+                        return 100 == ++cancelled ? CTDB_ERR : CTDB_OK;
+                    }
+                    __nested_func_ptr__;
+                })));
+            assert(100 == cancelled);
+        }
+        printf("parallel '%s': %lu\n", prefix, counted);
+        free(keys);
+        free(keys_len);
+    }
+    ctdb_transaction_free(&trans);
+    ctdb_close(&db);
+}
+
 int main(){
     srand(time(NULL));
     
     test_iter(100, "", 0);  //traverse all data
     test_iter(50, "ap", 2);  //traverse the specified data
+    test_long_keys(200);
+    test_binary_keys(1000);
+    test_diff(5000);
+    test_count(20000);
+    test_parallel(20000);
 
     printf("over\n");
     return 0;
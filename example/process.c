@@ -0,0 +1,113 @@
+/*
+ * 
+ * Copyright (c) 2021, Joel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "serializer.h"
+#include "ctdb.h"
+#include "utils.h"
+
+#define COMMITS 200
+
+//the reader process follows the commits of the writer process through the shared commit record
+int reader(char *path) {
+    struct ctdb *db = ctdb_open(path);
+    assert(NULL != db);
+    uint32_t seq = ctdb_commit_seq(db);
+    int wakeups = 0;
+    while (1) {
+        struct ctdb_transaction *trans = ctdb_transaction_begin(db);
+        assert(NULL != trans);
+        uint64_t tran_count = trans->footer.tran_count;
+        if (0 < tran_count) {  //the last committed key is always visible
+            char key[16];
+            int key_len = snprintf(key, sizeof(key), "key_%lu", tran_count - 1);
+            assert(0 < ctdb_get(trans, key, key_len).value_len);
+        }
+        ctdb_transaction_free(&trans);
+        if (COMMITS <= tran_count) break;
+
+        assert(CTDB_OK == ctdb_wait_commit(db, seq, 5000));
+        seq = ctdb_commit_seq(db);
+        wakeups++;
+    }
+    printf("reader: %d wakeups for %d commits\n", wakeups, COMMITS);
+    ctdb_close(&db);
+    return 0;
+}
+
+void process_test() {
+    char *path = "./test.db";
+    struct ctdb *db = ctdb_open(path);
+    assert(NULL != db);
+
+    pid_t pid = fork();
+    assert(0 <= pid);
+    if (0 == pid) exit(reader(path));
+
+    int i = 0;
+    for (; i < COMMITS; i++) {
+        char key[16];
+        int key_len = snprintf(key, sizeof(key), "key_%d", i);
+        struct ctdb_transaction *trans = ctdb_transaction_begin(db);
+        assert(NULL != trans);
+        assert(CTDB_OK == ctdb_put(trans, key, key_len, key, key_len));
+        assert(CTDB_OK == ctdb_transaction_commit(trans));
+        ctdb_transaction_free(&trans);
+    }
+    int status = -1;
+    assert(pid == waitpid(pid, &status, 0));
+    assert(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+
+    //a transaction that began before another writer committed cannot write on the old root
+    struct ctdb *other_db = ctdb_open(path);
+    assert(NULL != other_db);
+    struct ctdb_transaction *stale = ctdb_transaction_begin(db);
+    struct ctdb_transaction *trans = ctdb_transaction_begin(other_db);
+    assert(CTDB_OK == ctdb_put(trans, "other", 5, "other", 5));
+    assert(CTDB_OK == ctdb_transaction_commit(trans));
+    ctdb_transaction_free(&trans);
+    assert(CTDB_ERR == ctdb_put(stale, "stale", 5, "stale", 5));
+    assert(CTDB_ERR == ctdb_transaction_commit(stale));
+    ctdb_transaction_free(&stale);
+
+    assert(NULL != (trans = ctdb_transaction_begin(db)));  //sees the commit of 'other_db' without rescanning
+    assert(COMMITS + 1 == trans->footer.tran_count);
+    assert(0 < ctdb_get(trans, "other", 5).value_len);
+    ctdb_transaction_free(&trans);
+    ctdb_close(&other_db);
+    ctdb_close(&db);
+}
+
+int main(){
+    process_test();
+
+    printf("over\n");
+    return 0;
+}
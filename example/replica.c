@@ -0,0 +1,115 @@
+/*
+ * 
+ * Copyright (c) 2021, Joel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "serializer.h"
+#include "ctdb.h"
+#include "utils.h"
+
+#define ROUNDS 10
+#define KEYS 500
+
+//a local file stands for the pipe or socket between the primary and the follower
+static int ship_to_channel(struct ctdb *primary, struct ctdb *follower) {
+    int channel = open("./test_channel.bin", O_RDWR | O_CREAT | O_TRUNC, 0666);
+    assert(0 <= channel);
+    assert(CTDB_OK == ctdb_ship(primary, ctdb_committed_end(follower), channel));
+    assert(0 == lseek(channel, 0, SEEK_SET));
+    return channel;
+}
+
+void replica_test() {
+    struct ctdb *primary = ctdb_open("./test.db");
+    struct ctdb *follower = ctdb_open("./test_replica.db");
+    assert(NULL != primary && NULL != follower);
+
+    int round = 0;
+    for (; round < ROUNDS; round++) {
+        struct ctdb_transaction *trans = ctdb_transaction_begin(primary);
+        assert(NULL != trans);
+        int i = 0;
+        for (; i < KEYS; i++) {
+            char key[32];
+            int key_len = snprintf(key, sizeof(key), "key_%d_%d", round, i);
+            assert(CTDB_OK == ctdb_put(trans, key, key_len, key, key_len));
+        }
+        assert(CTDB_OK == ctdb_transaction_commit(trans));
+        ctdb_transaction_free(&trans);
+        if (0 == round % 3) continue;  //the follower may lag several commits
+
+        uint32_t seq = ctdb_commit_seq(follower);
+        int channel = ship_to_channel(primary, follower);
+        assert(CTDB_OK == ctdb_follow(follower, channel));
+        close(channel);
+        assert(seq != ctdb_commit_seq(follower));
+        assert(ctdb_committed_end(primary) == ctdb_committed_end(follower));
+    }
+
+    //a frame cut short is rejected, the follower stays at its last commit
+    struct ctdb_transaction *trans = ctdb_transaction_begin(primary);
+    assert(CTDB_OK == ctdb_put(trans, "last", 4, "last", 4));
+    assert(CTDB_OK == ctdb_transaction_commit(trans));
+    ctdb_transaction_free(&trans);
+    off_t end = ctdb_committed_end(follower);
+    int channel = ship_to_channel(primary, follower);
+    struct stat st;
+    assert(0 == fstat(channel, &st) && 0 == ftruncate(channel, st.st_size - 8));
+    assert(CTDB_ERR == ctdb_follow(follower, channel));
+    close(channel);
+    assert(end == ctdb_committed_end(follower));
+    assert(0 == fstat(follower->fd, &st) && end == st.st_size);  //the partial range was dropped
+
+    channel = ship_to_channel(primary, follower);
+    assert(CTDB_OK == ctdb_follow(follower, channel));
+    close(channel);
+
+    //the follower reads everything from its own file
+    assert(NULL != (trans = ctdb_transaction_begin(follower)));
+    for (round = 0; round < ROUNDS; round++) {
+        char key[32];
+        int key_len = snprintf(key, sizeof(key), "key_%d_%d", round, KEYS - 1);
+        struct ctdb_leaf leaf = ctdb_get(trans, key, key_len);
+        assert(key_len == leaf.value_len);
+        char *value = read_value_from_file(follower->fd, leaf.value_len, leaf.value_pos);
+        assert(NULL != value && 0 == strncmp(value, key, key_len));
+        free(value);
+    }
+    assert(4 == ctdb_get(trans, "last", 4).value_len);
+    printf("replica sucess, rounds:%d keys:%d end:%ld\n", ROUNDS, KEYS, ctdb_committed_end(follower));
+    ctdb_transaction_free(&trans);
+    ctdb_close(&follower);
+    ctdb_close(&primary);
+}
+
+int main(){
+    replica_test();
+
+    printf("over\n");
+    return 0;
+}
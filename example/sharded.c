@@ -0,0 +1,166 @@
+/*
+ * 
+ * Copyright (c) 2021, Joel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "serializer.h"
+#include "ctdb.h"
+#include "shard.h"
+#include "utils.h"
+
+#define SHARDS 4
+#define WRITERS 4
+#define KEYS 4000
+
+struct writer_arg{
+    struct ctdb_sharded_transaction *strans;
+    int id;
+};
+
+//the writers share one transaction, puts to different shards do not wait for each other
+void *writer(void *arg) {
+    struct writer_arg *warg = arg;
+    int i = warg->id;
+    for (; i < KEYS; i += WRITERS) {
+        char key[16];
+        int key_len = snprintf(key, sizeof(key), "key_%05d", i);
+        assert(CTDB_OK == ctdb_sharded_put(warg->strans, key, key_len, key, key_len));
+    }
+    return NULL;
+}
+
+void sharded_test() {
+    char *dir = "./test_shards";
+    struct ctdb_sharded *sdb = ctdb_sharded_open(dir, SHARDS, 0);  //hash of the whole key
+    assert(NULL != sdb);
+
+    struct ctdb_sharded_transaction *strans = ctdb_sharded_begin(sdb);
+    assert(NULL != strans);
+    pthread_t threads[WRITERS];
+    struct writer_arg args[WRITERS];
+    int i = 0;
+    for (; i < WRITERS; i++) {
+        args[i] = (struct writer_arg){.strans = strans, .id = i};
+        assert(0 == pthread_create(&threads[i], NULL, writer, &args[i]));
+    }
+    for (i = 0; i < WRITERS; i++) {
+        assert(0 == pthread_join(threads[i], NULL));
+    }
+    int64_t start = getCurrentTime();
+    assert(CTDB_OK == ctdb_sharded_commit(strans));
+    printf("sharded: %d keys over %d shards, commit time consuming:%ldms\n", KEYS, SHARDS, getCurrentTime() - start);
+    ctdb_sharded_free(&strans);
+    ctdb_sharded_close(&sdb);
+    assert(NULL == ctdb_sharded_open(dir, SHARDS + 1, 0));  //routed differently
+
+    //a shard that committed without the manifest is reverted on open
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), CTDB_SHARD_FILE_FMT, dir, 0);
+    struct ctdb *shard = ctdb_open(path);
+    assert(NULL != shard);
+    struct ctdb_transaction *trans = ctdb_transaction_begin(shard);
+    assert(CTDB_OK == ctdb_put(trans, "orphan", 6, "orphan", 6));
+    assert(CTDB_OK == ctdb_transaction_commit(trans));
+    ctdb_transaction_free(&trans);
+    ctdb_close(&shard);
+
+    assert(NULL != (sdb = ctdb_sharded_open(dir, SHARDS, 0)));
+    assert(NULL != (strans = ctdb_sharded_begin(sdb)));
+    for (i = 0; i < KEYS; i++) {
+        char key[16];
+        int key_len = snprintf(key, sizeof(key), "key_%05d", i);
+        int fd = -1;
+        struct ctdb_leaf leaf = ctdb_sharded_get(strans, key, key_len, &fd);
+        assert(key_len == leaf.value_len);
+        char *value = read_value_from_file(fd, leaf.value_len, leaf.value_pos);
+        assert(NULL != value && 0 == strncmp(value, key, key_len));
+        free(value);
+    }
+    assert(0 == ctdb_sharded_get(strans, "orphan", 6, NULL).value_len);
+
+    //merged scan, in key order across the shards
+    char last_key[16] = {0};
+    int count = 0;
+    assert(CTDB_OK == CTDB_SHARDED_FOREACH(strans, "key_", 4, 
+            (int fd, char *key, uint16_t key_len, struct ctdb_leaf leaf){
+                assert(key_len < sizeof(last_key));
+                assert(0 < strncmp(key, last_key, key_len));
+                memcpy(last_key, key, key_len);
+                count++;
+                return CTDB_OK;
+            }
+        ));
+    assert(KEYS == count);
+    ctdb_sharded_free(&strans);
+
+    //one writer per handle, a transaction that began before a commit cannot put
+    struct ctdb_sharded_transaction *other = NULL;
+    assert(NULL != (strans = ctdb_sharded_begin(sdb)));
+    assert(NULL != (other = ctdb_sharded_begin(sdb)));
+    assert(CTDB_OK == ctdb_sharded_put(strans, "ka", 2, "a", 1));
+    assert(CTDB_ERR == ctdb_sharded_put(other, "kb", 2, "b", 1));  //'strans' is the writer
+    assert(CTDB_OK == ctdb_sharded_commit(strans));
+    assert(CTDB_ERR == ctdb_sharded_put(other, "kb", 2, "b", 1));  //the manifest moved
+    ctdb_sharded_free(&strans);
+    ctdb_sharded_free(&other);
+    assert(NULL != (strans = ctdb_sharded_begin(sdb)));
+    assert(1 == ctdb_sharded_get(strans, "ka", 2, NULL).value_len);
+    assert(0 == ctdb_sharded_get(strans, "kb", 2, NULL).value_len);
+    ctdb_sharded_free(&strans);
+    ctdb_sharded_close(&sdb);
+
+    //routed by the leading bytes, a prefix scan stays in one shard
+    assert(NULL != (sdb = ctdb_sharded_open("./test_prefix_shards", SHARDS, 4)));
+    assert(NULL != (strans = ctdb_sharded_begin(sdb)));
+    assert(CTDB_OK == ctdb_sharded_put(strans, "usr:1", 5, "a", 1));
+    assert(CTDB_OK == ctdb_sharded_put(strans, "usr:2", 5, "b", 1));
+    assert(CTDB_OK == ctdb_sharded_put(strans, "grp:1", 5, "c", 1));
+    assert(ctdb_shard_of(sdb, "usr:1", 5) == ctdb_shard_of(sdb, "usr:2", 5));
+    assert(CTDB_OK == ctdb_sharded_commit(strans));
+    ctdb_sharded_free(&strans);
+    assert(NULL != (strans = ctdb_sharded_begin(sdb)));
+    count = 0;
+    assert(CTDB_OK == CTDB_SHARDED_FOREACH(strans, "usr:", 4, 
+            (int fd, char *key, uint16_t key_len, struct ctdb_leaf leaf){
+                count++;
+                return CTDB_OK;
+            }
+        ));
+    assert(2 == count);
+    ctdb_sharded_free(&strans);
+    ctdb_sharded_close(&sdb);
+    printf("sharded sucess, shards:%d keys:%d\n", SHARDS, KEYS);
+}
+
+int main(){
+    sharded_test();
+
+    printf("over\n");
+    return 0;
+}
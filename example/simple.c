@@ -186,6 +186,10 @@ void stress_get_testing(int count) {
     char *test_key = "t5gc8oko0a1uyrfb6xbf6bwsf877y44q";
     int test_key_len = 32;
 
+#ifdef CTDB_TRACING
+    assert(CTDB_OK == ctdb_enable_histograms(db));
+#endif
+
     struct ctdb_transaction *trans = ctdb_transaction_begin(db);
     assert(NULL != trans);
     assert(CTDB_OK == ctdb_put(trans, test_key, test_key_len, test_key, test_key_len));
@@ -217,6 +221,516 @@ void stress_get_testing(int count) {
     }
     printf("stress: %d pieces of data read operation, time consuming:%ldms del_count:%lu tran_count:%lu\n", count, getCurrentTime() - start, trans->footer.del_count, trans->footer.tran_count);
     ctdb_transaction_free(&trans);
+
+    struct ctdb_stats stats;
+    assert(CTDB_OK == ctdb_get_stats(db, &stats));
+    assert(count <= stats.lookups);
+    printf("stats: node_loads:%lu syscalls:%lu fsyncs:%lu avg_lookup_depth:%.2f write_amplification:%.2f\n", 
+            stats.node_loads, stats.syscalls, stats.fsyncs, stats.avg_lookup_depth, stats.write_amplification);
+#ifdef CTDB_TRACING
+    struct ctdb_histogram hist;
+    assert(CTDB_OK == ctdb_get_histogram(db, CTDB_OP_GET, &hist));
+    assert(count <= hist.count);
+    printf("latency: get p50:%luns p99:%luns max:%luns\n", 
+            ctdb_histogram_percentile(&hist, 50), ctdb_histogram_percentile(&hist, 99), hist.max_ns);
+#endif
+    ctdb_close(&db);
+}
+
+//the blocks are allocated ahead, the size of the file is still the end of the last commit
+void preallocate_test(int count) __attribute__((unused));
+void preallocate_test(int count) {
+    char *path = "./test_prealloc.db";
+    struct ctdb *db = ctdb_open(path);
+    assert(NULL != db);
+    assert(CTDB_OK == ctdb_set_preallocate(db, 1024 * 1024));
+    int i = 0;
+    for (; i < count; i++) {
+        char key[32];
+        int key_len = snprintf(key, sizeof(key), "prealloc_%d", i);
+        struct ctdb_transaction *trans = ctdb_transaction_begin(db);
+        assert(NULL != trans);
+        assert(CTDB_OK == ctdb_put(trans, key, key_len, key, key_len));
+        assert(CTDB_OK == ctdb_transaction_commit(trans));
+        ctdb_transaction_free(&trans);
+    }
+    struct stat st;
+    assert(0 == fstat(db->fd, &st));
+    assert(st.st_size == ctdb_committed_end(db));
+    printf("preallocate: size:%ld allocated:%ld\n", (long)st.st_size, (long)st.st_blocks * 512);
+    ctdb_close(&db);
+
+    assert(NULL != (db = ctdb_open(path)));
+    struct ctdb_transaction *trans = ctdb_transaction_begin(db);
+    assert(NULL != trans);
+    assert(count == trans->footer.tran_count);
+    assert(10 == ctdb_get(trans, "prealloc_0", 10).value_len);
+    ctdb_transaction_free(&trans);
+    ctdb_close(&db);
+}
+
+//the filter answers the missing keys, the keys put after it was built are in its log
+void filter_test(int count) __attribute__((unused));
+void filter_test(int count) {
+    char *path = "./test_filter.db";
+    char key[32];
+    int key_len = 0, i = 0;
+    struct ctdb *db = ctdb_open(path);
+    assert(NULL != db);
+    struct ctdb_transaction *trans = ctdb_transaction_begin(db);
+    assert(NULL != trans);
+    for (i = 0; i < count; i++) {
+        key_len = snprintf(key, sizeof(key), "filter_%d", i);
+        assert(CTDB_OK == ctdb_put(trans, key, key_len, key, key_len));
+    }
+    assert(CTDB_OK == ctdb_build_filter(trans, 10));
+    assert(CTDB_OK == ctdb_transaction_commit(trans));
+    ctdb_transaction_free(&trans);
+
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    assert(CTDB_OK == ctdb_put(trans, "filter_new", 10, "new", 3));
+    assert(CTDB_OK == ctdb_transaction_commit(trans));
+    ctdb_transaction_free(&trans);
+    ctdb_close(&db);
+
+    struct ctdb_stats stats;
+    assert(NULL != (db = ctdb_open(path)));
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    assert(0 < trans->footer.filter_pos && 0 < trans->footer.delta_pos);
+    for (i = 0; i < count; i++) {
+        key_len = snprintf(key, sizeof(key), "filter_%d", i);
+        assert(key_len == ctdb_get(trans, key, key_len).value_len);
+        key_len = snprintf(key, sizeof(key), "missing_%d", i);
+        assert(0 == ctdb_get(trans, key, key_len).value_len);
+    }
+    assert(3 == ctdb_get(trans, "filter_new", 10).value_len);  //from the log
+    assert(CTDB_OK == ctdb_put(trans, "zz", 2, "own", 3));
+    assert(3 == ctdb_get(trans, "zz", 2).value_len);  //not in the filter yet
+    assert(CTDB_CONFLICT == ctdb_put_if_absent(trans, "zz", 2, "again", 5));
+    assert(CTDB_OK == ctdb_get_stats(db, &stats));
+    printf("filter: %lu of %d missing keys without a search\n", stats.filter_negatives, count);
+    assert(stats.filter_negatives > (uint64_t)count * 9 / 10);
+    ctdb_transaction_free(&trans);
+
+    //the log outgrows the filter, it is dropped
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    for (i = 0; i < count + 1100; i++) {
+        key_len = snprintf(key, sizeof(key), "later_%d", i);
+        assert(CTDB_OK == ctdb_put(trans, key, key_len, key, key_len));
+    }
+    assert(CTDB_OK == ctdb_transaction_commit(trans));
+    ctdb_transaction_free(&trans);
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    assert(0 == trans->footer.filter_pos && 0 == trans->footer.delta_pos);
+    assert(7 == ctdb_get(trans, "later_0", 7).value_len);
+    ctdb_transaction_free(&trans);
+
+    //built again, and carried over by a vacuum
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    assert(CTDB_OK == ctdb_build_filter(trans, 10));
+    assert(CTDB_OK == ctdb_transaction_commit(trans));
+    ctdb_transaction_free(&trans);
+    struct ctdb *new_db = ctdb_open("./test_filter_tmp.db");
+    assert(NULL != new_db);
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    assert(CTDB_OK == ctdb_vacuum(trans, new_db));
+    ctdb_transaction_free(&trans);
+    assert(NULL != (trans = ctdb_transaction_begin(new_db)));
+    assert(0 < trans->footer.filter_pos);
+    assert(3 == ctdb_get(trans, "filter_new", 10).value_len);
+    assert(7 == ctdb_get(trans, "later_0", 7).value_len);
+    assert(0 == ctdb_get(trans, "missing_0", 9).value_len);
+    ctdb_transaction_free(&trans);
+    ctdb_close(&new_db);
+    ctdb_close(&db);
+}
+
+//the top levels are searched in memory, and follow the commits of another handle
+void pinned_test(int count) __attribute__((unused));
+void pinned_test(int count) {
+    char *path = "./test_pinned.db";
+    char key[32];
+    int key_len = 0, i = 0;
+    struct ctdb *db = ctdb_open(path), *other = ctdb_open(path);
+    assert(NULL != db && NULL != other);
+    struct ctdb_transaction *trans = ctdb_transaction_begin(db);
+    assert(NULL != trans);
+    for (i = 0; i < count; i++) {
+        key_len = snprintf(key, sizeof(key), "%c_pinned_%d", 'a' + i % 26, i);
+        assert(CTDB_OK == ctdb_put(trans, key, key_len, key, key_len));
+    }
+    assert(CTDB_OK == ctdb_transaction_commit(trans));
+    ctdb_transaction_free(&trans);
+
+    struct ctdb_stats before, after;
+    assert(CTDB_OK == ctdb_get_stats(db, &before));
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    for (i = 0; i < count; i++) {
+        key_len = snprintf(key, sizeof(key), "%c_pinned_%d", 'a' + i % 26, i);
+        assert(key_len == ctdb_get(trans, key, key_len).value_len);
+    }
+    ctdb_transaction_free(&trans);
+    assert(CTDB_OK == ctdb_get_stats(db, &after));
+    printf("pinned: %lu of %lu nodes from memory\n", after.cache_hits - before.cache_hits,
+            after.cache_hits - before.cache_hits + after.node_loads - before.node_loads);
+    assert(after.cache_hits - before.cache_hits >= (uint64_t)count * 2);  //the root and the first letter
+
+    //committed by the other handle, pinned again on the next begin
+    assert(NULL != (trans = ctdb_transaction_begin(other)));
+    assert(CTDB_OK == ctdb_put(trans, "a_pinned_new", 12, "new", 3));
+    assert(CTDB_OK == ctdb_del(trans, "b_pinned_1", 10));
+    assert(CTDB_OK == ctdb_transaction_commit(trans));
+    ctdb_transaction_free(&trans);
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    assert(3 == ctdb_get(trans, "a_pinned_new", 12).value_len);
+    assert(0 == ctdb_get(trans, "b_pinned_1", 10).value_len);
+    ctdb_transaction_free(&trans);
+
+    assert(CTDB_OK == ctdb_set_pinned_levels(db, 0));
+    assert(CTDB_OK == ctdb_get_stats(db, &before));
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    assert(10 == ctdb_get(trans, "a_pinned_0", 10).value_len);
+    ctdb_transaction_free(&trans);
+    assert(CTDB_OK == ctdb_get_stats(db, &after));
+    assert(after.cache_hits == before.cache_hits);
+    ctdb_close(&other);
+    ctdb_close(&db);
+}
+
+//the values go from fd to fd, and are read back a piece at a time
+void stream_test(int value_len) __attribute__((unused));
+void stream_test(int value_len) {
+    char *path = "./test_stream.db", *src_path = "./test_stream.src", *dst_path = "./test_stream.dst";
+    char chunk[4096];
+    int i = 0;
+    int src_fd = open(src_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    assert(0 <= src_fd);
+    for (i = 0; i < value_len; i += sizeof(chunk)) {
+        int j = 0;
+        for (; j < sizeof(chunk); j++) {
+            chunk[j] = (char)((i + j) % 251);
+        }
+        assert(sizeof(chunk) == write(src_fd, chunk, sizeof(chunk)));
+    }
+    assert(0 == lseek(src_fd, 0, SEEK_SET));
+
+    struct ctdb *db = ctdb_open(path);
+    assert(NULL != db);
+    struct ctdb_transaction *trans = ctdb_transaction_begin(db);
+    assert(NULL != trans);
+    assert(CTDB_OK == ctdb_put_from_fd(trans, "blob", 4, src_fd, value_len));  //file to file, in the kernel
+    int pipe_fds[2];
+    assert(0 == pipe(pipe_fds));
+    assert(11 == write(pipe_fds[1], "piped value", 11));
+    assert(CTDB_OK == ctdb_put_from_fd(trans, "piped", 5, pipe_fds[0], 11));  //read in chunks
+    close(pipe_fds[1]);
+    assert(CTDB_ERR == ctdb_put_from_fd(trans, "short", 5, pipe_fds[0], 11));  //the source ended
+    close(pipe_fds[0]);
+    close(src_fd);
+    ctdb_transaction_rollback(trans);
+    ctdb_transaction_free(&trans);
+
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    assert(0 <= (src_fd = open(src_path, O_RDONLY)));
+    assert(CTDB_OK == ctdb_put_from_fd(trans, "blob", 4, src_fd, value_len));
+    close(src_fd);
+    assert(CTDB_OK == ctdb_transaction_commit(trans));
+    ctdb_transaction_free(&trans);
+
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    struct ctdb_leaf leaf = ctdb_get(trans, "blob", 4);
+    assert(value_len == leaf.value_len);
+    uint32_t offset = 0, read_len = 0;
+    for (; offset < value_len; offset += read_len) {
+        assert(CTDB_OK == ctdb_read_value_at(db, &leaf, offset, chunk, 1000, &read_len));
+        assert(0 < read_len && 1000 >= read_len);
+        for (i = 0; i < read_len; i++) {
+            assert(chunk[i] == (char)((offset + i) % 251));
+        }
+    }
+    assert(CTDB_OK == ctdb_read_value_at(db, &leaf, value_len, chunk, 1000, &read_len) && 0 == read_len);
+
+    int dst_fd = open(dst_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    assert(0 <= dst_fd);
+    assert(CTDB_OK == ctdb_send_value(db, &leaf, dst_fd));
+    struct stat st;
+    assert(0 == fstat(dst_fd, &st) && value_len == st.st_size);
+    close(dst_fd);
+    printf("stream: %d bytes in and out\n", value_len);
+    ctdb_transaction_free(&trans);
+    ctdb_close(&db);
+}
+
+/*
+    Small commits buffered in the memtable, logged in the file and flushed to the trie now and then
+*/
+void memtable_test(int count) __attribute__((unused));
+void memtable_test(int count) {
+    char *path = "./test_memtable.db", *new_path = "./test_memtable_new.db";
+    char key[32], last_key[32];
+    int key_len = 0, last_key_len = 0, i = 0, live = 0, seen = 0;
+    uint8_t *is_live = calloc(count, 1);
+    assert(NULL != is_live);
+    struct ctdb *db = ctdb_open(path);
+    assert(NULL != db);
+    assert(CTDB_OK == ctdb_set_memtable(db, 16 * 1024));
+
+    //a commit per put, some of them delete an older key
+    struct ctdb_transaction *trans = NULL;
+    for (i = 0; i < count; i++) {
+        assert(NULL != (trans = ctdb_transaction_begin(db)));
+        key_len = snprintf(key, sizeof(key), "mt_%05d", i);
+        assert(CTDB_OK == ctdb_put(trans, key, key_len, key, key_len));
+        is_live[i] = 1;
+        if (0 == i % 7) {
+            key_len = snprintf(key, sizeof(key), "mt_%05d", i / 2);
+            assert(CTDB_OK == ctdb_del(trans, key, key_len));
+            is_live[i / 2] = 0;
+        }
+        assert(CTDB_OK == ctdb_transaction_commit(trans));
+        ctdb_transaction_free(&trans);
+        if (0 == i % 50) {
+            assert(NULL != (trans = ctdb_transaction_begin(db)));
+            key_len = snprintf(key, sizeof(key), "mt_%05d", i);
+            assert((is_live[i] ? key_len : 0) == ctdb_get(trans, key, key_len).value_len);  //the first one deletes itself
+            ctdb_transaction_free(&trans);
+        }
+    }
+    struct ctdb_stats stats;
+    assert(CTDB_OK == ctdb_get_stats(db, &stats));
+    assert(1 <= stats.memtable_flushes);
+
+    //the last ones stay in the log
+    assert(CTDB_OK == ctdb_set_memtable(db, 1 << 30));
+    for (i = 0; i < 10; i++) {
+        assert(NULL != (trans = ctdb_transaction_begin(db)));
+        key_len = snprintf(key, sizeof(key), "mt_%05d", count - 1 - i * 3);
+        assert(CTDB_OK == ctdb_put(trans, key, key_len, "overwritten", 11));
+        is_live[count - 1 - i * 3] = 1;
+        assert(CTDB_OK == ctdb_transaction_commit(trans));
+        ctdb_transaction_free(&trans);
+    }
+    ctdb_close(&db);
+
+    //the log is read back, a transaction sees its own puts over it
+    assert(NULL != (db = ctdb_open(path)));
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    assert(0 < trans->footer.log_pos);
+    assert(11 == ctdb_get(trans, key, key_len).value_len);
+    assert(CTDB_OK == ctdb_put(trans, "mt_00001", 8, "own", 3));
+    assert(CTDB_OK == ctdb_del(trans, "mt_00002", 8));
+    is_live[1] = 1;
+    is_live[2] = 0;
+    assert(3 == ctdb_get(trans, "mt_00001", 8).value_len);
+    assert(0 == ctdb_get(trans, "mt_00002", 8).value_len);
+    struct ctdb *new_db = ctdb_open(new_path);
+    assert(NULL != new_db);
+    assert(CTDB_ERR == ctdb_vacuum(trans, new_db));  //not flushed yet
+    for (i = 0; i < count; i++) {
+        live += is_live[i];
+    }
+
+    //the trie and the memtable in one order, before the flush and after it
+    int j = 0;
+    for (j = 0; j < 2; j++) {
+        seen = 0;
+        last_key_len = 0;
+        assert(CTDB_OK == CTDB_FOREACH(trans, "mt_", 3,
+                (int fd, char *key, uint16_t key_len, struct ctdb_leaf leaf){
+                    int index = -1;
+                    assert(1 == sscanf(key + 3, "%5d", &index) && is_live[index]);  //the key is not terminated
+                    assert(0 == last_key_len || 0 < memcmp(key, last_key, key_len));
+                    memcpy(last_key, key, key_len);
+                    last_key_len = key_len;
+                    seen++;
+                    return CTDB_OK;
+                }
+            ));
+        assert(live == seen);
+        if (0 == j) {
+            assert(CTDB_OK == ctdb_flush_memtable(trans));
+            assert(CTDB_OK == ctdb_transaction_commit(trans));
+            ctdb_transaction_free(&trans);
+            assert(NULL != (trans = ctdb_transaction_begin(db)));
+            assert(0 == trans->footer.log_pos);
+            assert(3 == ctdb_get(trans, "mt_00001", 8).value_len);
+        }
+    }
+    assert(CTDB_OK == ctdb_get_stats(db, &stats));
+    printf("memtable: %d commits, %lu flushes, %lu gets from the memtable\n", count + 11, stats.memtable_flushes, stats.memtable_hits);
+    assert(CTDB_OK == ctdb_vacuum(trans, new_db));
+    ctdb_transaction_free(&trans);
+    ctdb_close(&new_db);
+    ctdb_close(&db);
+    free(is_live);
+}
+
+/*
+    Conditional puts and counters, checked in the descent that writes them
+*/
+void rmw_test(int count) __attribute__((unused));
+void rmw_test(int count) {
+    char *path = "./test_rmw.db";
+    char key[32];
+    int key_len = 0, i = 0;
+    int64_t counter = 0;
+    struct ctdb *db = ctdb_open(path);
+    assert(NULL != db);
+    assert(CTDB_OK == ctdb_set_pinned_levels(db, 0));  //every node from the file, to compare the reads
+    struct ctdb_transaction *trans = ctdb_transaction_begin(db);
+    assert(NULL != trans);
+    for (i = 0; i < count; i++) {
+        key_len = snprintf(key, sizeof(key), "rmw_%d", i);
+        assert(CTDB_OK == ctdb_put(trans, key, key_len, key, key_len));
+    }
+    assert(CTDB_OK == ctdb_transaction_commit(trans));
+    ctdb_transaction_free(&trans);
+
+    //compare and swap on the version of the leaf
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    struct ctdb_leaf leaf = ctdb_get(trans, "rmw_1", 5);
+    assert(0 < leaf.value_len);
+    assert(CTDB_CONFLICT == ctdb_cas(trans, "rmw_1", 5, leaf.version + 1, "new", 3));
+    assert(CTDB_CONFLICT == ctdb_cas(trans, "rmw_none", 8, 0, "new", 3));
+    assert(CTDB_OK == ctdb_cas(trans, "rmw_1", 5, leaf.version, "new", 3));
+    assert(3 == ctdb_get(trans, "rmw_1", 5).value_len);
+    assert(CTDB_CONFLICT == ctdb_cas(trans, "rmw_1", 5, leaf.version, "newer", 5));  //the version moved on
+
+    //put if absent, a deleted key is absent
+    assert(CTDB_CONFLICT == ctdb_put_if_absent(trans, "rmw_2", 5, "x", 1));
+    assert(CTDB_OK == ctdb_put_if_absent(trans, "rmw_new", 7, "x", 1));
+    assert(CTDB_CONFLICT == ctdb_put_if_absent(trans, "rmw_new", 7, "y", 1));
+    assert(CTDB_OK == ctdb_del(trans, "rmw_2", 5));
+    assert(CTDB_OK == ctdb_put_if_absent(trans, "rmw_2", 5, "y", 1));
+    assert(CTDB_ERR == ctdb_incr(trans, "rmw_3", 5, 1, &counter));  //not a counter
+    assert(CTDB_OK == ctdb_transaction_commit(trans));
+    ctdb_transaction_free(&trans);
+
+    //a counter per transaction, the reads of one descent against a get and a put
+    struct ctdb_stats before, middle, after;
+    assert(CTDB_OK == ctdb_get_stats(db, &before));
+    for (i = 0; i < count; i++) {
+        assert(NULL != (trans = ctdb_transaction_begin(db)));
+        char value[8];
+        struct ctdb_leaf slow_leaf = ctdb_get(trans, "rmw_slow", 8);
+        int64_t slow = 0;
+        if (8 == slow_leaf.value_len) {
+            assert(CTDB_OK == ctdb_read_value(db, &slow_leaf, value));
+            memcpy(&slow, value, 8);
+        }
+        slow += 1;
+        memcpy(value, &slow, 8);
+        assert(CTDB_OK == ctdb_put(trans, "rmw_slow", 8, value, 8));
+        assert(CTDB_OK == ctdb_transaction_commit(trans));
+        ctdb_transaction_free(&trans);
+    }
+    assert(CTDB_OK == ctdb_get_stats(db, &middle));
+    for (i = 0; i < count; i++) {
+        assert(NULL != (trans = ctdb_transaction_begin(db)));
+        assert(CTDB_OK == ctdb_incr(trans, "rmw_counter", 11, 2, &counter));
+        assert(2 * (i + 1) == counter);
+        assert(CTDB_OK == ctdb_transaction_commit(trans));
+        ctdb_transaction_free(&trans);
+    }
+    assert(CTDB_OK == ctdb_get_stats(db, &after));
+    printf("rmw: %d updates, get and put read %lu bytes, incr %lu\n", count, middle.bytes_read - before.bytes_read, after.bytes_read - middle.bytes_read);
+    assert(after.bytes_read - middle.bytes_read < middle.bytes_read - before.bytes_read);
+
+    //buffered in the memtable, checked against the memtable and the trie
+    assert(CTDB_OK == ctdb_set_memtable(db, 1 << 20));
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    assert(CTDB_OK == ctdb_incr(trans, "rmw_counter", 11, -1, &counter));
+    assert(2 * count - 1 == counter);
+    assert(CTDB_CONFLICT == ctdb_put_if_absent(trans, "rmw_new", 7, "z", 1));
+    assert(CTDB_OK == ctdb_transaction_commit(trans));
+    ctdb_transaction_free(&trans);
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    assert(CTDB_OK == ctdb_incr(trans, "rmw_counter", 11, -1, &counter));
+    assert(2 * count - 2 == counter);
+    assert(CTDB_OK == ctdb_transaction_commit(trans));
+    ctdb_transaction_free(&trans);
+
+    //the bytes of the counter, big-endian
+    unsigned char raw[8];
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    struct ctdb_leaf counter_leaf = ctdb_get(trans, "rmw_counter", 11);
+    assert(8 == counter_leaf.value_len);
+    assert(CTDB_OK == ctdb_read_value(db, &counter_leaf, (char *)raw));
+    for (i = 0; i < 8; i++) {
+        assert(raw[i] == (unsigned char)((uint64_t)(2 * count - 2) >> (56 - 8 * i)));
+    }
+    ctdb_transaction_free(&trans);
+    ctdb_close(&db);
+}
+
+/*
+    Repeated values, every key points to one copy of its value, before and after a vacuum
+*/
+void dedup_test(int count) __attribute__((unused));
+void dedup_test(int count) {
+    char *path = "./test_dedup.db", *new_path = "./test_dedup_new.db";
+    char key[32], blobs[4][1000], value[1000];
+    int key_len = 0, i = 0;
+    for (i = 0; i < 4; i++) {
+        memset(blobs[i], 'a' + i, sizeof(blobs[i]));
+    }
+    struct ctdb *db = ctdb_open(path);
+    assert(NULL != db);
+    assert(CTDB_OK == ctdb_set_dedup(db, 64));
+    struct ctdb_transaction *trans = ctdb_transaction_begin(db);
+    assert(NULL != trans);
+    for (i = 0; i < count; i++) {
+        key_len = snprintf(key, sizeof(key), "dedup_%d", i);
+        assert(CTDB_OK == ctdb_put(trans, key, key_len, blobs[i % 4], sizeof(blobs[i % 4])));
+    }
+    assert(CTDB_OK == ctdb_put(trans, "small_1", 7, "0123456789", 10));  //too small to share
+    assert(CTDB_OK == ctdb_put(trans, "small_2", 7, "0123456789", 10));
+    assert(CTDB_OK == ctdb_transaction_commit(trans));
+    ctdb_transaction_free(&trans);
+    struct ctdb_stats stats;
+    assert(CTDB_OK == ctdb_get_stats(db, &stats));
+    assert(count - 4 == stats.dedup_hits);
+    struct ctdb_usage usage;
+    assert(CTDB_OK == ctdb_usage(db, &usage));
+    assert(usage.file_bytes < (uint64_t)count * sizeof(blobs[0]));  //less than the values alone, the paths included
+
+    //replaced and deleted, the other keys still read their value
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    assert(CTDB_OK == ctdb_put(trans, "dedup_0", 7, blobs[1], sizeof(blobs[1])));
+    assert(CTDB_OK == ctdb_del(trans, "dedup_4", 7));
+    assert(CTDB_OK == ctdb_transaction_commit(trans));
+    ctdb_transaction_free(&trans);
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    for (i = 1; i < count; i++) {
+        key_len = snprintf(key, sizeof(key), "dedup_%d", i);
+        struct ctdb_leaf leaf = ctdb_get(trans, key, key_len);
+        if (4 == i) {
+            assert(0 == leaf.value_len);
+            continue;
+        }
+        assert(sizeof(value) == leaf.value_len && CTDB_OK == ctdb_read_value(db, &leaf, value));
+        assert(0 == memcmp(value, blobs[i % 4], sizeof(value)));
+    }
+
+    //the vacuum copies each value once
+    struct ctdb *new_db = ctdb_open(new_path);
+    assert(NULL != new_db);
+    assert(CTDB_OK == ctdb_vacuum(trans, new_db));
+    ctdb_transaction_free(&trans);
+    struct ctdb_usage new_usage;
+    assert(CTDB_OK == ctdb_usage(new_db, &new_usage));
+    printf("dedup: %d values of %lu bytes in %lu bytes, %lu after a vacuum\n", count, sizeof(blobs[0]), usage.file_bytes, new_usage.file_bytes);
+    assert(new_usage.file_bytes < (uint64_t)count * sizeof(blobs[0]) / 4);
+    assert(NULL != (trans = ctdb_transaction_begin(new_db)));
+    struct ctdb_leaf leaf = ctdb_get(trans, "dedup_0", 7);
+    assert(sizeof(value) == leaf.value_len && CTDB_OK == ctdb_read_value(new_db, &leaf, value));
+    assert(0 == memcmp(value, blobs[1], sizeof(value)));
+    leaf = ctdb_get(trans, "dedup_5", 7);
+    assert(sizeof(value) == leaf.value_len && CTDB_OK == ctdb_read_value(new_db, &leaf, value));
+    assert(0 == memcmp(value, blobs[1], sizeof(value)));
+    assert(10 == ctdb_get(trans, "small_2", 7).value_len);
+    ctdb_transaction_free(&trans);
+    ctdb_close(&new_db);
     ctdb_close(&db);
 }
 
@@ -227,6 +741,13 @@ int main(){
     stress_put_testing_single_transaction(5, 25000);
     stress_put_testing_multiple_transactions(5000);
     stress_get_testing(50000);
+    preallocate_test(1000);
+    filter_test(1000);
+    pinned_test(1000);
+    stream_test(4 * 1024 * 1024);
+    memtable_test(2000);
+    rmw_test(1000);
+    dedup_test(1000);
     
     printf("over\n");
     return 0;
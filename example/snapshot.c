@@ -0,0 +1,126 @@
+/*
+ * 
+ * Copyright (c) 2021, Joel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "serializer.h"
+#include "ctdb.h"
+#include "utils.h"
+
+#define READERS 4
+#define KEYS 1000
+
+//every reader checks that the snapshot still shows the values of the first commit
+void *reader(void *arg) {
+    struct ctdb_snapshot *snap = arg;
+    int round = 0;
+    for (; round < 20; round++) {
+        int i = 0;
+        for (; i < KEYS; i++) {
+            char key[16];
+            int key_len = snprintf(key, sizeof(key), "key_%d", i);
+            struct ctdb_leaf leaf = ctdb_get(&snap->trans, key, key_len);
+            assert(0 < leaf.value_len);
+            char *value = read_value_from_file(snap->trans.db->fd, leaf.value_len, leaf.value_pos);
+            assert(NULL != value && 0 == strncmp(value, "old", 3));
+            free(value);
+        }
+    }
+    ctdb_snapshot_release(&snap);
+    return NULL;
+}
+
+void snapshot_test() {
+    char *path = "./test.db";
+    struct ctdb *db = ctdb_open(path);
+    assert(NULL != db);
+
+    struct ctdb_transaction *trans = ctdb_transaction_begin(db);
+    assert(NULL != trans);
+    int i = 0;
+    for (; i < KEYS; i++) {
+        char key[16];
+        int key_len = snprintf(key, sizeof(key), "key_%d", i);
+        assert(CTDB_OK == ctdb_put(trans, key, key_len, "old", 3));
+    }
+    assert(CTDB_OK == ctdb_transaction_commit(trans));
+    uint64_t first_tran_count = trans->footer.tran_count;
+    ctdb_transaction_free(&trans);
+
+    //one snapshot, shared by all the readers
+    struct ctdb_snapshot *snap = ctdb_snapshot_acquire(db);
+    assert(NULL != snap);
+    assert(CTDB_ERR == ctdb_put(&snap->trans, "key_0", 5, "new", 3));  //read-only
+
+    pthread_t threads[READERS];
+    for (i = 0; i < READERS; i++) {
+        assert(0 == pthread_create(&threads[i], NULL, reader, ctdb_snapshot_retain(snap)));
+    }
+
+    //the writer commits new roots while the readers are running
+    for (i = 0; i < KEYS; i++) {
+        char key[16];
+        int key_len = snprintf(key, sizeof(key), "key_%d", i);
+        assert(NULL != (trans = ctdb_transaction_begin(db)));
+        assert(CTDB_OK == ctdb_put(trans, key, key_len, "new", 3));
+        assert(CTDB_OK == ctdb_transaction_commit(trans));
+        ctdb_transaction_free(&trans);
+    }
+
+    uint64_t oldest = 0;
+    assert(CTDB_OK == ctdb_oldest_snapshot(db, &oldest));
+    assert(first_tran_count == oldest);
+    ctdb_snapshot_release(&snap);
+
+    for (i = 0; i < READERS; i++) {
+        assert(0 == pthread_join(threads[i], NULL));
+    }
+    assert(CTDB_ERR == ctdb_oldest_snapshot(db, &oldest));  //all released
+
+    //a new snapshot sees the last commit
+    assert(NULL != (snap = ctdb_snapshot_acquire(db)));
+    struct ctdb_leaf leaf = ctdb_get(&snap->trans, "key_0", 5);
+    char *value = read_value_from_file(db->fd, leaf.value_len, leaf.value_pos);
+    assert(NULL != value && 0 == strncmp(value, "new", 3));
+    free(value);
+    snap->pinned = CTDB_PIN_ANNOUNCED;  //as while it is acquired, before the root is read
+    assert(CTDB_OK == ctdb_oldest_snapshot(db, &oldest));
+    assert(snap->trans.footer.tran_count == oldest);  //the last committed one
+    ctdb_snapshot_release(&snap);
+
+    printf("snapshot sucess, readers:%d keys:%d oldest:%lu\n", READERS, KEYS, oldest);
+    ctdb_close(&db);
+}
+
+int main(){
+    snapshot_test();
+
+    printf("over\n");
+    return 0;
+}
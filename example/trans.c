@@ -132,11 +132,165 @@ void transction_test2() {
     ctdb_close(&db);
 }
 
+/*
+    Read the old versions back, after the tests above
+*/
+void history_test() __attribute__((unused));
+void history_test() {
+    char *path = "./test.db";
+    struct ctdb *db = ctdb_open(path);
+    assert(NULL != db);
+
+    int commits = 0;
+    uint64_t last_tran_count = UINT64_MAX;
+    off_t pos_at[8] = {0};  //the newest footer of each tran_count
+    assert(CTDB_OK == ctdb_history(db, ({
+            int __nested_func_ptr__(struct ctdb_footer footer) {
+                assert(footer.tran_count <= last_tran_count);  //the newest first
+                last_tran_count = footer.tran_count;
+                if (footer.tran_count < 8 && 0 == pos_at[footer.tran_count]) pos_at[footer.tran_count] = footer.pos;
+                commits++;
+                return CTDB_OK;
+            }
+            __nested_func_ptr__;
+        })));
+    assert(6 == commits);  //the empty file, 3 + 2 commits
+
+    char *value = NULL;
+    struct ctdb_transaction *trans = ctdb_transaction_begin_at(db, pos_at[3]);
+    assert(NULL != trans);
+    struct ctdb_leaf leaf = ctdb_get(trans, "app", 3);
+    assert(NULL != (value = read_value_from_file(db->fd, leaf.value_len, leaf.value_pos)));
+    assert(9 == leaf.value_len && 0 == strncmp(value, "app_value", 9));
+    free(value);
+    assert(CTDB_ERR == ctdb_put(trans, "app", 3, "app", 3));  //read-only
+    ctdb_transaction_free(&trans);
+
+    assert(NULL != (trans = ctdb_transaction_begin_at(db, pos_at[4])));
+    leaf = ctdb_get(trans, "app", 3);
+    assert(NULL != (value = read_value_from_file(db->fd, leaf.value_len, leaf.value_pos)));
+    printf("app at 4: %.*s\n", leaf.value_len, value);
+    assert(13 == leaf.value_len && 0 == strncmp(value, "app_new_value", 13));
+    free(value);
+    ctdb_transaction_free(&trans);
+    assert(NULL == ctdb_transaction_begin_at(db, pos_at[4] + 1));  //not a footer of the history
+    ctdb_close(&db);
+}
+
+/*
+    Pipelined commits, each transaction begins on the root of the one before it, durable or not
+*/
+void async_test(int count) __attribute__((unused));
+void async_test(int count) {
+    char *path = "./test_async.db";
+    char key[32];
+    int key_len = 0, i = 0;
+    uint64_t ticket = 0, last_ticket = 0;
+    struct ctdb *db = ctdb_open(path);
+    assert(NULL != db);
+    assert(CTDB_ERR == ctdb_wait_durable(db, 1));  //nothing pipelined yet
+
+    struct ctdb_transaction *trans = NULL;
+    for (i = 0; i < count; i++) {
+        assert(NULL != (trans = ctdb_transaction_begin(db)));
+        assert(i == trans->footer.tran_count);
+        if (0 < i) {
+            key_len = snprintf(key, sizeof(key), "async_%d", i - 1);
+            assert(key_len == ctdb_get(trans, key, key_len).value_len);  //the last commit, maybe not durable yet
+        }
+        key_len = snprintf(key, sizeof(key), "async_%d", i);
+        assert(CTDB_OK == ctdb_put(trans, key, key_len, key, key_len));
+        assert(CTDB_OK == ctdb_transaction_commit_async(trans, &ticket));
+        assert(last_ticket < ticket);
+        last_ticket = ticket;
+        ctdb_transaction_free(&trans);
+    }
+    assert(CTDB_OK == ctdb_wait_durable(db, last_ticket));
+    struct ctdb_stats stats;
+    assert(CTDB_OK == ctdb_get_stats(db, &stats));
+    printf("async: %d commits, %lu syncs\n", count, stats.fsyncs - 1);  //the one that created the file
+
+    //a plain commit waits behind the pipeline
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    assert(CTDB_OK == ctdb_put(trans, "async_last", 10, "last", 4));
+    assert(CTDB_OK == ctdb_transaction_commit_async(trans, &ticket));
+    ctdb_transaction_free(&trans);
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    assert(CTDB_OK == ctdb_del(trans, "async_0", 7));
+    assert(CTDB_OK == ctdb_transaction_commit(trans));
+    ctdb_transaction_free(&trans);
+    assert(CTDB_OK == ctdb_wait_durable(db, ticket));
+    ctdb_close(&db);
+
+    assert(NULL != (db = ctdb_open(path)));
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    assert(count + 2 == trans->footer.tran_count);
+    for (i = 1; i < count; i++) {
+        key_len = snprintf(key, sizeof(key), "async_%d", i);
+        assert(key_len == ctdb_get(trans, key, key_len).value_len);
+    }
+    assert(0 == ctdb_get(trans, "async_0", 7).value_len);
+    assert(4 == ctdb_get(trans, "async_last", 10).value_len);
+    ctdb_transaction_free(&trans);
+
+    int commits = 0;
+    assert(CTDB_OK == ctdb_history(db, ({
+            int __nested_func_ptr__(struct ctdb_footer footer) {
+                commits++;
+                return CTDB_OK;
+            }
+            __nested_func_ptr__;
+        })));
+    assert(count + 3 == commits);  //every footer is chained, the empty file included
+    ctdb_close(&db);
+}
+
+/*
+    A transaction that began before another one committed is not committed over it, even without puts
+*/
+void stale_test() __attribute__((unused));
+void stale_test() {
+    char *path = "./test_stale.db";
+    struct ctdb *db = ctdb_open(path);
+    assert(NULL != db);
+    struct ctdb_transaction *trans_a = ctdb_transaction_begin(db);
+    struct ctdb_transaction *trans_b = ctdb_transaction_begin(db);
+    assert(NULL != trans_a && NULL != trans_b);
+    assert(CTDB_OK == ctdb_put(trans_b, "b", 1, "b_value", 7));
+    assert(CTDB_OK == ctdb_transaction_commit(trans_b));
+    assert(CTDB_ERR == ctdb_transaction_commit(trans_a));
+    ctdb_transaction_free(&trans_a);
+    ctdb_transaction_free(&trans_b);
+
+    assert(NULL != (trans_a = ctdb_transaction_begin(db)));
+    assert(7 == ctdb_get(trans_a, "b", 1).value_len);
+    assert(CTDB_OK == ctdb_transaction_commit(trans_a));  //not stale, the footer is written
+    ctdb_transaction_free(&trans_a);
+
+    //both put, the writer lock of the handle is shared, the second commit is refused
+    assert(NULL != (trans_a = ctdb_transaction_begin(db)));
+    assert(NULL != (trans_b = ctdb_transaction_begin(db)));
+    assert(CTDB_OK == ctdb_put(trans_a, "k1", 2, "v1", 2));
+    assert(CTDB_OK == ctdb_put(trans_b, "k2", 2, "v2", 2));
+    assert(CTDB_OK == ctdb_transaction_commit(trans_a));
+    assert(CTDB_ERR == ctdb_transaction_commit(trans_b));
+    ctdb_transaction_free(&trans_a);
+    ctdb_transaction_free(&trans_b);
+    assert(NULL != (trans_a = ctdb_transaction_begin(db)));
+    assert(2 == ctdb_get(trans_a, "k1", 2).value_len);
+    assert(0 == ctdb_get(trans_a, "k2", 2).value_len);
+    ctdb_transaction_free(&trans_a);
+    ctdb_close(&db);
+}
+
 int main(){
     srand(time(NULL));
     
     transction_test();
     transction_test2();
+    history_test();
+    async_test(1000);
+    stale_test();
 
     printf("over\n");
     return 0;
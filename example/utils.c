@@ -77,8 +77,7 @@ char *random_str_num(int len) {
 char *read_value_from_file(int fd, uint32_t value_len, off_t value_pos) {
     char *value = calloc(1, value_len);
     if (NULL == value) goto err;
-    if (-1 == lseek(fd, value_pos, SEEK_SET)) goto err;
-    if (value_len != read(fd, value, value_len)) goto err;
+    if (value_len != pread(fd, value, value_len, value_pos)) goto err;  //the fd may be shared by threads
     return value;
 
 err:
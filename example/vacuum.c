@@ -79,7 +79,7 @@ void test_iter() {
     assert(NULL != trans);
     int g_iter_count = 0;
     int res = CTDB_FOREACH(trans, "", 0, 
-                (int fd, char *key, uint8_t key_len, struct ctdb_leaf leaf){
+                (int fd, char *key, uint16_t key_len, struct ctdb_leaf leaf){
                     g_iter_count += 1;
                     assert(0 < leaf.value_len);
                     assert(0 < leaf.value_pos);
@@ -100,11 +100,322 @@ void test_iter() {
     ctdb_close(&db);
 }
 
+//expired keys are invisible at once, and gone from the file after a vacuum
+void test_expire(int count) {
+    struct ctdb *db = ctdb_open("./test_expire.db");
+    assert(NULL != db);
+    struct ctdb_transaction *trans = ctdb_transaction_begin(db);
+    assert(NULL != trans);
+    int64_t now = time(NULL);
+    int i = 0;
+    for (; i < count; i++) {
+        char key[16];
+        int key_len = snprintf(key, sizeof(key), "expired_%d", i);
+        assert(CTDB_OK == ctdb_put_expire(trans, key, key_len, key, key_len, now - 1));
+        key_len = snprintf(key, sizeof(key), "later_%d", i);
+        assert(CTDB_OK == ctdb_put_expire(trans, key, key_len, key, key_len, now + 3600));
+        key_len = snprintf(key, sizeof(key), "never_%d", i);
+        assert(CTDB_OK == ctdb_put(trans, key, key_len, key, key_len));
+    }
+    assert(CTDB_OK == ctdb_transaction_commit(trans));
+    ctdb_transaction_free(&trans);
+
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    assert(0 == ctdb_get(trans, "expired_0", 9).value_len);
+    assert(now + 3600 == ctdb_get(trans, "later_0", 7).expire);
+    int g_iter_count = 0;
+    assert(CTDB_OK == CTDB_FOREACH(trans, "", 0, 
+                (int fd, char *key, uint16_t key_len, struct ctdb_leaf leaf){
+                    assert(0 != strncmp(key, "expired_", 8));
+                    g_iter_count += 1;
+                    return CTDB_OK; //continue 
+                }
+            ));
+    assert(2 * count == g_iter_count);
+    char rank_key[CTDB_MAX_KEY_LEN];
+    uint16_t rank_key_len = 0;
+    struct ctdb_leaf rank_leaf;
+    assert(CTDB_OK == ctdb_seek_rank(trans, "", 0, 0, rank_key, &rank_key_len, &rank_leaf));  //counted, expired: the next live key
+    assert(7 == rank_key_len && 0 == strncmp(rank_key, "later_0", 7) && 7 == rank_leaf.value_len);
+    assert(CTDB_ERR == ctdb_seek_rank(trans, "expired_", 8, 0, rank_key, &rank_key_len, &rank_leaf));
+
+    struct ctdb *new_db = ctdb_open("./test_expire_tmp.db");
+    assert(NULL != new_db);
+    assert(CTDB_OK == ctdb_vacuum(trans, new_db));
+    ctdb_transaction_free(&trans);
+
+    assert(NULL != (trans = ctdb_transaction_begin(new_db)));
+    uint64_t counted = 0;
+    assert(CTDB_OK == ctdb_count_prefix(trans, "", 0, &counted));
+    assert(2 * count == counted);  //the expired keys were dropped, not copied
+    assert(CTDB_OK == ctdb_count_prefix(trans, "expired_", 8, &counted) && 0 == counted);
+    assert(now + 3600 == ctdb_get(trans, "later_0", 7).expire);
+    printf("expire sucess, count:%d live:%lu\n", 3 * count, 2 * (uint64_t)count);
+    ctdb_transaction_free(&trans);
+    ctdb_close(&new_db);
+    ctdb_close(&db);
+}
+
+//the live bytes of the footer are exact for a file without expired keys, a vacuum copies just them
+void test_usage(int count) {
+    struct ctdb *db = ctdb_open("./test_usage.db");
+    assert(NULL != db);
+    int fired = 0;
+    struct ctdb_usage fired_usage;
+    assert(CTDB_OK == ctdb_set_vacuum_policy(db, 0.5, 0, ({
+            void __nested_func_ptr__(void *arg, struct ctdb *hook_db, struct ctdb_usage *usage) {
+                fired += 1;
+                fired_usage = *usage;
+            }
+            __nested_func_ptr__;
+        }), NULL));
+
+    struct ctdb_transaction *trans = NULL;
+    int round = 0;
+    for (; round < 4; round++) {  //overwrite everything, one commit per round
+        assert(NULL != (trans = ctdb_transaction_begin(db)));
+        int i = 0;
+        for (; i < count; i++) {
+            char key[32];
+            int key_len = snprintf(key, sizeof(key), "usage_%d", i);
+            if (3 == round && 0 == i % 4) {
+                assert(CTDB_OK == ctdb_del(trans, key, key_len));
+            } else {
+                assert(CTDB_OK == ctdb_put(trans, key, key_len, key, key_len));
+            }
+        }
+        assert(CTDB_OK == ctdb_transaction_commit(trans));
+        ctdb_transaction_free(&trans);
+    }
+    struct ctdb_usage usage;
+    assert(CTDB_OK == ctdb_usage(db, &usage));
+    assert(usage.file_bytes == usage.live_bytes + usage.dead_bytes);
+    assert(0.5 < usage.garbage_ratio);
+    assert(1 == fired && 0.5 <= fired_usage.garbage_ratio);  //once, at the crossing
+
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    struct ctdb *new_db = ctdb_open("./test_usage_tmp.db");
+    assert(NULL != new_db);
+    assert(CTDB_OK == ctdb_vacuum(trans, new_db));
+    ctdb_transaction_free(&trans);
+    struct ctdb_usage new_usage;
+    assert(CTDB_OK == ctdb_usage(new_db, &new_usage));
+    assert(usage.live_bytes == new_usage.live_bytes);
+    assert(new_usage.dead_bytes < CTDB_HEADER_SIZE + 4 * CTDB_FOOTER_SIZE);  //the header and the footers
+    printf("usage sucess, file:%lu live:%lu garbage:%.2f after vacuum:%lu\n", 
+            usage.file_bytes, usage.live_bytes, usage.garbage_ratio, new_usage.file_bytes);
+    ctdb_close(&new_db);
+    ctdb_close(&db);
+}
+
+//a segmented file rolls over at the size limit, the compactor empties the segments that are mostly garbage
+void test_segments(int count) {
+    struct ctdb *db = ctdb_open_segmented("./test_seg.db", 256 * 1024);
+    assert(NULL != db);
+    struct ctdb_transaction *trans = NULL;
+    char key[32], value[64];
+    int round = 0;
+    for (; round < 8; round++) {  //overwrite everything, one commit per round
+        assert(NULL != (trans = ctdb_transaction_begin(db)));
+        int i = 0;
+        for (; i < count; i++) {
+            int key_len = snprintf(key, sizeof(key), "seg_%d", i);
+            int value_len = snprintf(value, sizeof(value), "value_%d_%d", i, round);
+            assert(CTDB_OK == ctdb_put(trans, key, key_len, value, value_len));
+        }
+        assert(CTDB_OK == ctdb_transaction_commit(trans));
+        ctdb_transaction_free(&trans);
+    }
+    uint32_t tail_segment = db->tail_segment;
+    assert(2 < tail_segment);
+    struct ctdb_usage usage;
+    assert(CTDB_OK == ctdb_usage(db, &usage));
+    ctdb_close(&db);
+
+    assert(NULL != (db = ctdb_open("./test_seg.db")));  //the header knows it is segmented
+    assert(256 * 1024 == db->segment_size && tail_segment == db->tail_segment);
+    uint32_t compacted = 0;
+    struct ctdb *other = ctdb_open("./test_seg.db");
+    assert(NULL != other);
+    struct ctdb_transaction *readers[2] = {ctdb_transaction_begin(db), ctdb_transaction_begin(other)};
+    int j = 0;
+    for (; j < 2; j++) {  //an older root is still read, by this handle or another one: the data moves, nothing is emptied
+        assert(NULL != readers[j]);
+        assert(NULL != (trans = ctdb_transaction_begin(db)));
+        assert(CTDB_OK == ctdb_compact_segments(trans, 0.5, &compacted));
+        ctdb_transaction_free(&trans);
+        assert(0 == compacted);
+        ctdb_transaction_free(&readers[j]);
+    }
+    ctdb_close(&other);
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    assert(CTDB_OK == ctdb_compact_segments(trans, 0.5, &compacted));
+    ctdb_transaction_free(&trans);
+    assert(0 < compacted);
+    uint32_t segment = 1, unlinked = 0;
+    for (; segment < tail_segment; segment++) {
+        char seg_path[64];
+        snprintf(seg_path, sizeof(seg_path), CTDB_SEGMENT_FMT, "./test_seg.db", segment);
+        if (-1 == access(seg_path, F_OK)) unlinked++;
+    }
+    assert(compacted - 1 <= unlinked);  //segment 0 keeps the header
+    struct ctdb_usage compacted_usage;
+    assert(CTDB_OK == ctdb_usage(db, &compacted_usage));
+    assert(compacted_usage.file_bytes < usage.file_bytes && usage.live_bytes == compacted_usage.live_bytes);
+    ctdb_close(&db);
+
+    assert(NULL != (db = ctdb_open("./test_seg.db")));
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    int i = 0;
+    for (; i < count; i++) {
+        int key_len = snprintf(key, sizeof(key), "seg_%d", i);
+        int value_len = snprintf(value, sizeof(value), "value_%d_%d", i, round - 1);
+        struct ctdb_leaf leaf = ctdb_get(trans, key, key_len);
+        char read_value[64];
+        assert(value_len == leaf.value_len && CTDB_OK == ctdb_read_value(db, &leaf, read_value));
+        assert(0 == strncmp(value, read_value, value_len));
+    }
+    uint64_t counted = 0;
+    assert(CTDB_OK == ctdb_count_prefix(trans, "seg_", 4, &counted) && count == counted);
+    printf("segments sucess, segments:%u compacted:%u file:%lu -> %lu\n", 
+            tail_segment + 1, compacted, usage.file_bytes, compacted_usage.file_bytes);
+    ctdb_transaction_free(&trans);
+    ctdb_close(&db);
+}
+
+//the index answers the gets of the root it was built for, and a vacuum builds one for the new file
+void test_index(int count) {
+    char key[32];
+    int key_len = 0, i = 0;
+    struct ctdb *db = ctdb_open("./test_index.db");
+    assert(NULL != db);
+    struct ctdb_transaction *trans = ctdb_transaction_begin(db);
+    assert(NULL != trans);
+    for (i = 0; i < count; i++) {
+        key_len = snprintf(key, sizeof(key), "index_%d", i);
+        assert(CTDB_OK == ctdb_put(trans, key, key_len, key, key_len));
+    }
+    assert(CTDB_ERR == ctdb_build_index(trans));  //not committed yet
+    assert(CTDB_OK == ctdb_transaction_commit(trans));
+    ctdb_transaction_free(&trans);
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    assert(CTDB_OK == ctdb_build_index(trans));
+    ctdb_transaction_free(&trans);
+    ctdb_close(&db);
+
+    struct ctdb_stats stats;
+    assert(NULL != (db = ctdb_open("./test_index.db")));  //mapped again
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    for (i = 0; i < count; i++) {
+        key_len = snprintf(key, sizeof(key), "index_%d", i);
+        assert(key_len == ctdb_get(trans, key, key_len).value_len);
+    }
+    assert(0 == ctdb_get(trans, "index_missing", 13).value_len);
+    assert(CTDB_OK == ctdb_get_stats(db, &stats));
+    assert(count + 1 == stats.index_probes && 0 == stats.lookups);
+    ctdb_transaction_free(&trans);
+
+    //a newer root searches the trie
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    assert(CTDB_OK == ctdb_put(trans, "index_new", 9, "new", 3));
+    assert(CTDB_OK == ctdb_del(trans, "index_0", 7));
+    assert(CTDB_OK == ctdb_transaction_commit(trans));
+    ctdb_transaction_free(&trans);
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    assert(3 == ctdb_get(trans, "index_new", 9).value_len);
+    assert(0 == ctdb_get(trans, "index_0", 7).value_len);
+    assert(CTDB_OK == ctdb_get_stats(db, &stats));
+    assert(count + 1 == stats.index_probes && 2 == stats.lookups);
+
+    struct ctdb *new_db = ctdb_open("./test_index_tmp.db");
+    assert(NULL != new_db);
+    assert(CTDB_OK == ctdb_vacuum(trans, new_db));
+    ctdb_transaction_free(&trans);
+    ctdb_close(&new_db);
+    ctdb_close(&db);
+
+    assert(NULL != (db = ctdb_open("./test_index_tmp.db")));
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    assert(3 == ctdb_get(trans, "index_new", 9).value_len);
+    assert(0 == ctdb_get(trans, "index_0", 7).value_len);
+    assert(7 == ctdb_get(trans, "index_1", 7).value_len);
+    assert(CTDB_OK == ctdb_get_stats(db, &stats));
+    assert(3 == stats.index_probes && 0 == stats.lookups);
+    printf("index: %d keys, %lu probes\n", count, stats.index_probes);
+    ctdb_transaction_free(&trans);
+    ctdb_close(&db);
+}
+
+void test_packed(int count) {
+    char key[32];
+    int key_len = 0, i = 0;
+    struct ctdb *db = ctdb_open("./test_packed.db");
+    assert(NULL != db);
+    struct ctdb_transaction *trans = ctdb_transaction_begin(db);
+    assert(NULL != trans);
+    for (i = 0; i < count; i++) {  //the values are written in the order of 'i', not the order of the keys
+        key_len = snprintf(key, sizeof(key), "packed_%d", (i * 7919) % count);
+        assert(CTDB_OK == ctdb_put(trans, key, key_len, key, key_len));
+    }
+    assert(CTDB_OK == ctdb_transaction_commit(trans));
+    ctdb_transaction_free(&trans);
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    for (i = 0; i < count; i += 10) {
+        key_len = snprintf(key, sizeof(key), "packed_%d", i);
+        assert(CTDB_OK == ctdb_del(trans, key, key_len));
+    }
+    assert(CTDB_OK == ctdb_put_expire(trans, "packed_gone", 11, "gone", 4, time(NULL) - 1));
+    assert(CTDB_OK == ctdb_transaction_commit(trans));
+    ctdb_transaction_free(&trans);
+
+    struct ctdb *new_db = ctdb_open("./test_packed_tmp.db");
+    assert(NULL != new_db);
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    assert(CTDB_OK == ctdb_vacuum_packed(trans, new_db));
+    ctdb_transaction_free(&trans);
+    ctdb_close(&new_db);
+    ctdb_close(&db);
+
+    uint64_t prefix_count = 0;
+    assert(NULL != (db = ctdb_open("./test_packed_tmp.db")));
+    assert(NULL != (trans = ctdb_transaction_begin(db)));
+    for (i = 0; i < count; i++) {
+        key_len = snprintf(key, sizeof(key), "packed_%d", i);
+        struct ctdb_leaf leaf = ctdb_get(trans, key, key_len);
+        assert((0 == i % 10 ? 0 : key_len) == leaf.value_len);
+    }
+    assert(0 == ctdb_get(trans, "packed_gone", 11).value_len);
+    assert(CTDB_OK == ctdb_count_prefix(trans, "packed_", 7, &prefix_count));
+    assert(count - (count + 9) / 10 == prefix_count);
+    assert(CTDB_OK == ctdb_count_prefix(trans, "packed_1", 8, &prefix_count));
+
+    //the values follow each other in key order, the nodes come after them
+    off_t next_value_pos = 0;
+    uint64_t listed = 0;
+    assert(CTDB_OK == CTDB_FOREACH(trans, "packed_1", 8,
+            (int fd, char *key, uint16_t key_len, struct ctdb_leaf leaf){
+                assert(0 == next_value_pos || next_value_pos == leaf.value_pos);
+                next_value_pos = leaf.value_pos + leaf.value_len;
+                listed++;
+                return CTDB_OK;
+            }
+        ));
+    assert(prefix_count == listed);
+    printf("packed: %d keys, %lu under 'packed_1'\n", count, listed);
+    ctdb_transaction_free(&trans);
+    ctdb_close(&db);
+}
+
 int main(){
     srand(time(NULL));
 
     stress_put_testing_single_transaction(32, 2500);
     test_iter();
+    test_expire(100);
+    test_usage(1000);
+    test_segments(1000);
+    test_index(1000);
+    test_packed(1000);
     
     printf("over\n");
     return 0;
@@ -0,0 +1,465 @@
+/*
+ * 
+ * Copyright (c) 2021, Joel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "serializer.h"
+#include "ctdb.h"
+#include "shard.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// MANIFEST
+///////////////////////////////////////////////////////////////////////////////
+static int check_manifest_header(struct ctdb_sharded *sdb) {
+    char magic_str[CTDB_MAGIC_LEN + 1] = {[0 ... CTDB_MAGIC_LEN] = 0};
+    uint32_t version_num = 0, n_shards = 0, route_len = 0;
+    struct serializer ser = SERIALIZER_INIT(CTDB_MANIFEST_HEADER_SIZE);
+    if (CTDB_MANIFEST_HEADER_SIZE != pread(sdb->manifest_fd, ser.buf, ser.buf_len, 0)) return CTDB_ERR;
+    if (SERIALIZER_OK != SERIALIZER_READ_STR(ser, magic_str, CTDB_MAGIC_LEN) ||
+        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, version_num, uint32_t) ||
+        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, n_shards, uint32_t) ||
+        SERIALIZER_OK != SERIALIZER_READ_NUM(ser, route_len, uint32_t)) {
+        return CTDB_ERR;
+    }
+    if (0 == strncmp(magic_str, CTDB_MANIFEST_MAGIC_STR, CTDB_MAGIC_LEN) && CTDB_MANIFEST_VERSION_NUM == version_num &&
+        sdb->n_shards == n_shards && sdb->route_len == route_len) {  //the keys would be routed differently otherwise
+        return CTDB_OK;
+    }
+    return CTDB_ERR;
+}
+
+static int dump_manifest_header(struct ctdb_sharded *sdb) {
+    struct serializer ser = SERIALIZER_INIT(CTDB_MANIFEST_HEADER_SIZE);
+    if (SERIALIZER_OK != SERIALIZER_WRITE_STR(ser, CTDB_MANIFEST_MAGIC_STR, CTDB_MAGIC_LEN) ||
+        SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, CTDB_MANIFEST_VERSION_NUM, uint32_t) ||
+        SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, sdb->n_shards, uint32_t) ||
+        SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, sdb->route_len, uint32_t)) {
+        return CTDB_ERR;
+    }
+    if (CTDB_MANIFEST_HEADER_SIZE != pwrite(sdb->manifest_fd, ser.buf, ser.buf_len, 0)) return CTDB_ERR;
+    return CTDB_OK;
+}
+
+//two slots, a commit overwrites the older one, so a torn write always leaves the other intact
+static int load_manifest(struct ctdb_sharded *sdb, uint64_t *generation, struct ctdb_footer *footers) {
+    struct serializer ser = SERIALIZER_INIT(CTDB_MANIFEST_SLOT_SIZE * 2);
+    ssize_t read_len = pread(sdb->manifest_fd, ser.buf, ser.buf_len, CTDB_MANIFEST_HEADER_SIZE);
+    uint64_t best = 0;
+    int slot = 0;
+    for (; slot < 2 && (slot + 1) * CTDB_MANIFEST_SLOT_SIZE <= read_len; slot++) {
+        uint64_t slot_generation = 0, cksum = 0, sum = 0;
+        struct ctdb_footer slot_footers[CTDB_SHARD_MAX];
+        memset(slot_footers, 0, sizeof(slot_footers));  //the rest of the footer is not in the manifest
+        ser.offset = slot * CTDB_MANIFEST_SLOT_SIZE;
+        if (SERIALIZER_OK != SERIALIZER_READ_NUM(ser, slot_generation, uint64_t) ||
+            SERIALIZER_OK != SERIALIZER_READ_NUM(ser, cksum, uint64_t)) {
+            continue;
+        }
+        int i = 0;
+        for (; i < sdb->n_shards; i++) {
+            if (SERIALIZER_OK != SERIALIZER_READ_NUM(ser, slot_footers[i].tran_count, uint64_t) ||
+                SERIALIZER_OK != SERIALIZER_READ_NUM(ser, slot_footers[i].del_count, uint64_t) ||
+                SERIALIZER_OK != SERIALIZER_READ_NUM(ser, slot_footers[i].root_pos, int64_t)) {
+                break;
+            }
+            sum += slot_footers[i].tran_count + slot_footers[i].del_count + slot_footers[i].root_pos;
+        }
+        if (i != sdb->n_shards || 0 == slot_generation || cksum != ~(slot_generation + sum)) continue;  //CheckSum
+        if (slot_generation > best) {
+            best = slot_generation;
+            memcpy(footers, slot_footers, sdb->n_shards * sizeof(struct ctdb_footer));
+        }
+    }
+    if (0 == best) return CTDB_ERR;  //never committed
+    *generation = best;
+    return CTDB_OK;
+}
+
+static int dump_manifest(struct ctdb_sharded *sdb, uint64_t generation, struct ctdb_footer *footers) {
+    struct serializer ser = SERIALIZER_INIT(CTDB_MANIFEST_SLOT_SIZE);
+    uint64_t sum = 0;
+    int i = 0;
+    for (; i < sdb->n_shards; i++) {
+        sum += footers[i].tran_count + footers[i].del_count + footers[i].root_pos;
+    }
+    if (SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, generation, uint64_t) ||
+        SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, ~(generation + sum), uint64_t)) {
+        return CTDB_ERR;
+    }
+    for (i = 0; i < sdb->n_shards; i++) {
+        if (SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, footers[i].tran_count, uint64_t) ||
+            SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, footers[i].del_count, uint64_t) ||
+            SERIALIZER_OK != SERIALIZER_WRITE_NUM(ser, footers[i].root_pos, int64_t)) {
+            return CTDB_ERR;
+        }
+    }
+    off_t slot_pos = CTDB_MANIFEST_HEADER_SIZE + (generation % 2) * CTDB_MANIFEST_SLOT_SIZE;
+    if (CTDB_MANIFEST_SLOT_SIZE != pwrite(sdb->manifest_fd, ser.buf, ser.buf_len, slot_pos)) return CTDB_ERR;
+    if (-1 == fsync(sdb->manifest_fd)) return CTDB_ERR;
+    return CTDB_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// COMMEN
+///////////////////////////////////////////////////////////////////////////////
+static inline uint64_t hash_key(char *key, uint16_t key_len) {  //FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    int i = 0;
+    for (; i < key_len; i++) {
+        hash ^= (uint8_t)key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static int committed_footer(struct ctdb *db, struct ctdb_footer *footer) {
+    struct ctdb_transaction *trans = ctdb_transaction_begin(db);
+    if (NULL == trans) return CTDB_ERR;
+    *footer = trans->footer;
+    ctdb_transaction_free(&trans);
+    return CTDB_OK;
+}
+
+//a shard that committed ahead of the manifest gets the manifest root back, as a new footer (append only)
+static int revert_shard(struct ctdb *db, struct ctdb_footer *footer) {
+    struct ctdb_transaction trans = {.is_isvalid = 1, .is_forced = 1, .db = db, .footer = *footer};
+    struct ctdb_footer committed;
+    if (CTDB_OK != committed_footer(db, &committed)) return CTDB_ERR;
+    off_t pos = committed.pos;
+    while (0 < pos) {  //the newest footer of the history with the manifest root, the manifest keeps no live bytes nor filter
+        struct ctdb_transaction *old = ctdb_transaction_begin_at(db, pos);
+        if (NULL == old) break;
+        pos = old->footer.prev_pos;
+        if (old->footer.tran_count == footer->tran_count && old->footer.del_count == footer->del_count &&
+            old->footer.root_pos == footer->root_pos) {
+            trans.footer = old->footer;
+            pos = 0;
+        }
+        ctdb_transaction_free(&old);
+    }
+    return ctdb_transaction_commit(&trans);
+}
+
+static void *commit_part(void *arg) {
+    struct ctdb_sharded_part *part = arg;
+    part->commit_res = ctdb_transaction_commit(&(part->trans));
+    return NULL;
+}
+
+static void release_writer(struct ctdb_sharded *sdb) {
+    pthread_mutex_lock(&(sdb->writer_lock));
+    sdb->writer = NULL;
+    pthread_mutex_unlock(&(sdb->writer_lock));
+}
+
+static int sharded_writer_lock(struct ctdb_sharded_transaction *strans) {
+    int res = CTDB_OK;
+    struct ctdb_sharded *sdb = strans->sdb;
+    pthread_mutex_lock(&(strans->lock));
+    if (!strans->is_writer) {
+        uint64_t generation = 0;
+        struct ctdb_footer footers[CTDB_SHARD_MAX];
+        pthread_mutex_lock(&(sdb->writer_lock));
+        uint8_t is_taken = NULL != sdb->writer;
+        if (!is_taken) sdb->writer = strans;
+        pthread_mutex_unlock(&(sdb->writer_lock));
+        if (is_taken) {
+            res = CTDB_ERR;  //another transaction of this handle is the writer
+        } else if (-1 == flock(sdb->manifest_fd, LOCK_EX)) {
+            release_writer(sdb);
+            res = CTDB_ERR;
+        } else if (CTDB_OK != load_manifest(sdb, &generation, footers) || generation != strans->generation) {
+            flock(sdb->manifest_fd, LOCK_UN);  //another writer committed since the transaction began
+            release_writer(sdb);
+            strans->is_isvalid = 0;
+            res = CTDB_ERR;
+        } else {
+            strans->is_writer = 1;
+        }
+    }
+    pthread_mutex_unlock(&(strans->lock));
+    return res;
+}
+
+static void sharded_writer_unlock(struct ctdb_sharded_transaction *strans) {
+    if (!strans->is_writer) return;
+    strans->is_writer = 0;
+    flock(strans->sdb->manifest_fd, LOCK_UN);
+    release_writer(strans->sdb);
+}
+
+static inline int key_cmp(char *a, uint16_t a_len, char *b, uint16_t b_len) {
+    int cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    return 0 != cmp ? cmp : (int)a_len - (int)b_len;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// API
+///////////////////////////////////////////////////////////////////////////////
+struct ctdb_sharded *ctdb_sharded_open(char *dir, int n_shards, uint16_t route_len) {
+    char path[PATH_MAX];
+    struct ctdb_sharded *sdb = NULL;
+    if (NULL == dir || 0 >= n_shards || CTDB_SHARD_MAX < n_shards) goto err;
+    if (-1 == mkdir(dir, 0777) && EEXIST != errno) goto err;
+
+    sdb = calloc(1, sizeof(*sdb));
+    if (NULL == sdb) goto err;
+    pthread_mutex_init(&(sdb->writer_lock), NULL);
+    sdb->n_shards = n_shards;
+    sdb->route_len = route_len;
+    if (sizeof(path) <= snprintf(path, sizeof(path), "%s/%s", dir, CTDB_MANIFEST_NAME)) goto err;
+    sdb->manifest_fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (0 > sdb->manifest_fd) goto err;
+    if (-1 == flock(sdb->manifest_fd, LOCK_EX)) goto err;  //no writer while recovering
+
+    struct stat st;
+    if (-1 == fstat(sdb->manifest_fd, &st)) goto err;
+    if (0 == st.st_size) {
+        if (CTDB_OK != dump_manifest_header(sdb)) goto err;
+    } else {
+        if (CTDB_OK != check_manifest_header(sdb)) goto err;
+    }
+    int i = 0;
+    for (; i < n_shards; i++) {
+        if (sizeof(path) <= snprintf(path, sizeof(path), CTDB_SHARD_FILE_FMT, dir, i)) goto err;
+        if (NULL == (sdb->shards[i] = ctdb_open(path))) goto err;
+    }
+
+    uint64_t generation = 0;
+    struct ctdb_footer footers[CTDB_SHARD_MAX];
+    if (CTDB_OK != load_manifest(sdb, &generation, footers)) {  //new, the shards start from whatever they hold
+        for (i = 0; i < n_shards; i++) {
+            if (CTDB_OK != committed_footer(sdb->shards[i], &footers[i])) goto err;
+        }
+        if (CTDB_OK != dump_manifest(sdb, 1, footers)) goto err;
+    } else {
+        for (i = 0; i < n_shards; i++) {
+            struct ctdb_footer footer;
+            if (CTDB_OK != committed_footer(sdb->shards[i], &footer)) goto err;
+            if (footer.tran_count == footers[i].tran_count && footer.del_count == footers[i].del_count &&
+                footer.root_pos == footers[i].root_pos) {
+                continue;
+            }
+            if (CTDB_OK != revert_shard(sdb->shards[i], &footers[i])) goto err;  //the multi-shard commit did not finish
+        }
+    }
+    flock(sdb->manifest_fd, LOCK_UN);
+    return sdb;
+
+err:
+    ctdb_sharded_close(&sdb);
+    return NULL;
+}
+
+void ctdb_sharded_close(struct ctdb_sharded **sdb) {
+    if (NULL == sdb || NULL == *sdb) return;
+    int i = 0;
+    for (; i < (*sdb)->n_shards; i++) {
+        ctdb_close(&((*sdb)->shards[i]));
+    }
+    if (0 < (*sdb)->manifest_fd) 
+        close((*sdb)->manifest_fd);  //releases the lock as well
+    pthread_mutex_destroy(&((*sdb)->writer_lock));
+    free(*sdb);
+    *sdb = NULL;
+}
+
+int ctdb_shard_of(struct ctdb_sharded *sdb, char *key, uint16_t key_len) {
+    if (0 < sdb->route_len && sdb->route_len < key_len) key_len = sdb->route_len;
+    return hash_key(key, key_len) % sdb->n_shards;
+}
+
+struct ctdb_sharded_transaction *ctdb_sharded_begin(struct ctdb_sharded *sdb) {
+    if (NULL == sdb) return NULL;
+    struct ctdb_sharded_transaction *strans = calloc(1, sizeof(*strans));
+    if (NULL == strans) return NULL;
+    struct ctdb_footer footers[CTDB_SHARD_MAX];
+    if (CTDB_OK != load_manifest(sdb, &(strans->generation), footers)) {  //the roots that were committed together
+        free(strans);
+        return NULL;
+    }
+    strans->is_isvalid = 1;
+    strans->sdb = sdb;
+    pthread_mutex_init(&(strans->lock), NULL);
+    int i = 0;
+    for (; i < sdb->n_shards; i++) {
+        struct ctdb_sharded_part *part = &(strans->parts[i]);
+        pthread_mutex_init(&(part->lock), NULL);
+        struct ctdb_footer committed;
+        if (CTDB_OK == committed_footer(sdb->shards[i], &committed) && committed.tran_count == footers[i].tran_count &&
+            committed.del_count == footers[i].del_count && committed.root_pos == footers[i].root_pos) {
+            footers[i] = committed;  //with the live bytes and the filter
+        }
+        part->base = footers[i];
+        part->trans = (struct ctdb_transaction){.is_isvalid = 1, .db = sdb->shards[i], .footer = footers[i]};
+    }
+    return strans;
+}
+
+struct ctdb_leaf ctdb_sharded_get(struct ctdb_sharded_transaction *strans, char *key, uint16_t key_len, int *fd) {
+    if (NULL == strans || 1 != strans->is_isvalid || NULL == key) 
+        return (struct ctdb_leaf){.version = 0, .value_len = 0, .value_pos = -1};
+    struct ctdb_sharded_part *part = &(strans->parts[ctdb_shard_of(strans->sdb, key, key_len)]);
+    if (NULL != fd) *fd = part->trans.db->fd;
+    pthread_mutex_lock(&(part->lock));
+    struct ctdb_leaf leaf = ctdb_get(&(part->trans), key, key_len);
+    pthread_mutex_unlock(&(part->lock));
+    return leaf;
+}
+
+int ctdb_sharded_put(struct ctdb_sharded_transaction *strans, char *key, uint16_t key_len, char *value, uint32_t value_len) {
+    if (NULL == strans || 1 != strans->is_isvalid || NULL == key) return CTDB_ERR;
+    if (CTDB_OK != sharded_writer_lock(strans)) return CTDB_ERR;
+    struct ctdb_sharded_part *part = &(strans->parts[ctdb_shard_of(strans->sdb, key, key_len)]);
+    pthread_mutex_lock(&(part->lock));
+    int res = ctdb_put(&(part->trans), key, key_len, value, value_len);
+    if (CTDB_OK == res) part->is_dirty = 1;
+    pthread_mutex_unlock(&(part->lock));
+    return res;
+}
+
+int ctdb_sharded_del(struct ctdb_sharded_transaction *strans, char *key, uint16_t key_len) {
+    return ctdb_sharded_put(strans, key, key_len, "", 0);
+}
+
+int ctdb_sharded_commit(struct ctdb_sharded_transaction *strans) {
+    if (NULL == strans || 1 != strans->is_isvalid) return CTDB_ERR;
+    strans->is_isvalid = 0;
+    if (!strans->is_writer) return CTDB_OK;  //nothing was put
+    struct ctdb_sharded *sdb = strans->sdb;
+
+    //every dirty shard writes and syncs its own footer, in parallel
+    pthread_t threads[CTDB_SHARD_MAX];
+    uint8_t is_threaded[CTDB_SHARD_MAX] = {0};
+    int i = 0;
+    for (; i < sdb->n_shards; i++) {
+        struct ctdb_sharded_part *part = &(strans->parts[i]);
+        if (!part->is_dirty) {
+            ctdb_transaction_rollback(&(part->trans));
+            continue;
+        }
+        if (0 == pthread_create(&threads[i], NULL, commit_part, part)) {
+            is_threaded[i] = 1;
+        } else {
+            commit_part(part);
+        }
+    }
+    int res = CTDB_OK;
+    struct ctdb_footer footers[CTDB_SHARD_MAX];
+    for (i = 0; i < sdb->n_shards; i++) {
+        struct ctdb_sharded_part *part = &(strans->parts[i]);
+        if (is_threaded[i]) pthread_join(threads[i], NULL);
+        footers[i] = part->is_dirty ? part->trans.footer : part->base;
+        if (part->is_dirty && CTDB_OK != part->commit_res) res = CTDB_ERR;
+    }
+
+    //the manifest is the commit point of all the shards, still the one the transaction began from
+    uint64_t generation = 0;
+    struct ctdb_footer loaded[CTDB_SHARD_MAX];
+    if (CTDB_OK == res && (CTDB_OK != load_manifest(sdb, &generation, loaded) || generation != strans->generation)) res = CTDB_ERR;
+    if (CTDB_OK == res) res = dump_manifest(sdb, strans->generation + 1, footers);
+    if (CTDB_OK != res) {
+        for (i = 0; i < sdb->n_shards; i++) {
+            struct ctdb_sharded_part *part = &(strans->parts[i]);
+            if (part->is_dirty && CTDB_OK == part->commit_res) revert_shard(sdb->shards[i], &(part->base));
+        }
+    }
+    sharded_writer_unlock(strans);
+    return res;
+}
+
+void ctdb_sharded_rollback(struct ctdb_sharded_transaction *strans) {
+    if (NULL == strans) return;
+    strans->is_isvalid = 0;
+    int i = 0;
+    for (; i < strans->sdb->n_shards; i++) {
+        ctdb_transaction_rollback(&(strans->parts[i].trans));  //releases the writer lock of the shard
+    }
+    sharded_writer_unlock(strans);
+}
+
+void ctdb_sharded_free(struct ctdb_sharded_transaction **strans) {
+    if (NULL == strans || NULL == *strans) return;
+    ctdb_sharded_rollback(*strans);  //neither committed nor rolled back
+    int i = 0;
+    for (; i < (*strans)->sdb->n_shards; i++) {
+        pthread_mutex_destroy(&((*strans)->parts[i].lock));
+    }
+    pthread_mutex_destroy(&((*strans)->lock));
+    free(*strans);
+    *strans = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// iterator
+///////////////////////////////////////////////////////////////////////////////
+struct sharded_cursor{
+    uint8_t is_valid;
+    uint16_t key_len;
+    struct ctdb_leaf leaf;
+    char key[CTDB_MAX_KEY_LEN];
+};
+
+static void cursor_next(struct sharded_cursor *cursor, struct ctdb_transaction *trans, char *prefix, uint16_t prefix_len, uint8_t inclusive) {
+    cursor->is_valid = CTDB_OK == ctdb_next(trans, cursor->key, cursor->key_len, inclusive, cursor->key, &(cursor->key_len), &(cursor->leaf)) &&
+        prefix_len <= cursor->key_len && 0 == memcmp(cursor->key, prefix, prefix_len);  //past the prefix, the shard is done
+}
+
+int ctdb_sharded_travel(struct ctdb_sharded_transaction *strans, char *key, uint16_t key_len, ctdb_traversal *traversal) {
+    if (NULL == strans || 1 != strans->is_isvalid) return CTDB_ERR;
+    if (CTDB_MAX_KEY_LEN < key_len || (0 < key_len && NULL == key)) return CTDB_ERR;
+    struct ctdb_sharded *sdb = strans->sdb;
+    if (0 < sdb->route_len && sdb->route_len <= key_len) {  //the whole prefix lives in one shard
+        return ctdb_iterator_travel(&(strans->parts[ctdb_shard_of(sdb, key, key_len)].trans), key, key_len, traversal);
+    }
+
+    //k-way merge, one cursor per shard
+    struct sharded_cursor *cursors = calloc(sdb->n_shards, sizeof(struct sharded_cursor));
+    if (NULL == cursors) return CTDB_ERR;
+    int i = 0;
+    for (; i < sdb->n_shards; i++) {
+        if (0 < key_len) memcpy(cursors[i].key, key, key_len);
+        cursors[i].key_len = key_len;
+        cursor_next(&cursors[i], &(strans->parts[i].trans), key, key_len, 1);
+    }
+    int res = CTDB_OK;
+    while (1) {
+        int min = -1;
+        for (i = 0; i < sdb->n_shards; i++) {
+            if (!cursors[i].is_valid) continue;
+            if (0 > min || 0 > key_cmp(cursors[i].key, cursors[i].key_len, cursors[min].key, cursors[min].key_len)) min = i;
+        }
+        if (0 > min) break;  //all the shards are done
+        struct sharded_cursor *cursor = &cursors[min];
+        if (CTDB_OK != traversal(sdb->shards[min]->fd, cursor->key, cursor->key_len, cursor->leaf)) {
+            res = CTDB_ERR;  //the traversal operation has been cancelled
+            break;
+        }
+        cursor_next(cursor, &(strans->parts[min].trans), key, key_len, 0);
+    }
+    free(cursors);
+    return res;
+}
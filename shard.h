@@ -0,0 +1,92 @@
+/*
+ * 
+ * Copyright (c) 2021, Joel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __SHARD_H_
+#define __SHARD_H_
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "ctdb.h"
+
+#define CTDB_SHARD_MAX 64
+#define CTDB_SHARD_FILE_FMT "%s/shard_%03d.db"
+
+//manifest, the roots of all the shards that were committed together
+#define CTDB_MANIFEST_NAME "MANIFEST"
+#define CTDB_MANIFEST_MAGIC_STR "ctsm"
+#define CTDB_MANIFEST_VERSION_NUM 1
+#define CTDB_MANIFEST_HEADER_SIZE 32  //magic, version, n_shards, route_len
+#define CTDB_MANIFEST_SLOT_SIZE (CTDB_I64_LEN * 2 + CTDB_SHARD_MAX * CTDB_I64_LEN * 3)  //generation, cksum, the footer of every shard
+
+struct ctdb_sharded{
+    int n_shards;
+    uint16_t route_len;  //keys sharing their first 'route_len' bytes live in the same shard, 0 hashes the whole key
+    int manifest_fd;  //flock'ed by the writer
+    struct ctdb *shards[CTDB_SHARD_MAX];
+    pthread_mutex_t writer_lock;  //for 'writer'
+    struct ctdb_sharded_transaction *writer;  //the one transaction of this handle that holds the manifest lock (flock is per file)
+};
+
+struct ctdb_sharded_transaction{
+    uint8_t is_isvalid;
+    uint8_t is_writer;  //holds the manifest lock, taken by the first put
+    struct ctdb_sharded *sdb;
+    uint64_t generation;  //of the manifest the transaction began from
+    pthread_mutex_t lock;  //for 'is_writer'
+
+    struct ctdb_sharded_part{
+        pthread_mutex_t lock;  //puts to different shards run in parallel
+        uint8_t is_dirty;
+        int commit_res;
+        struct ctdb_footer base;  //the root in the manifest
+        struct ctdb_transaction trans;
+    } parts[CTDB_SHARD_MAX];
+};
+
+struct ctdb_sharded *ctdb_sharded_open(char *dir, int n_shards, uint16_t route_len);
+void ctdb_sharded_close(struct ctdb_sharded **sdb);
+int ctdb_shard_of(struct ctdb_sharded *sdb, char *key, uint16_t key_len);
+
+struct ctdb_sharded_transaction *ctdb_sharded_begin(struct ctdb_sharded *sdb);
+struct ctdb_leaf ctdb_sharded_get(struct ctdb_sharded_transaction *strans, char *key, uint16_t key_len, int *fd);  //'fd' of the shard holding the value
+int ctdb_sharded_put(struct ctdb_sharded_transaction *strans, char *key, uint16_t key_len, char *value, uint32_t value_len);
+int ctdb_sharded_del(struct ctdb_sharded_transaction *strans, char *key, uint16_t key_len);
+int ctdb_sharded_commit(struct ctdb_sharded_transaction *strans);
+void ctdb_sharded_rollback(struct ctdb_sharded_transaction *strans);
+void ctdb_sharded_free(struct ctdb_sharded_transaction **strans);
+
+//all the shards merged in key order, unless 'key' is long enough to be routed to one shard
+int ctdb_sharded_travel(struct ctdb_sharded_transaction *strans, char *key, uint16_t key_len, ctdb_traversal *traversal);
+#define CTDB_SHARDED_FOREACH(strans, key, key_len, function_body) \
+    ({ \
+        ctdb_sharded_travel((strans), (key), (key_len), \
+            ({ \
+                int __nested_func_ptr__ function_body \
+                __nested_func_ptr__; \
+            }) \
+        ); \
+    })
+
+#ifdef __cplusplus
+}
+#endif
+#endif